@@ -39,9 +39,13 @@ static void resolve_cb(
          case AVAHI_RESOLVER_FOUND: {
              char a[AVAHI_ADDRESS_STR_MAX], *t;
 
+             /* Our relays tell us about everybody else */
+             if (i->server->relay_mode)
+                 break;
+
              avahi_address_snprint(a, sizeof(a), address);
              t = g_strdup_printf("tcp:port=%u,host=%s", port, a);
-             lassi_server_connect(i->server,  t);
+             lassi_server_connect_async(i->server, t);
              g_free(t);
              break;
          }
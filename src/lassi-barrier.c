@@ -0,0 +1,189 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#include <glib.h>
+
+#include <X11/Xlib.h>
+#include <X11/extensions/Xfixes.h>
+#include <X11/extensions/XInput2.h>
+
+#include "lassi-barrier.h"
+
+/* Roughly a short but deliberate push */
+#define DEFAULT_PRESSURE 30
+#define DEFAULT_DWELL_MSEC 0
+
+static void destroy_barriers(LassiBarrierInfo *i) {
+    g_assert(i);
+
+    if (i->left_barrier)
+        XFixesDestroyPointerBarrier(i->display, i->left_barrier);
+
+    if (i->right_barrier)
+        XFixesDestroyPointerBarrier(i->display, i->right_barrier);
+
+    i->left_barrier = i->right_barrier = 0;
+}
+
+int lassi_barrier_init(LassiBarrierInfo *i, Display *display, Window root) {
+    XIEventMask mask;
+    unsigned char bits[XIMaskLen(XI_BarrierLeave)];
+    int event_base, error_base, major = 5, minor = 0;
+
+    g_assert(i);
+    g_assert(display);
+
+    memset(i, 0, sizeof(*i));
+    i->pressure_threshold = DEFAULT_PRESSURE;
+    i->dwell_msec = DEFAULT_DWELL_MSEC;
+
+    if (!XFixesQueryExtension(display, &event_base, &error_base) ||
+        !XFixesQueryVersion(display, &major, &minor) || major < 5) {
+        g_debug("XFixes 5 not supported, no pointer barriers.");
+        return -1;
+    }
+
+    if (!XQueryExtension(display, "XInputExtension", &i->xi_opcode, &event_base, &error_base)) {
+        g_debug("XInput not supported, no pointer barriers.");
+        return -1;
+    }
+
+    major = 2;
+    minor = 3;
+
+    if (XIQueryVersion(display, &major, &minor) != Success || major < 2 || (major == 2 && minor < 3)) {
+        g_debug("XInput 2.3 not supported, no pointer barriers.");
+        return -1;
+    }
+
+    memset(bits, 0, sizeof(bits));
+    XISetMask(bits, XI_BarrierHit);
+    XISetMask(bits, XI_BarrierLeave);
+
+    mask.deviceid = XIAllMasterDevices;
+    mask.mask_len = sizeof(bits);
+    mask.mask = bits;
+
+    XISelectEvents(display, root, &mask, 1);
+
+    i->display = display;
+    i->root = root;
+
+    g_debug("Using pointer barriers.");
+
+    return 0;
+}
+
+void lassi_barrier_done(LassiBarrierInfo *i) {
+    g_assert(i);
+
+    if (i->display)
+        destroy_barriers(i);
+
+    memset(i, 0, sizeof(*i));
+}
+
+void lassi_barrier_set_thresholds(LassiBarrierInfo *i, unsigned pressure, unsigned dwell_msec) {
+    g_assert(i);
+
+    i->pressure_threshold = pressure;
+    i->dwell_msec = dwell_msec;
+}
+
+void lassi_barrier_enable(LassiBarrierInfo *i, gboolean left, gboolean right, int width, int height) {
+    g_assert(i);
+    g_assert(i->display);
+
+    i->left_enabled = left;
+    i->right_enabled = right;
+
+    /* Barriers can't be moved, so they are created anew whenever the
+     * layout or the screen size changes. Both span the same part of the
+     * edge as the trigger windows would. The pointer may always leave
+     * the edge again. */
+    destroy_barriers(i);
+
+    if (left)
+        i->left_barrier = XFixesCreatePointerBarrier(i->display, i->root,
+                                                     0, height/20, 0, (height*19)/20,
+                                                     BarrierPositiveX, 0, NULL);
+
+    if (right)
+        i->right_barrier = XFixesCreatePointerBarrier(i->display, i->root,
+                                                      width, height/20, width, (height*19)/20,
+                                                      BarrierNegativeX, 0, NULL);
+
+    XFlush(i->display);
+}
+
+int lassi_barrier_handle_event(LassiBarrierInfo *i, XEvent *xe, gboolean *left, int *y) {
+    XGenericEventCookie *cookie;
+    XIBarrierEvent *be;
+    gboolean is_left;
+    double push;
+    int r = -1;
+
+    g_assert(i);
+    g_assert(xe);
+    g_assert(left);
+    g_assert(y);
+
+    cookie = &xe->xcookie;
+
+    if (!i->display || xe->type != GenericEvent || cookie->extension != i->xi_opcode)
+        return -1;
+
+    if (!XGetEventData(i->display, cookie))
+        return -1;
+
+    if (cookie->evtype != XI_BarrierHit && cookie->evtype != XI_BarrierLeave)
+        goto finish;
+
+    be = cookie->data;
+
+    if (!be->barrier || (be->barrier != i->left_barrier && be->barrier != i->right_barrier))
+        goto finish;
+
+    r = 0;
+
+    /* A new push, or the pointer moved away from the edge */
+    if (cookie->evtype == XI_BarrierLeave || be->eventid != i->event_id) {
+        i->event_id = be->eventid;
+        i->pressure = 0;
+        i->first_hit = be->time;
+    }
+
+    if (cookie->evtype == XI_BarrierLeave)
+        goto finish;
+
+    is_left = be->barrier == i->left_barrier;
+
+    /* Only the motion towards the edge counts */
+    push = is_left ? -be->dx : be->dx;
+
+    if (push > 0)
+        i->pressure += push;
+
+    if (i->pressure < i->pressure_threshold || be->time - i->first_hit < i->dwell_msec)
+        goto finish;
+
+    g_debug("Crossing %s edge at %.0f after pushing %.0f px for %lu ms, %.0f px/s",
+            is_left ? "left" : "right", be->root_y, i->pressure,
+            (unsigned long) (be->time - i->first_hit),
+            be->dtime > 0 ? push * 1000 / be->dtime : 0.0);
+
+    /* Don't hand over again before the next push */
+    i->pressure = 0;
+    i->first_hit = be->time;
+
+    *left = is_left;
+    *y = (int) be->root_y;
+    r = 1;
+
+finish:
+    XFreeEventData(i->display, cookie);
+    return r;
+}
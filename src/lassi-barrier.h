@@ -0,0 +1,40 @@
+#ifndef foolassibarrierhfoo
+#define foolassibarrierhfoo
+
+#include <glib.h>
+#include <X11/Xlib.h>
+#include <X11/extensions/Xfixes.h>
+#include <X11/extensions/XInput2.h>
+
+typedef struct LassiBarrierInfo LassiBarrierInfo;
+
+/* Pointer barriers along the screen edges that lead to another screen.
+ * The X server tells us how hard and how long the pointer is pushed
+ * against them, so that merely bumping into an edge doesn't hand the
+ * input over. */
+struct LassiBarrierInfo {
+    Display *display;
+    Window root;
+    int xi_opcode;
+
+    gboolean left_enabled, right_enabled;
+    PointerBarrier left_barrier, right_barrier;
+
+    /* How far and how long the pointer has to push */
+    unsigned pressure_threshold, dwell_msec;
+
+    /* The push in progress, the X server counts them */
+    BarrierEventID event_id;
+    double pressure;
+    Time first_hit;
+};
+
+int lassi_barrier_init(LassiBarrierInfo *i, Display *display, Window root);
+void lassi_barrier_done(LassiBarrierInfo *i);
+
+void lassi_barrier_set_thresholds(LassiBarrierInfo *i, unsigned pressure, unsigned dwell_msec);
+void lassi_barrier_enable(LassiBarrierInfo *i, gboolean left, gboolean right, int width, int height);
+
+int lassi_barrier_handle_event(LassiBarrierInfo *i, XEvent *xe, gboolean *left, int *y);
+
+#endif
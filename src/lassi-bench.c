@@ -0,0 +1,388 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/select.h>
+
+#include <glib.h>
+
+#include <X11/Xlib.h>
+#include <X11/keysym.h>
+#include <X11/extensions/XTest.h>
+#include <X11/extensions/record.h>
+
+/* Feeds synthetic input into the X server of one peer while input is
+ * redirected to another, and watches it arrive on the X server of the
+ * other peer with XRecord:
+ *
+ *   mango-lassi-bench --sender=:91 --receiver=:92 --mode=keys --count=2000
+ *
+ * Both X servers have to run on this machine, so that one clock serves
+ * for sending and receiving. src/lassi-bench.sh sets up two Xvfb servers
+ * with a mango-lassi on each and runs this. Events arrive in the order
+ * they were sent, the n-th event seen on the receiver is the n-th one we
+ * sent. */
+
+#define MODE_KEYS 0
+#define MODE_MOTION 1
+
+/* Give the motion of crossing the edge time to settle before counting */
+#define SETTLE_USEC (300*1000)
+
+/* Moved up and down, so that neither pointer ever reaches an edge */
+#define MOTION_STEP 4
+
+typedef struct Bench Bench;
+
+struct Bench {
+    Display *sender, *receiver, *data;
+    XRecordContext context;
+
+    int mode;
+    guint count;
+
+    gint64 *sent;
+    double *latency;
+    guint n_sent, n_received;
+
+    /* Any input at all seen on the receiver */
+    guint n_seen;
+    gint64 last_seen;
+};
+
+static gint64 now_usec(void) {
+    GTimeVal tv;
+
+    g_get_current_time(&tv);
+
+    return (gint64) tv.tv_sec * G_USEC_PER_SEC + tv.tv_usec;
+}
+
+static void record_cb(XPointer userdata, XRecordInterceptData *d) {
+    Bench *b = (Bench*) userdata;
+    int type;
+    gint64 now;
+
+    if (d->category != XRecordFromServer || d->data_len <= 0) {
+        XRecordFreeData(d);
+        return;
+    }
+
+    now = now_usec();
+    type = d->data[0] & 0x7f;
+
+    b->n_seen++;
+    b->last_seen = now;
+
+    if (b->n_received < b->n_sent &&
+        ((b->mode == MODE_KEYS && type == KeyPress) ||
+         (b->mode == MODE_MOTION && type == MotionNotify))) {
+
+        b->latency[b->n_received] = (double) (now - b->sent[b->n_received]) / 1000;
+        b->n_received++;
+    }
+
+    XRecordFreeData(d);
+}
+
+/* Handle whatever the receiver reported until the deadline */
+static void pump(Bench *b, gint64 until) {
+    int fd;
+
+    fd = ConnectionNumber(b->data);
+
+    for (;;) {
+        struct timeval tv;
+        fd_set fds;
+        gint64 wait;
+
+        XRecordProcessReplies(b->data);
+
+        wait = until - now_usec();
+
+        if (wait <= 0)
+            break;
+
+        FD_ZERO(&fds);
+        FD_SET(fd, &fds);
+        tv.tv_sec = wait / G_USEC_PER_SEC;
+        tv.tv_usec = wait % G_USEC_PER_SEC;
+
+        if (select(fd + 1, &fds, NULL, NULL, &tv) < 0)
+            break;
+    }
+}
+
+static int record_start(Bench *b, const char *display) {
+    XRecordClientSpec clients = XRecordAllClients;
+    XRecordRange *range;
+    int major, minor;
+
+    if (!(b->data = XOpenDisplay(display))) {
+        fprintf(stderr, "Failed to open %s.\n", display);
+        return -1;
+    }
+
+    if (!XRecordQueryVersion(b->receiver, &major, &minor)) {
+        fprintf(stderr, "%s doesn't support XRecord.\n", display);
+        return -1;
+    }
+
+    range = XRecordAllocRange();
+    range->device_events.first = KeyPress;
+    range->device_events.last = MotionNotify;
+
+    b->context = XRecordCreateContext(b->receiver, 0, &clients, 1, &range, 1);
+    XFree(range);
+
+    if (!b->context) {
+        fprintf(stderr, "Failed to create XRecord context.\n");
+        return -1;
+    }
+
+    /* The control connection has to see the context before the data
+     * connection may use it */
+    XSync(b->receiver, False);
+
+    if (!XRecordEnableContextAsync(b->data, b->context, record_cb, (XPointer) b)) {
+        fprintf(stderr, "Failed to enable XRecord context.\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Push the pointer against the edges of the sender until input shows up
+ * on the receiver, which depending on the layout is on either side */
+static int cross_edge(Bench *b, int timeout) {
+    int screen, w, h, left = 0;
+    gint64 deadline;
+
+    screen = DefaultScreen(b->sender);
+    w = DisplayWidth(b->sender, screen);
+    h = DisplayHeight(b->sender, screen);
+
+    deadline = now_usec() + (gint64) timeout * G_USEC_PER_SEC;
+
+    while (b->n_seen == 0) {
+
+        if (now_usec() >= deadline) {
+            fprintf(stderr, "No input arrived on the receiver within %i s, are both peers linked?\n", timeout);
+            return -1;
+        }
+
+        XTestFakeMotionEvent(b->sender, screen, w/2, h/2, 0);
+        XTestFakeMotionEvent(b->sender, screen, left ? 0 : w-1, h/2, 0);
+        XFlush(b->sender);
+
+        pump(b, now_usec() + G_USEC_PER_SEC/2);
+        left = !left;
+    }
+
+    /* Wait until the receiver is quiet again */
+    while (now_usec() - b->last_seen < SETTLE_USEC)
+        pump(b, b->last_seen + SETTLE_USEC);
+
+    return 0;
+}
+
+static void send_event(Bench *b, KeyCode keycode) {
+
+    b->sent[b->n_sent++] = now_usec();
+
+    if (b->mode == MODE_KEYS) {
+        XTestFakeKeyEvent(b->sender, keycode, True, 0);
+        XTestFakeKeyEvent(b->sender, keycode, False, 0);
+    } else
+        XTestFakeRelativeMotionEvent(b->sender, 0, b->n_sent & 1 ? MOTION_STEP : -MOTION_STEP, 0);
+
+    XFlush(b->sender);
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double*) a, y = *(const double*) b;
+
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static double percentile(const double *v, guint n, double p) {
+    guint k;
+
+    g_assert(n > 0);
+
+    k = (guint) (p * (n - 1) + 0.5);
+
+    return v[MIN(k, n - 1)];
+}
+
+static void report(Bench *b, gint64 start, gint64 end) {
+    double seconds;
+
+    seconds = (double) (end - start) / G_USEC_PER_SEC;
+
+    printf("%s: sent %u, received %u in %.3f s, %.1f events/s\n",
+           b->mode == MODE_KEYS ? "keys" : "motion",
+           b->n_sent, b->n_received, seconds,
+           seconds > 0 ? b->n_received / seconds : 0.0);
+
+    if (b->n_received == 0)
+        return;
+
+    qsort(b->latency, b->n_received, sizeof(double), compare_double);
+
+    printf("latency ms: min %.2f p50 %.2f p90 %.2f p99 %.2f max %.2f\n",
+           b->latency[0],
+           percentile(b->latency, b->n_received, 0.50),
+           percentile(b->latency, b->n_received, 0.90),
+           percentile(b->latency, b->n_received, 0.99),
+           b->latency[b->n_received - 1]);
+}
+
+int main(int argc, char *argv[]) {
+    gchar *sender = NULL, *receiver = NULL, *mode = NULL;
+    gint count = 1000, timeout = 10;
+    gdouble rate = 0;
+    GOptionEntry entries[] = {
+        {
+            "sender", 's', 0, G_OPTION_ARG_STRING, &sender,
+            "X display to feed input into", "DISPLAY"
+        },
+        {
+            "receiver", 'r', 0, G_OPTION_ARG_STRING, &receiver,
+            "X display the input is redirected to", "DISPLAY"
+        },
+        {
+            "mode", 'm', 0, G_OPTION_ARG_STRING, &mode,
+            "keys (default) or motion", "MODE"
+        },
+        {
+            "count", 'n', 0, G_OPTION_ARG_INT, &count,
+            "how many events to send, defaults to 1000", "N"
+        },
+        {
+            "rate", 0, 0, G_OPTION_ARG_DOUBLE, &rate,
+            "events per second, 0 for as fast as possible", "N"
+        },
+        {
+            "timeout", 't', 0, G_OPTION_ARG_INT, &timeout,
+            "how long to wait for the link and for stragglers, defaults to 10", "SECONDS"
+        },
+        {NULL, 0, 0, 0, NULL, NULL, NULL}
+    };
+    GOptionContext *context;
+    GError *error = NULL;
+    Bench b;
+    KeyCode keycode;
+    gint64 start, deadline;
+    int major, minor, event, error_base, ret = 1;
+
+    context = g_option_context_new("- measure input redirection between two X servers");
+    g_option_context_add_main_entries(context, entries, NULL);
+
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        fprintf(stderr, "%s\n", error->message);
+        g_error_free(error);
+        g_option_context_free(context);
+        return 1;
+    }
+
+    g_option_context_free(context);
+
+    memset(&b, 0, sizeof(b));
+
+    if (!sender || !receiver || count <= 0 || rate < 0 || timeout <= 0) {
+        fprintf(stderr, "Invalid arguments.\n");
+        goto finish;
+    }
+
+    if (!mode || strcmp(mode, "keys") == 0)
+        b.mode = MODE_KEYS;
+    else if (strcmp(mode, "motion") == 0)
+        b.mode = MODE_MOTION;
+    else {
+        fprintf(stderr, "Unknown mode %s.\n", mode);
+        goto finish;
+    }
+
+    b.count = (guint) count;
+    b.sent = g_new0(gint64, b.count);
+    b.latency = g_new0(double, b.count);
+
+    if (!(b.sender = XOpenDisplay(sender))) {
+        fprintf(stderr, "Failed to open %s.\n", sender);
+        goto finish;
+    }
+
+    if (!XTestQueryExtension(b.sender, &event, &error_base, &major, &minor)) {
+        fprintf(stderr, "%s doesn't support XTest.\n", sender);
+        goto finish;
+    }
+
+    if (!(b.receiver = XOpenDisplay(receiver))) {
+        fprintf(stderr, "Failed to open %s.\n", receiver);
+        goto finish;
+    }
+
+    if (record_start(&b, receiver) < 0)
+        goto finish;
+
+    if (cross_edge(&b, timeout) < 0)
+        goto finish;
+
+    keycode = XKeysymToKeycode(b.sender, XK_a);
+
+    start = now_usec();
+
+    while (b.n_sent < b.count) {
+
+        if (rate > 0)
+            pump(&b, start + (gint64) (b.n_sent * G_USEC_PER_SEC / rate));
+        else
+            XRecordProcessReplies(b.data);
+
+        send_event(&b, keycode);
+    }
+
+    /* Collect the rest, unless nothing arrives for a while */
+    deadline = now_usec() + (gint64) timeout * G_USEC_PER_SEC;
+
+    while (b.n_received < b.n_sent && now_usec() < deadline) {
+        guint n = b.n_received;
+
+        pump(&b, now_usec() + G_USEC_PER_SEC/10);
+
+        if (b.n_received > n)
+            deadline = now_usec() + (gint64) timeout * G_USEC_PER_SEC;
+    }
+
+    report(&b, start, b.last_seen);
+
+    ret = b.n_received == b.n_sent ? 0 : 2;
+
+finish:
+
+    if (b.context) {
+        XRecordDisableContext(b.receiver, b.context);
+        XRecordFreeContext(b.receiver, b.context);
+    }
+
+    if (b.data)
+        XCloseDisplay(b.data);
+
+    if (b.receiver)
+        XCloseDisplay(b.receiver);
+
+    if (b.sender)
+        XCloseDisplay(b.sender);
+
+    g_free(b.sent);
+    g_free(b.latency);
+    g_free(sender);
+    g_free(receiver);
+    g_free(mode);
+
+    return ret;
+}
@@ -0,0 +1,61 @@
+#!/bin/sh
+#
+# Runs two mango-lassi instances on Xvfb servers of their own and
+# measures how fast and how late input redirected from one arrives on
+# the other, e.g.
+#
+#   src/lassi-bench.sh --mode=keys --count=2000 --rate=500
+#   src/lassi-bench.sh --mode=motion --count=10000
+#
+# Arguments are passed on to mango-lassi-bench. Needs Xvfb, dbus-launch
+# and a running avahi-daemon, the instances find each other through it
+# like on a real network. Set BUILDDIR if building outside the source
+# tree and LASSI_ARGS to pass options like --trace to both instances.
+
+set -e
+
+top=$(cd "$(dirname "$0")/.." && pwd)
+builddir=${BUILDDIR:-$top}
+
+sender=${SENDER:-:91}
+receiver=${RECEIVER:-:92}
+
+tmp=$(mktemp -d)
+pids=
+
+cleanup() {
+    [ -n "$pids" ] && kill $pids 2>/dev/null
+    wait 2>/dev/null
+    rm -rf "$tmp"
+}
+
+trap cleanup EXIT INT TERM
+
+for d in $sender $receiver; do
+    Xvfb $d -screen 0 1280x1024x24 -nolisten tcp > "$tmp/Xvfb$d.log" 2>&1 &
+    pids="$pids $!"
+done
+
+# Give the X servers time to come up
+for i in 1 2 3 4 5 6 7 8 9 10; do
+    xdpyinfo -display $sender > /dev/null 2>&1 && xdpyinfo -display $receiver > /dev/null 2>&1 && break
+    sleep 1
+done
+
+# Separate configuration, so that neither instance picks up the layout
+# or clipboard policy of the user running the benchmark
+for d in $sender $receiver; do
+    mkdir -p "$tmp/config$d"
+    DISPLAY=$d XDG_CONFIG_HOME="$tmp/config$d" \
+        dbus-launch --exit-with-session "$builddir/mango-lassi" $LASSI_ARGS > "$tmp/mango-lassi$d.log" 2>&1 &
+    pids="$pids $!"
+done
+
+"$builddir/mango-lassi-bench" --sender=$sender --receiver=$receiver "$@" || {
+    ret=$?
+    echo "Logs of the sender:" >&2
+    cat "$tmp/mango-lassi$sender.log" >&2
+    echo "Logs of the receiver:" >&2
+    cat "$tmp/mango-lassi$receiver.log" >&2
+    exit $ret
+}
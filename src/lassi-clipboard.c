@@ -9,6 +9,16 @@
 
 #define LASSI_MARKER "application/x-mango-lassi-marker"
 
+/* Applications like to reassert their selections several times in a
+ * row, so we always wait this long for the dust to settle */
+#define COALESCE_MSEC 100
+
+typedef struct TargetsRequest {
+    LassiClipboardInfo *info;
+    gboolean primary;
+    guint serial;
+} TargetsRequest;
+
 #if !GTK_CHECK_VERSION(2,14,0)
 #define gtk_selection_data_get_data(sd)   ((sd)->data)
 #define gtk_selection_data_get_format(sd) ((sd)->format)
@@ -16,18 +26,52 @@
 #define gtk_selection_data_get_target(sd) ((sd)->target)
 #endif
 
+static gboolean targets_equal(char **a, char **b) {
+
+    if (!a || !b)
+        return FALSE;
+
+    for (; *a && *b; a++, b++)
+        if (strcmp(*a, *b))
+            return FALSE;
+
+    return !*a && !*b;
+}
+
+static void set_announced(LassiClipboardInfo *i, gboolean primary, char **targets) {
+    char ***announced;
+
+    g_assert(i);
+
+    announced = primary ? &i->primary_announced : &i->clipboard_announced;
+
+    g_strfreev(*announced);
+    *announced = targets ? g_strdupv(targets) : NULL;
+}
+
 static void targets_received(GtkClipboard *clipboard, GdkAtom *atoms, int n_atoms, gpointer userdata) {
     int j, k;
-    LassiClipboardInfo *i = userdata;
-    char **targets;
+    TargetsRequest *r = userdata;
+    LassiClipboardInfo *i;
+    char **targets = NULL;
+    gboolean primary;
 
     g_assert(clipboard);
-    g_assert(i);
+    g_assert(r);
+
+    i = r->info;
+    primary = r->primary;
 
     g_debug("recvd targs %p, %i", (void*) atoms, n_atoms);
 
+    /* The selection changed again while we were waiting */
+    if (r->serial != (primary ? i->primary_request : i->clipboard_request)) {
+        g_debug("Dropping superseded targets");
+        goto fail;
+    }
+
     if (!atoms)
-        return;
+        goto fail;
 
     targets = g_new0(char*, n_atoms+1);
 
@@ -50,7 +94,8 @@ static void targets_received(GtkClipboard *clipboard, GdkAtom *atoms, int n_atom
             strcmp(c, "LENGTH") == 0 ||
             strcmp(c, "TASK") == 0 ||
             strcmp(c, "MULTIPLE") == 0 ||
-            strcmp(c, "DRAWABLE") == 0) {
+            strcmp(c, "DRAWABLE") == 0 ||
+            !lassi_policy_target_allowed(&i->server->policy_info, primary, c)) {
             g_free(c);
             continue;
         }
@@ -58,25 +103,122 @@ static void targets_received(GtkClipboard *clipboard, GdkAtom *atoms, int n_atom
         targets[k++] = c;
     }
 
+    /* Nothing the policy lets us share. If the others still think we
+     * own what we announced before, give it back, pasting it would
+     * fail on their side now */
+    if (k == 0) {
+        if ((primary ? i->primary_announced : i->clipboard_announced) &&
+            lassi_server_return_clipboard(i->server, primary) >= 0)
+            set_announced(i, primary, NULL);
+
+        goto fail;
+    }
+
+    /* We still own it with the same targets, and the data itself is
+     * only fetched when somebody pastes */
+    if (targets_equal(targets, primary ? i->primary_announced : i->clipboard_announced)) {
+        g_debug("Selection reasserted, not announcing it again");
+        goto fail;
+    }
+
     g_debug("%p %i", (void*) targets, n_atoms);
-    lassi_server_acquire_clipboard(i->server, clipboard == i->primary, targets);
+    lassi_server_acquire_clipboard(i->server, primary, targets);
+    set_announced(i, primary, targets);
 
 fail:
     g_strfreev(targets);
+    g_free(r);
+}
+
+static void request_targets(LassiClipboardInfo *i, gboolean primary) {
+    TargetsRequest *r;
+
+    g_assert(i);
+
+    r = g_new(TargetsRequest, 1);
+    r->info = i;
+    r->primary = primary;
+    r->serial = primary ? ++i->primary_request : ++i->clipboard_request;
+
+    gtk_clipboard_request_targets(primary ? i->primary : i->clipboard, targets_received, r);
+}
+
+static void announce(LassiClipboardInfo *i, gboolean primary) {
+    g_assert(i);
+
+    if (primary ? i->primary_owned : i->clipboard_owned)
+        request_targets(i, primary);
+    else {
+        /* Supersede whatever request is still in flight */
+        if (primary)
+            i->primary_request++;
+        else
+            i->clipboard_request++;
+
+        if (lassi_server_return_clipboard(i->server, primary) >= 0)
+            set_announced(i, primary, NULL);
+    }
+}
+
+static gboolean announce_clipboard_cb(gpointer userdata) {
+    LassiClipboardInfo *i = userdata;
+
+    g_assert(i);
+
+    i->clipboard_announce_id = 0;
+    announce(i, FALSE);
+
+    return FALSE;
+}
+
+static gboolean announce_primary_cb(gpointer userdata) {
+    LassiClipboardInfo *i = userdata;
+
+    g_assert(i);
+
+    i->primary_announce_id = 0;
+    announce(i, TRUE);
+
+    return FALSE;
+}
+
+static void schedule_announce(LassiClipboardInfo *i, gboolean primary) {
+    guint *announce_id, msec;
+
+    g_assert(i);
+
+    msec = MAX(lassi_policy_debounce_msec(&i->server->policy_info, primary), COALESCE_MSEC);
+
+    /* Restart the timer on every change, only the state the selection
+     * finally settles in is announced */
+    announce_id = primary ? &i->primary_announce_id : &i->clipboard_announce_id;
+
+    if (*announce_id > 0)
+        g_source_remove(*announce_id);
+
+    *announce_id = g_timeout_add(msec, primary ? announce_primary_cb : announce_clipboard_cb, i);
 }
 
 static void owner_change(GtkClipboard *clipboard, GdkEventOwnerChange *event, gpointer userdata) {
     LassiClipboardInfo *i = userdata;
+    gboolean primary;
 
     g_assert(clipboard);
     g_assert(i);
 
     g_debug("owner change");
 
-    if (event->reason == GDK_OWNER_CHANGE_NEW_OWNER)
-        gtk_clipboard_request_targets(clipboard, targets_received, i);
+    primary = clipboard == i->primary;
+
+    if (!lassi_policy_selection_enabled(&i->server->policy_info, primary))
+        return;
+
+    if (primary)
+        i->primary_owned = event->reason == GDK_OWNER_CHANGE_NEW_OWNER;
     else
-        lassi_server_return_clipboard(i->server, clipboard == i->primary);
+        i->clipboard_owned = event->reason == GDK_OWNER_CHANGE_NEW_OWNER;
+
+    schedule_announce(i, primary);
 }
 
 static void get_func(GtkClipboard *clipboard, GtkSelectionData *sd, guint info, gpointer userdata) {
@@ -105,13 +247,23 @@ static void get_func(GtkClipboard *clipboard, GtkSelectionData *sd, guint info,
 
 static void clear_func(GtkClipboard *clipboard, gpointer userdata) {
     LassiClipboardInfo *i = userdata;
+    gboolean primary;
 
     g_assert(clipboard);
     g_assert(i);
 
     g_debug("clear");
 
-    gtk_clipboard_request_targets(clipboard, targets_received, i);
+    primary = clipboard == i->primary;
+
+    /* Somebody took the selection over from us, which is announced
+     * like any other change once it has settled */
+    if (primary)
+        i->primary_owned = TRUE;
+    else
+        i->clipboard_owned = TRUE;
+
+    schedule_announce(i, primary);
 }
 
 int lassi_clipboard_init(LassiClipboardInfo *i, LassiServer *s) {
@@ -137,6 +289,15 @@ int lassi_clipboard_init(LassiClipboardInfo *i, LassiServer *s) {
 void lassi_clipboard_done(LassiClipboardInfo *i) {
     g_assert(i);
 
+    if (i->clipboard_announce_id > 0)
+        g_source_remove(i->clipboard_announce_id);
+
+    if (i->primary_announce_id > 0)
+        g_source_remove(i->primary_announce_id);
+
+    g_strfreev(i->clipboard_announced);
+    g_strfreev(i->primary_announced);
+
     memset(i, 0, sizeof(*i));
 }
 
@@ -159,6 +320,9 @@ void lassi_clipboard_set(LassiClipboardInfo *i, gboolean primary, char *targets[
     e[j].target = (char*) LASSI_MARKER;
     e[j].info = j;
 
+    /* Somebody else owns it now */
+    set_announced(i, primary, NULL);
+
     g_debug("setting %i targets", n+1);
 
     b = gtk_clipboard_set_with_data(primary ? i->primary : i->clipboard, e, n+1, get_func, clear_func, i);
@@ -168,6 +332,8 @@ void lassi_clipboard_set(LassiClipboardInfo *i, gboolean primary, char *targets[
 void lassi_clipboard_clear(LassiClipboardInfo *i, gboolean primary) {
     g_assert(i);
 
+    set_announced(i, primary, NULL);
+
     gtk_clipboard_clear(primary ? i->primary : i->clipboard);
 }
 
@@ -10,6 +10,19 @@ struct LassiClipboardInfo {
     struct LassiServer *server;
 
     GtkClipboard *clipboard, *primary;
+
+    /* Pending announcements of a local selection change, see
+     * lassi_policy_debounce_msec(), and whether the selection had a new
+     * owner or was cleared */
+    guint clipboard_announce_id, primary_announce_id;
+    gboolean clipboard_owned, primary_owned;
+
+    /* Serial of the latest targets request, replies to older ones are
+     * dropped */
+    guint clipboard_request, primary_request;
+
+    /* What we told the others we own, NULL if somebody else owns it */
+    char **clipboard_announced, **primary_announced;
 };
 
 #include "lassi-server.h"
@@ -0,0 +1,105 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "lassi-clock.h"
+
+#define LOGICAL_BITS 16
+
+/* Peers whose clocks are further ahead than this drag ours along, which
+ * is harmless for ordering but worth knowing about */
+#define DRIFT_WARN_MSEC (60*1000)
+
+static guint64 physical_now(void) {
+    GTimeVal tv;
+
+    g_get_current_time(&tv);
+
+    return ((guint64) tv.tv_sec * 1000 + (guint64) tv.tv_usec / 1000) << LOGICAL_BITS;
+}
+
+int lassi_clock_init(LassiClockInfo *i, LassiServer *server) {
+    g_assert(i);
+    g_assert(server);
+
+    memset(i, 0, sizeof(*i));
+    i->server = server;
+
+    return 0;
+}
+
+void lassi_clock_done(LassiClockInfo *i) {
+    g_assert(i);
+
+    memset(i, 0, sizeof(*i));
+}
+
+guint64 lassi_clock_tick(LassiClockInfo *i) {
+    guint64 now;
+
+    g_assert(i);
+
+    now = physical_now();
+
+    /* Within the same millisecond, or while a peer's clock is ahead of
+     * ours, only the logical part moves on */
+    if (now > i->last)
+        i->last = now;
+    else
+        i->last++;
+
+    return i->last;
+}
+
+void lassi_clock_witness(LassiClockInfo *i, guint64 time) {
+    guint64 now;
+
+    g_assert(i);
+
+    now = physical_now();
+
+    if (time > now && ((time - now) >> LOGICAL_BITS) > DRIFT_WARN_MSEC)
+        g_debug("Peer clock is %llu ms ahead of ours.", (unsigned long long) ((time - now) >> LOGICAL_BITS));
+
+    if (time > i->last)
+        i->last = time;
+}
+
+void lassi_stamp_set(LassiStamp *s, guint64 time, const char *origin) {
+    char *o;
+
+    g_assert(s);
+
+    /* origin might point into s itself */
+    o = g_strdup(origin);
+    g_free(s->origin);
+
+    s->time = time;
+    s->origin = o;
+}
+
+void lassi_stamp_clear(LassiStamp *s) {
+    g_assert(s);
+
+    g_free(s->origin);
+
+    s->time = 0;
+    s->origin = NULL;
+}
+
+int lassi_stamp_compare(const LassiStamp *s, guint64 time, const char *origin) {
+    g_assert(s);
+    g_assert(origin);
+
+    /* Positive if (time, origin) is newer than s. Concurrent changes at
+     * the very same time are ordered by node id, so that every peer
+     * picks the same winner */
+    if (time != s->time)
+        return time > s->time ? 1 : -1;
+
+    return strcmp(origin, s->origin ? s->origin : "");
+}
@@ -0,0 +1,38 @@
+#ifndef foolassiclockhfoo
+#define foolassiclockhfoo
+
+#include <glib.h>
+
+typedef struct LassiClockInfo LassiClockInfo;
+typedef struct LassiStamp LassiStamp;
+struct LassiServer;
+
+/* A hybrid logical clock: wall clock milliseconds in the upper 48 bits,
+ * a counter for events within the same millisecond in the lower 16. It
+ * never runs backwards and is always ahead of every time we have seen */
+struct LassiClockInfo {
+    struct LassiServer *server;
+
+    guint64 last;
+};
+
+/* When and by whom a replicated state was last changed. A time of 0
+ * means the change came from a peer without a clock */
+struct LassiStamp {
+    guint64 time;
+    char *origin;
+};
+
+#include "lassi-server.h"
+
+int lassi_clock_init(LassiClockInfo *i, LassiServer *server);
+void lassi_clock_done(LassiClockInfo *i);
+
+guint64 lassi_clock_tick(LassiClockInfo *i);
+void lassi_clock_witness(LassiClockInfo *i, guint64 time);
+
+void lassi_stamp_set(LassiStamp *s, guint64 time, const char *origin);
+void lassi_stamp_clear(LassiStamp *s);
+int lassi_stamp_compare(const LassiStamp *s, guint64 time, const char *origin);
+
+#endif
@@ -0,0 +1,236 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <glib.h>
+#include <gdk/gdk.h>
+
+#include "lassi-geometry.h"
+
+LassiGeometry *lassi_geometry_new_from_screen(GdkScreen *screen) {
+    LassiGeometry *g;
+    int j;
+
+    g_assert(screen);
+
+    g = g_new0(LassiGeometry, 1);
+    g->width = gdk_screen_get_width(screen);
+    g->height = gdk_screen_get_height(screen);
+
+    g->n_monitors = gdk_screen_get_n_monitors(screen);
+    g->monitors = g_new(GdkRectangle, MAX(g->n_monitors, 1));
+
+    for (j = 0; j < g->n_monitors; j++)
+        gdk_screen_get_monitor_geometry(screen, j, &g->monitors[j]);
+
+    g->dpi = gdk_screen_get_resolution(screen);
+
+    if (g->dpi <= 0)
+        g->dpi = 96;
+
+    /* GTK+ 2 doesn't do scaling */
+    g->scale = 1;
+
+    return g;
+}
+
+LassiGeometry *lassi_geometry_new_from_parameters(GHashTable *parameters) {
+    LassiGeometry *g;
+    const char *w, *h, *t;
+
+    g_assert(parameters);
+
+    if (!(w = g_hash_table_lookup(parameters, "screen-width")) ||
+        !(h = g_hash_table_lookup(parameters, "screen-height")))
+        return NULL;
+
+    g = g_new0(LassiGeometry, 1);
+    g->width = atoi(w);
+    g->height = atoi(h);
+
+    if (g->width <= 0 || g->height <= 0) {
+        lassi_geometry_free(g);
+        return NULL;
+    }
+
+    /* "x,y,w,h;x,y,w,h;..." */
+    if ((t = g_hash_table_lookup(parameters, "monitors"))) {
+        char **rects, **r;
+
+        rects = g_strsplit(t, ";", 0);
+        g->monitors = g_new(GdkRectangle, g_strv_length(rects) + 1);
+
+        for (r = rects; *r; r++) {
+            GdkRectangle *m = &g->monitors[g->n_monitors];
+
+            if (sscanf(*r, "%i,%i,%i,%i", &m->x, &m->y, &m->width, &m->height) == 4 &&
+                m->width > 0 && m->height > 0)
+                g->n_monitors++;
+        }
+
+        g_strfreev(rects);
+    } else
+        g->monitors = g_new(GdkRectangle, 1);
+
+    /* Peers that don't tell us about monitors get one covering it all */
+    if (g->n_monitors == 0) {
+        g->monitors[0].x = g->monitors[0].y = 0;
+        g->monitors[0].width = g->width;
+        g->monitors[0].height = g->height;
+        g->n_monitors = 1;
+    }
+
+    g->dpi = (t = g_hash_table_lookup(parameters, "dpi")) ? g_ascii_strtod(t, NULL) : 96;
+    g->scale = (t = g_hash_table_lookup(parameters, "scale")) ? atoi(t) : 1;
+
+    if (g->dpi <= 0)
+        g->dpi = 96;
+
+    if (g->scale <= 0)
+        g->scale = 1;
+
+    return g;
+}
+
+void lassi_geometry_free(LassiGeometry *g) {
+    if (!g)
+        return;
+
+    g_free(g->monitors);
+    g_free(g);
+}
+
+void lassi_geometry_to_parameters(LassiGeometry *g, GHashTable *parameters) {
+    GString *s;
+    char t[G_ASCII_DTOSTR_BUF_SIZE];
+    int j;
+
+    g_assert(g);
+    g_assert(parameters);
+
+    g_hash_table_replace(parameters, g_strdup("screen-width"), g_strdup_printf("%i", g->width));
+    g_hash_table_replace(parameters, g_strdup("screen-height"), g_strdup_printf("%i", g->height));
+
+    s = g_string_new(NULL);
+
+    for (j = 0; j < g->n_monitors; j++)
+        g_string_append_printf(s, "%s%i,%i,%i,%i", j > 0 ? ";" : "",
+                               g->monitors[j].x, g->monitors[j].y,
+                               g->monitors[j].width, g->monitors[j].height);
+
+    g_hash_table_replace(parameters, g_strdup("monitors"), g_string_free(s, FALSE));
+
+    g_ascii_dtostr(t, sizeof(t), g->dpi);
+    g_hash_table_replace(parameters, g_strdup("dpi"), g_strdup(t));
+
+    g_hash_table_replace(parameters, g_strdup("scale"), g_strdup_printf("%i", g->scale));
+}
+
+static gboolean monitor_on_edge(LassiGeometry *g, int j, gboolean left_edge) {
+    g_assert(g);
+
+    return left_edge ? g->monitors[j].x <= 0 : g->monitors[j].x + g->monitors[j].width >= g->width;
+}
+
+static void edge_span(LassiGeometry *g, gboolean left_edge, int *top, int *bottom) {
+    int j;
+
+    g_assert(g);
+
+    *top = g->height;
+    *bottom = 0;
+
+    for (j = 0; j < g->n_monitors; j++) {
+        if (!monitor_on_edge(g, j, left_edge))
+            continue;
+
+        *top = MIN(*top, g->monitors[j].y);
+        *bottom = MAX(*bottom, g->monitors[j].y + g->monitors[j].height);
+    }
+
+    /* No monitor touches this edge, fall back to the whole screen */
+    if (*top >= *bottom) {
+        *top = 0;
+        *bottom = g->height;
+    }
+}
+
+int lassi_geometry_edge_to_global(LassiGeometry *g, gboolean left_edge, int y) {
+    int top, bottom;
+
+    g_assert(g);
+
+    /* Convert a position on the given edge into global coordinates
+     * (0 .. 65535), relative to the part of the edge that is actually
+     * covered by monitors */
+    edge_span(g, left_edge, &top, &bottom);
+
+    y = CLAMP(y, top, bottom - 1);
+
+    if (bottom - top <= 1)
+        return 0;
+
+    return ((y - top) * 0xFFFF) / (bottom - top - 1);
+}
+
+int lassi_geometry_edge_from_global(LassiGeometry *g, gboolean left_edge, int y) {
+    int top, bottom, best = -1, best_distance = G_MAXINT, j;
+
+    g_assert(g);
+    g_assert(y >= 0 && y <= 0xFFFF);
+
+    edge_span(g, left_edge, &top, &bottom);
+
+    y = top + (y * (bottom - top - 1)) / 0xFFFF;
+
+    /* Monitors on an edge may leave gaps between them, snap into the
+     * closest one so that the pointer doesn't end up off screen */
+    for (j = 0; j < g->n_monitors; j++) {
+        int d;
+
+        if (!monitor_on_edge(g, j, left_edge))
+            continue;
+
+        if (y < g->monitors[j].y)
+            d = g->monitors[j].y - y;
+        else if (y >= g->monitors[j].y + g->monitors[j].height)
+            d = y - (g->monitors[j].y + g->monitors[j].height - 1);
+        else
+            return y;
+
+        if (d < best_distance) {
+            best_distance = d;
+            best = j;
+        }
+    }
+
+    if (best >= 0)
+        y = y < g->monitors[best].y ? g->monitors[best].y : g->monitors[best].y + g->monitors[best].height - 1;
+
+    return CLAMP(y, 0, g->height - 1);
+}
+
+int lassi_geometry_edge_to_screen(LassiGeometry *g, gboolean left_edge, int y) {
+    g_assert(g);
+    g_assert(y >= 0 && y <= 0xFFFF);
+
+    /* Older peers map global coordinates onto the whole height of the
+     * screen, whatever the monitors along the edge cover */
+    y = lassi_geometry_edge_from_global(g, left_edge, y);
+
+    if (g->height <= 1)
+        return 0;
+
+    return (y * 0xFFFF) / (g->height - 1);
+}
+
+int lassi_geometry_screen_to_edge(LassiGeometry *g, gboolean left_edge, int y) {
+    g_assert(g);
+    g_assert(y >= 0 && y <= 0xFFFF);
+
+    return lassi_geometry_edge_to_global(g, left_edge, (y * (g->height - 1)) / 0xFFFF);
+}
@@ -0,0 +1,33 @@
+#ifndef foolassigeometryhfoo
+#define foolassigeometryhfoo
+
+#include <glib.h>
+#include <gdk/gdk.h>
+
+typedef struct LassiGeometry LassiGeometry;
+
+struct LassiGeometry {
+    int width, height;
+
+    int n_monitors;
+    GdkRectangle *monitors;
+
+    double dpi;
+    int scale;
+};
+
+LassiGeometry *lassi_geometry_new_from_screen(GdkScreen *screen);
+LassiGeometry *lassi_geometry_new_from_parameters(GHashTable *parameters);
+void lassi_geometry_free(LassiGeometry *g);
+
+void lassi_geometry_to_parameters(LassiGeometry *g, GHashTable *parameters);
+
+int lassi_geometry_edge_to_global(LassiGeometry *g, gboolean left_edge, int y);
+int lassi_geometry_edge_from_global(LassiGeometry *g, gboolean left_edge, int y);
+
+/* Between a position on the edge and one on the whole screen height, for
+ * peers without LASSI_CAPABILITY_EDGE_Y */
+int lassi_geometry_edge_to_screen(LassiGeometry *g, gboolean left_edge, int y);
+int lassi_geometry_screen_to_edge(LassiGeometry *g, gboolean left_edge, int y);
+
+#endif
@@ -15,49 +15,74 @@
 
 #include "lassi-server.h"
 #include "lassi-grab.h"
+#include "lassi-trace.h"
 
 #define TRIGGER_WIDTH 1
 
-static int local2global(LassiGrabInfo *i, int y) {
+#ifdef LASSI_XCB
+/* How long a key release waits for the press of an autorepeat that was
+ * split across two reads */
+#define RELEASE_HOLD_MSEC 10
+#endif
+
+static int local2global(LassiGrabInfo *i, gboolean left_edge, int y) {
     g_assert(i);
-    g_assert(y >= 0 && y <= gdk_screen_get_height(i->screen)-1);
+    g_assert(y >= 0 && y <= i->geometry->height-1);
 
-    /* Convert local screen coordinates (0 .. height) into global ones (0 . 65535) */
-    return (y * 0xFFFF) / (gdk_screen_get_height(i->screen)-1);
+    /* Convert local screen coordinates (0 .. height) into global ones
+     * (0 . 65535), relative to the monitors along that edge */
+    return lassi_geometry_edge_to_global(i->geometry, left_edge, y);
 }
 
-static int global2local(LassiGrabInfo *i, int y) {
+static int global2local(LassiGrabInfo *i, gboolean left_edge, int y) {
     g_assert(i);
     g_assert(y >= 0 && y <= 0xFFFF);
 
     /* Convert global screen coordinates (0 . 65535) into local ones (0 .. height) */
-    return (y * (gdk_screen_get_height(i->screen)-1)) / 0xFFFF;
+    return lassi_geometry_edge_from_global(i->geometry, left_edge, y);
 }
 
 static void move_pointer(LassiGrabInfo *i, int x, int y) {
     g_assert(i);
 
-    /* Move the pointer ... */
-    gdk_display_warp_pointer(i->display, i->screen, x, y);
+    /* Move the pointer ... unless we're replaying a recording, which
+     * already contains the effect of the warp */
+    if (!i->server->record_info.replaying)
+#ifdef LASSI_XCB
+        lassi_xcb_warp_pointer(&i->xcb_info, x, y);
+#else
+        gdk_display_warp_pointer(i->display, i->screen, x, y);
+#endif
 
     i->last_x = x;
     i->last_y = y;
 }
 
 static void drop_motion_events(LassiGrabInfo *i) {
+#ifndef LASSI_XCB
     XEvent txe;
+#endif
 
     g_assert(i);
 
     /* Drop all queued motion events */
+#ifdef LASSI_XCB
+    lassi_xcb_drop_motion(&i->xcb_info);
+#else
     while (XCheckTypedEvent(GDK_DISPLAY_XDISPLAY(i->display), MotionNotify, &txe))
         ;
+#endif
 }
 
 static int grab_input(LassiGrabInfo *i, GdkWindow *w) {
     g_assert(i);
     g_assert(w);
 
+#ifdef LASSI_XCB
+    /* Whether it worked turns up in xcb_cb() */
+    lassi_xcb_grab(&i->xcb_info, GDK_WINDOW_XID(w), gdk_x11_cursor_get_xcursor(i->empty_cursor));
+    lassi_xcb_grab_control(&i->xcb_info, FALSE);
+#else
     if (gdk_pointer_grab(w, TRUE,
                          GDK_POINTER_MOTION_MASK|
                          GDK_BUTTON_PRESS_MASK|GDK_BUTTON_RELEASE_MASK,
@@ -74,6 +99,7 @@ static int grab_input(LassiGrabInfo *i, GdkWindow *w) {
     }
 
     XTestGrabControl(GDK_DISPLAY_XDISPLAY(i->display), False);
+#endif
 
     if (i->grab_window != w) {
         /* Now, rebase the pointer, so that we can easily calculate
@@ -83,8 +109,13 @@ static int grab_input(LassiGrabInfo *i, GdkWindow *w) {
         i->grab_window = w;
 
         i->left_shift = i->right_shift = i->double_shift = FALSE;
+        i->real_left_shift = i->real_right_shift = i->real_double_shift = FALSE;
+        g_hash_table_remove_all(i->keys_down);
+        i->buttons_down = 0;
 
         g_debug("Input now grabbed");
+
+        lassi_record_grab_started(&i->server->record_info);
     }
 
     return 0;
@@ -108,12 +139,12 @@ void lassi_grab_stop(LassiGrabInfo *i, int y) {
     if (y >= 0 && y < 0xFFFF) {
 
         /* We received a valid y coordinate, so let's use it */
-        y = global2local(i, y);
+        y = global2local(i, i->grab_window == i->left_window, y);
 
         if (i->grab_window == i->left_window)
             x = TRIGGER_WIDTH;
         else
-            x = gdk_screen_get_width(i->screen)-TRIGGER_WIDTH-1;
+            x = i->geometry->width-TRIGGER_WIDTH-1;
 
     } else {
 
@@ -125,22 +156,65 @@ void lassi_grab_stop(LassiGrabInfo *i, int y) {
 
     move_pointer(i, x, y);
 
+#ifdef LASSI_XCB
+    lassi_xcb_ungrab(&i->xcb_info);
+#else
     gdk_display_keyboard_ungrab(i->display, GDK_CURRENT_TIME);
     gdk_display_pointer_ungrab(i->display, GDK_CURRENT_TIME);
+#endif
 
     drop_motion_events(i);
 
     i->grab_window = NULL;
+    g_hash_table_remove_all(i->keys_down);
+    i->buttons_down = 0;
 
     g_debug("Input now ungrabbed");
 
+#ifdef LASSI_XCB
+    lassi_xcb_grab_control(&i->xcb_info, TRUE);
+#else
     XTestGrabControl(GDK_DISPLAY_XDISPLAY(i->display), True);
+#endif
+}
+
+static gboolean next_queued_motion(LassiGrabInfo *i, int *x, int *y) {
+#ifdef LASSI_XCB
+    xcb_motion_notify_event_t *me;
+#else
+    XEvent txe;
+#endif
+
+    g_assert(i);
+
+    if (i->server->record_info.replaying)
+        return lassi_record_next_drained(&i->server->record_info, x, y);
+
+#ifdef LASSI_XCB
+    if (!(me = (xcb_motion_notify_event_t*) lassi_xcb_poll_motion(&i->xcb_info)))
+        return FALSE;
+
+    *x = me->root_x;
+    *y = me->root_y;
+
+    free(me);
+#else
+    if (!XCheckTypedEvent(GDK_DISPLAY_XDISPLAY(i->display), MotionNotify, &txe))
+        return FALSE;
+
+    *x = txe.xmotion.x;
+    *y = txe.xmotion.y;
+#endif
+
+    lassi_record_event(&i->server->record_info, LASSI_RECORD_MOTION_DRAINED, *x, *y, 0, FALSE);
+
+    return TRUE;
 }
 
 static void handle_motion(LassiGrabInfo *i, int x, int y) {
     int dx, dy;
     int r;
-    int w, h;
+    int qx, qy;
 
     dx = x - i->last_x;
     dy = y - i->last_y;
@@ -148,29 +222,22 @@ static void handle_motion(LassiGrabInfo *i, int x, int y) {
     i->last_x = x;
     i->last_y = y;
 
-/*     g_debug("rel motion %i %i", dx, dy); */
-
-    w = gdk_screen_get_width(i->screen);
-    h = gdk_screen_get_height(i->screen);
-
-    if (x <= w/10 || y <= h/10 ||
-        x >= (w*9)/10 || y >= (h*9)/10) {
-
-        XEvent txe;
+    if (x <= i->recenter_left || y <= i->recenter_top ||
+        x >= i->recenter_right || y >= i->recenter_bottom) {
 
         /* Pointer is too near to the edges, move cursor
          * back to center, so that further movements are
          * not clipped */
 
-        g_debug("centering");
+        lassi_trace(LASSI_TRACE_RECENTER, x, y, 0);
 
         /* First, make sure there is no further motion event in the queue */
-        while (XCheckTypedEvent(GDK_DISPLAY_XDISPLAY(i->display), MotionNotify, &txe)) {
-            dx += txe.xmotion.x - i->last_x;
-            dy += txe.xmotion.y - i->last_y;
+        while (next_queued_motion(i, &qx, &qy)) {
+            dx += qx - i->last_x;
+            dy += qy - i->last_y;
 
-            i->last_x = txe.xmotion.x;
-            i->last_y = txe.xmotion.y;
+            i->last_x = qx;
+            i->last_y = qy;
         }
 
         move_pointer(i, i->base_x, i->base_y);
@@ -178,9 +245,7 @@ static void handle_motion(LassiGrabInfo *i, int x, int y) {
 
     /* Filter out non-existant or too large motions */
     if ((dx != 0 || dy != 0) &&
-        ((abs(dx) <= (w*9)/20) && (abs(dy) <= (h*9)/20))) {
-
-/*         g_debug("sending motion"); */
+        ((abs(dx) <= i->max_dx) && (abs(dy) <= i->max_dy))) {
 
         /* Send the event */
         r = lassi_server_motion_event(i->server, dx, dy);
@@ -188,32 +253,180 @@ static void handle_motion(LassiGrabInfo *i, int x, int y) {
     }
 }
 
+static void handle_button(LassiGrabInfo *i, int x, int y, unsigned button, gboolean is_press) {
+    int r;
+
+    g_assert(i);
+
+    /* While a button is down the pointer stays on this screen, so that
+     * the release goes where the press went */
+    if (is_press && button < 32)
+        i->buttons_down |= 1U << button;
+
+    handle_motion(i, x, y);
+
+    if (!is_press && button < 32)
+        i->buttons_down &= ~(1U << button);
+
+    /* The motion might have handed the pointer back to us */
+    if (!i->grab_window)
+        return;
+
+    /* Send the event */
+    r = lassi_server_button_event(i->server, button, is_press);
+    g_assert(r >= 0);
+}
+
+static void handle_key(LassiGrabInfo *i, int x, int y, KeySym keysym, gboolean is_press) {
+    gboolean is_repeat;
+    int r;
+
+    g_assert(i);
+
+    is_repeat = is_press && g_hash_table_lookup(i->keys_down, GUINT_TO_POINTER(keysym));
+
+    /* Just like buttons, a key that is down keeps the pointer here */
+    if (is_press)
+        g_hash_table_insert(i->keys_down, GUINT_TO_POINTER(keysym), GUINT_TO_POINTER(TRUE));
+
+    if (keysym == XK_Shift_L)
+        i->left_shift = is_press;
+    if (keysym == XK_Shift_R)
+        i->right_shift = is_press;
+
+    if (i->left_shift && i->right_shift)
+        i->double_shift = TRUE;
+
+/*     g_debug("left_shift=%i right_shift=%i 0x04%x", i->left_shift, i->right_shift, (unsigned) keysym); */
+
+    handle_motion(i, x, y);
+
+    if (!is_press)
+        g_hash_table_remove(i->keys_down, GUINT_TO_POINTER(keysym));
+
+    if (!i->grab_window)
+        return;
+
+    if (is_repeat) {
+
+        /* Otherwise both X servers would repeat the key */
+        if (lassi_server_peer_repeats_keys(i->server))
+            return;
+
+        /* Older peers expect what X sends without detectable
+         * autorepeat, a release before every repeat */
+        r = lassi_server_key_event(i->server, keysym, FALSE);
+        g_assert(r >= 0);
+    }
+
+    /* Send the event */
+    r = lassi_server_key_event(i->server, keysym, is_press);
+    g_assert(r >= 0);
+
+    if (!i->left_shift && !i->right_shift && i->double_shift) {
+/*         g_debug("Got double shift"); */
+        lassi_server_acquire_grab(i->server);
+        lassi_grab_stop(i, -1);
+    }
+}
+
+static void handle_replay_key(LassiGrabInfo *i, KeySym keysym, gboolean is_press) {
+    g_assert(i);
+
+    /* Real keys go nowhere while a recording is replayed, but a double
+     * Shift still ends it and gets the user their input back */
+    if (keysym == XK_Shift_L)
+        i->real_left_shift = is_press;
+    if (keysym == XK_Shift_R)
+        i->real_right_shift = is_press;
+
+    if (i->real_left_shift && i->real_right_shift)
+        i->real_double_shift = TRUE;
+
+    if (!i->real_left_shift && !i->real_right_shift && i->real_double_shift) {
+        i->real_double_shift = FALSE;
+
+        lassi_record_cancel(&i->server->record_info);
+        lassi_server_acquire_grab(i->server);
+        lassi_grab_stop(i, -1);
+    }
+}
+
 static GdkFilterReturn filter_func(GdkXEvent *gxe, GdkEvent *event, gpointer data) {
     LassiGrabInfo *i = data;
     XEvent *xe = (XEvent*) gxe;
-    GdkWindow *w = ((GdkEventAny*) event)->window;
 
     g_assert(i);
     g_assert(xe);
-    g_assert(event);
+
+    /* We see the raw X events here before GDK translates them. Whatever
+     * we consume is removed, so that GDK never has to build GdkEvents
+     * for the stream of motion events while input is redirected */
+
+    /* While a recording is replayed it is all the input there is */
+    if (i->grab_window && i->server->record_info.replaying &&
+        (xe->type == MotionNotify ||
+         xe->type == ButtonPress || xe->type == ButtonRelease ||
+         xe->type == KeyPress || xe->type == KeyRelease ||
+         (xe->type == EnterNotify && (xe->xany.window == i->left_xid || xe->xany.window == i->right_xid)))) {
+
+        if (xe->type == KeyPress || xe->type == KeyRelease)
+            handle_replay_key(i, XKeycodeToKeysym(GDK_DISPLAY_XDISPLAY(i->display), xe->xkey.keycode, 0), xe->type == KeyPress);
+
+        return GDK_FILTER_REMOVE;
+    }
 
     switch (xe->type){
 
+#ifdef LASSI_BARRIERS
+        case GenericEvent: {
+            GdkModifierType state;
+            gboolean left;
+            int y, r;
+
+            if ((r = lassi_barrier_handle_event(&i->barrier_info, xe, &left, &y)) < 0)
+                return GDK_FILTER_CONTINUE;
+
+            if (r > 0 && !i->grab_window) {
+
+                /* Only honour this when no button/key is pressed, the
+                 * barrier events don't tell */
+                gdk_display_get_pointer(i->display, NULL, NULL, NULL, &state);
+
+                if ((state & i->lock_mask) == 0 &&
+                    lassi_server_change_grab(i->server, left, local2global(i, left, y)) >= 0)
+                    grab_input(i, left ? i->left_window : i->right_window);
+            }
+
+            return GDK_FILTER_REMOVE;
+        }
+#endif
+
         case EnterNotify: {
             XEnterWindowEvent *ewe = (XEnterWindowEvent*) xe;
+            gboolean left;
+
+            if (xe->xany.window == i->left_xid)
+                left = TRUE;
+            else if (xe->xany.window == i->right_xid)
+                left = FALSE;
+            else
+                return GDK_FILTER_CONTINUE;
 
             if (ewe->mode == NotifyNormal && (ewe->state & i->lock_mask) == 0 && !i->grab_window) {
                 g_debug("enter %u %u", ewe->x_root, ewe->y_root);
 
                 /* Only honour this when no button/key is pressed */
 
-                if (lassi_server_change_grab(i->server, w == i->left_window, local2global(i, ewe->y_root)) >= 0)
-                    grab_input(i, w);
+                if (lassi_server_change_grab(i->server, left, local2global(i, left, ewe->y_root)) >= 0)
+                    grab_input(i, left ? i->left_window : i->right_window);
 
-            } else if (i->grab_window)
+            } else if (i->grab_window) {
+                lassi_record_event(&i->server->record_info, LASSI_RECORD_MOTION, ewe->x_root, ewe->y_root, 0, FALSE);
                 handle_motion(i, ewe->x_root, ewe->y_root);
+            }
 
-            break;
+            return GDK_FILTER_REMOVE;
         }
 
         case MotionNotify:
@@ -221,8 +434,11 @@ static GdkFilterReturn filter_func(GdkXEvent *gxe, GdkEvent *event, gpointer dat
             if (i->grab_window) {
                 XMotionEvent *me = (XMotionEvent*) xe;
 
-/*                 g_debug("motion %u %u", me->x_root, me->y_root); */
+                lassi_trace(LASSI_TRACE_FILTER_MOTION, me->x_root, me->y_root, 0);
+                lassi_record_event(&i->server->record_info, LASSI_RECORD_MOTION, me->x_root, me->y_root, 0, FALSE);
                 handle_motion(i, me->x_root, me->y_root);
+
+                return GDK_FILTER_REMOVE;
             }
 
             break;
@@ -231,59 +447,198 @@ static GdkFilterReturn filter_func(GdkXEvent *gxe, GdkEvent *event, gpointer dat
         case ButtonRelease:
 
             if (i->grab_window) {
-                int r;
                 XButtonEvent *be = (XButtonEvent*) xe;
 
-/*                 g_debug("button press/release"); */
-                handle_motion(i,  be->x_root, be->y_root);
+                lassi_trace(LASSI_TRACE_FILTER_BUTTON, be->button, xe->type == ButtonPress, 0);
+                lassi_record_event(&i->server->record_info, LASSI_RECORD_BUTTON, be->x_root, be->y_root, be->button, xe->type == ButtonPress);
+                handle_button(i, be->x_root, be->y_root, be->button, xe->type == ButtonPress);
 
-                /* Send the event */
-                r = lassi_server_button_event(i->server, be->button, xe->type == ButtonPress);
-                g_assert(r >= 0);
+                return GDK_FILTER_REMOVE;
             }
             break;
 
         case KeyPress:
         case KeyRelease:
 
-/*             g_debug("raw key"); */
-
             if (i->grab_window) {
-                int r;
                 XKeyEvent *ke = (XKeyEvent *) xe;
                 KeySym keysym;
 
                 keysym = XKeycodeToKeysym(GDK_DISPLAY_XDISPLAY(i->display), ke->keycode, 0);
 
-                if (keysym == XK_Shift_L)
-                    i->left_shift = ke->type == KeyPress;
-                if (keysym == XK_Shift_R)
-                    i->right_shift = xe->type == KeyPress;
+                lassi_trace(LASSI_TRACE_FILTER_KEY, keysym, xe->type == KeyPress, 0);
+                lassi_record_event(&i->server->record_info, LASSI_RECORD_KEY, ke->x_root, ke->y_root, keysym, xe->type == KeyPress);
+                handle_key(i, ke->x_root, ke->y_root, keysym, xe->type == KeyPress);
 
-                if (i->left_shift && i->right_shift)
-                    i->double_shift = TRUE;
+                return GDK_FILTER_REMOVE;
+            }
+            break;
+    }
 
-/*                 g_debug("left_shift=%i right_shift=%i 0x04%x", i->left_shift, i->right_shift, (unsigned) keysym); */
+    return GDK_FILTER_CONTINUE;
+}
 
-/*                 g_debug("key press/release"); */
-                handle_motion(i,  ke->x_root, ke->y_root);
+#ifdef LASSI_XCB
+static void handle_xcb_event(LassiGrabInfo *i, xcb_generic_event_t *e) {
+    g_assert(i);
+    g_assert(e);
 
-                /* Send the event */
-                r = lassi_server_key_event(i->server, keysym, xe->type == KeyPress);
-                g_assert(r >= 0);
+    /* What filter_func() does while input is grabbed, only that the
+     * events arrive on our own connection */
+    if (!i->grab_window)
+        return;
 
-                if (!i->left_shift && !i->right_shift && i->double_shift) {
-/*                     g_debug("Got double shift"); */
-                    lassi_server_acquire_grab(i->server);
-                    lassi_grab_stop(i, -1);
-                }
-            }
+    if (i->server->record_info.replaying) {
+        uint8_t type = e->response_type & 0x7f;
+
+        if (type == XCB_KEY_PRESS || type == XCB_KEY_RELEASE)
+            handle_replay_key(i, lassi_xcb_keycode_to_keysym(&i->xcb_info, ((xcb_key_press_event_t*) e)->detail), type == XCB_KEY_PRESS);
+
+        return;
+    }
+
+    switch (e->response_type & 0x7f) {
+
+        case XCB_ENTER_NOTIFY: {
+            xcb_enter_notify_event_t *ee = (xcb_enter_notify_event_t*) e;
+
+            lassi_record_event(&i->server->record_info, LASSI_RECORD_MOTION, ee->root_x, ee->root_y, 0, FALSE);
+            handle_motion(i, ee->root_x, ee->root_y);
             break;
+        }
+
+        case XCB_MOTION_NOTIFY: {
+            xcb_motion_notify_event_t *me = (xcb_motion_notify_event_t*) e;
+
+            lassi_trace(LASSI_TRACE_FILTER_MOTION, me->root_x, me->root_y, 0);
+            lassi_record_event(&i->server->record_info, LASSI_RECORD_MOTION, me->root_x, me->root_y, 0, FALSE);
+            handle_motion(i, me->root_x, me->root_y);
+            break;
+        }
+
+        case XCB_BUTTON_PRESS:
+        case XCB_BUTTON_RELEASE: {
+            xcb_button_press_event_t *be = (xcb_button_press_event_t*) e;
+            gboolean is_press = (e->response_type & 0x7f) == XCB_BUTTON_PRESS;
+
+            lassi_trace(LASSI_TRACE_FILTER_BUTTON, be->detail, is_press, 0);
+            lassi_record_event(&i->server->record_info, LASSI_RECORD_BUTTON, be->root_x, be->root_y, be->detail, is_press);
+            handle_button(i, be->root_x, be->root_y, be->detail, is_press);
+            break;
+        }
+
+        case XCB_KEY_PRESS:
+        case XCB_KEY_RELEASE: {
+            xcb_key_press_event_t *ke = (xcb_key_press_event_t*) e;
+            gboolean is_press = (e->response_type & 0x7f) == XCB_KEY_PRESS;
+            KeySym keysym;
+
+            keysym = lassi_xcb_keycode_to_keysym(&i->xcb_info, ke->detail);
+
+            lassi_trace(LASSI_TRACE_FILTER_KEY, keysym, is_press, 0);
+            lassi_record_event(&i->server->record_info, LASSI_RECORD_KEY, ke->root_x, ke->root_y, keysym, is_press);
+            handle_key(i, ke->root_x, ke->root_y, keysym, is_press);
+            break;
+        }
     }
+}
 
-    return GDK_FILTER_CONTINUE;
+static gboolean is_key_event(xcb_generic_event_t *e, uint8_t type) {
+    g_assert(e);
+
+    return (e->response_type & 0x7f) == type;
+}
+
+static void flush_release(LassiGrabInfo *i) {
+    g_assert(i);
+
+    if (i->release_id > 0) {
+        g_source_remove(i->release_id);
+        i->release_id = 0;
+    }
+
+    if (i->release) {
+        handle_xcb_event(i, i->release);
+        free(i->release);
+        i->release = NULL;
+    }
 }
 
+static gboolean release_cb(gpointer userdata) {
+    LassiGrabInfo *i = userdata;
+
+    g_assert(i);
+
+    /* No press came after it, so it was a real release */
+    i->release_id = 0;
+    flush_release(i);
+
+    return FALSE;
+}
+
+static gboolean xcb_cb(gpointer userdata) {
+    LassiGrabInfo *i = userdata;
+    xcb_generic_event_t *e, *release;
+
+    g_assert(i);
+
+    /* The press of a repeat might not have been read along with its
+     * release last time */
+    release = i->release;
+    i->release = NULL;
+
+    if (i->release_id > 0) {
+        g_source_remove(i->release_id);
+        i->release_id = 0;
+    }
+
+    while ((e = lassi_xcb_poll_event(&i->xcb_info))) {
+
+        /* Detectable autorepeat is set up for GTK's connection only,
+         * here a repeat is a release and a press at the same time. Drop
+         * the release, so that the press is taken for a repeat. */
+        if (is_key_event(e, XCB_KEY_RELEASE)) {
+
+            if (release) {
+                handle_xcb_event(i, release);
+                free(release);
+            }
+
+            release = e;
+            continue;
+        }
+
+        if (release) {
+            xcb_key_press_event_t *pe = (xcb_key_press_event_t*) e, *re = (xcb_key_press_event_t*) release;
+
+            if (!is_key_event(e, XCB_KEY_PRESS) || pe->detail != re->detail || pe->time != re->time)
+                handle_xcb_event(i, release);
+
+            free(release);
+            release = NULL;
+        }
+
+        handle_xcb_event(i, e);
+        free(e);
+    }
+
+    /* Wait a moment for the press that might still follow */
+    if (release) {
+        i->release = release;
+        i->release_id = g_timeout_add(RELEASE_HOLD_MSEC, release_cb, i);
+    }
+
+    /* Somebody else holds a grab, give the input back to us */
+    if (i->xcb_info.grab_failed && i->grab_window) {
+        g_debug("grab failed");
+        lassi_server_acquire_grab(i->server);
+        lassi_grab_stop(i, -1);
+    }
+
+    return TRUE;
+}
+#endif
+
 static unsigned int get_lock_mask(LassiGrabInfo *i, LassiServer *s) {
     XModifierKeymap *map;
     int max_ks_offset = 15;
@@ -342,6 +697,69 @@ static unsigned int get_lock_mask(LassiGrabInfo *i, LassiServer *s) {
     return ~inv_lock_mask;
 }
 
+static void update_geometry(LassiGrabInfo *i) {
+    int w, h;
+
+    g_assert(i);
+
+    lassi_geometry_free(i->geometry);
+    i->geometry = lassi_geometry_new_from_screen(i->screen);
+
+    w = i->geometry->width;
+    h = i->geometry->height;
+
+    i->base_x = w/2;
+    i->base_y = h/2;
+
+    /* Re-center once the pointer gets this close to an edge */
+    i->recenter_left = w/10;
+    i->recenter_top = h/10;
+    i->recenter_right = (w*9)/10;
+    i->recenter_bottom = (h*9)/10;
+
+    /* Anything larger is the pointer jumping back from re-centering */
+    i->max_dx = (w*9)/20;
+    i->max_dy = (h*9)/20;
+}
+
+static void place_triggers(LassiGrabInfo *i) {
+    int w, h;
+
+    g_assert(i);
+
+    w = i->geometry->width;
+    h = i->geometry->height;
+
+#ifdef LASSI_BARRIERS
+    if (i->use_barriers) {
+
+        /* Just outside the screen, where the pointer never gets */
+        gdk_window_move_resize(i->left_window, -TRIGGER_WIDTH, 0, TRIGGER_WIDTH, h);
+        gdk_window_move_resize(i->right_window, w, 0, TRIGGER_WIDTH, h);
+
+        lassi_barrier_enable(&i->barrier_info, i->barrier_info.left_enabled, i->barrier_info.right_enabled, w, h);
+        return;
+    }
+#endif
+
+    gdk_window_move_resize(i->left_window, 0, h/20, TRIGGER_WIDTH, (h*18)/20);
+    gdk_window_move_resize(i->right_window, w - TRIGGER_WIDTH, h/20, TRIGGER_WIDTH, (h*18)/20);
+}
+
+static void screen_changed(GdkScreen *screen, gpointer userdata) {
+    LassiGrabInfo *i = userdata;
+
+    g_assert(i);
+
+    update_geometry(i);
+
+    g_debug("Screen geometry changed to %ix%i with %i monitor(s)", i->geometry->width, i->geometry->height, i->geometry->n_monitors);
+
+    place_triggers(i);
+
+    lassi_server_geometry_changed(i->server);
+}
+
 int lassi_grab_init(LassiGrabInfo *i, LassiServer *s) {
     GdkWindowAttr wa;
     GdkColor black = { 0, 0, 0, 0 };
@@ -349,6 +767,7 @@ int lassi_grab_init(LassiGrabInfo *i, LassiServer *s) {
     GdkBitmap *bitmap;
     int xtest_event_base, xtest_error_base;
     int major_version, minor_version;
+    Bool detectable;
 
     memset(i, 0, sizeof(*i));
     i->server = s;
@@ -357,6 +776,8 @@ int lassi_grab_init(LassiGrabInfo *i, LassiServer *s) {
     i->display = gdk_screen_get_display(i->screen);
     i->root = gdk_screen_get_root_window(i->screen);
 
+    update_geometry(i);
+
     if (!XTestQueryExtension(GDK_DISPLAY_XDISPLAY(i->display), &xtest_event_base, &xtest_error_base, &major_version, &minor_version)) {
         g_warning("XTest extension not supported.");
         return -1;
@@ -364,9 +785,24 @@ int lassi_grab_init(LassiGrabInfo *i, LassiServer *s) {
 
     g_debug("XTest %u.%u supported.", major_version, minor_version);
 
+#ifdef LASSI_XCB
+    if (lassi_xcb_init(&i->xcb_info, gdk_display_get_name(i->display)) < 0)
+        return -1;
+
+    i->xcb_watch_id = lassi_xcb_add_watch(&i->xcb_info, xcb_cb, i);
+#endif
+
     /* Get mask for Lock modifiers */
     i->lock_mask = get_lock_mask(i,s);
 
+    /* Autorepeat then shows up as presses without releases in between */
+    if (!XkbSetDetectableAutoRepeat(GDK_DISPLAY_XDISPLAY(i->display), True, &detectable))
+        detectable = False;
+
+    g_debug("Detectable autorepeat %s.", detectable ? "supported" : "not supported");
+
+    i->keys_down = g_hash_table_new(g_direct_hash, g_direct_equal);
+
     /* Create empty cursor */
     bitmap = gdk_bitmap_create_from_data(NULL, cursor_data, 1, 1);
     i->empty_cursor = gdk_cursor_new_from_pixmap(bitmap, bitmap, &black, &black, 0, 0);
@@ -378,9 +814,9 @@ int lassi_grab_init(LassiGrabInfo *i, LassiServer *s) {
     wa.title = (char*) "Mango Lassi Left";
     wa.event_mask = GDK_POINTER_MOTION_MASK|GDK_BUTTON_PRESS_MASK|GDK_BUTTON_RELEASE_MASK|GDK_KEY_PRESS_MASK|GDK_KEY_RELEASE_MASK|GDK_ENTER_NOTIFY_MASK;
     wa.x = 0;
-    wa.y = gdk_screen_get_height(i->screen)/20;
+    wa.y = i->geometry->height/20;
     wa.width = TRIGGER_WIDTH;
-    wa.height = (gdk_screen_get_height(i->screen)*18)/20;
+    wa.height = (i->geometry->height*18)/20;
     wa.wclass = GDK_INPUT_ONLY;
     wa.window_type = GDK_WINDOW_FOREIGN;
     wa.override_redirect = TRUE;
@@ -389,19 +825,38 @@ int lassi_grab_init(LassiGrabInfo *i, LassiServer *s) {
 
     i->left_window = gdk_window_new(i->root, &wa, GDK_WA_TITLE|GDK_WA_X|GDK_WA_Y|GDK_WA_NOREDIR|GDK_WA_TYPE_HINT|GDK_WA_CURSOR);
     gdk_window_set_keep_above(i->left_window, TRUE);
-    gdk_window_add_filter(i->left_window, filter_func, i);
+    i->left_xid = GDK_WINDOW_XID(i->left_window);
 
     wa.title = (char*) "Mango Lassi Right";
-    wa.x = gdk_screen_get_width(i->screen) - TRIGGER_WIDTH;
+    wa.x = i->geometry->width - TRIGGER_WIDTH;
 
     i->right_window = gdk_window_new(i->root, &wa, GDK_WA_TITLE|GDK_WA_X|GDK_WA_Y|GDK_WA_NOREDIR|GDK_WA_TYPE_HINT);
     gdk_window_set_keep_above(i->right_window, TRUE);
-    gdk_window_add_filter(i->right_window, filter_func, i);
+    i->right_xid = GDK_WINDOW_XID(i->right_window);
+
+    /* Filter everything, not just the trigger windows: while grabbed
+     * keyboard events may be reported on any of our windows */
+    gdk_window_add_filter(NULL, filter_func, i);
+
+#ifdef LASSI_BARRIERS
+    /* Grabbing needs viewable windows, so they stay mapped */
+    if (lassi_barrier_init(&i->barrier_info, GDK_DISPLAY_XDISPLAY(i->display), GDK_WINDOW_XID(i->root)) >= 0) {
+        i->use_barriers = TRUE;
+
+        place_triggers(i);
+        gdk_window_show(i->left_window);
+        gdk_window_show(i->right_window);
+    }
+#endif
 
-    i->base_x = gdk_screen_get_width(i->screen)/2;
-    i->base_y = gdk_screen_get_height(i->screen)/2;
+    g_signal_connect(i->screen, "size-changed", G_CALLBACK(screen_changed), i);
+    g_signal_connect(i->screen, "monitors-changed", G_CALLBACK(screen_changed), i);
 
+#ifdef LASSI_XCB
+    lassi_xcb_grab_control(&i->xcb_info, TRUE);
+#else
     XTestGrabControl(GDK_DISPLAY_XDISPLAY(i->display), True);
+#endif
 
     return 0;
 }
@@ -411,6 +866,15 @@ void lassi_grab_done(LassiGrabInfo *i) {
 
     lassi_grab_stop(i, -1);
 
+    if (i->screen)
+        g_signal_handlers_disconnect_by_func(i->screen, screen_changed, i);
+
+    gdk_window_remove_filter(NULL, filter_func, i);
+
+#ifdef LASSI_BARRIERS
+    lassi_barrier_done(&i->barrier_info);
+#endif
+
     if (i->left_window)
         gdk_window_destroy(i->left_window);
 
@@ -419,6 +883,23 @@ void lassi_grab_done(LassiGrabInfo *i) {
 
     if (i->empty_cursor)
         gdk_cursor_unref(i->empty_cursor);
+
+#ifdef LASSI_XCB
+    if (i->xcb_watch_id > 0)
+        g_source_remove(i->xcb_watch_id);
+
+    if (i->release_id > 0)
+        g_source_remove(i->release_id);
+
+    free(i->release);
+
+    lassi_xcb_done(&i->xcb_info);
+#endif
+
+    if (i->keys_down)
+        g_hash_table_destroy(i->keys_down);
+
+    lassi_geometry_free(i->geometry);
 }
 
 void lassi_grab_enable_triggers(LassiGrabInfo *i, gboolean left, gboolean right) {
@@ -426,6 +907,13 @@ void lassi_grab_enable_triggers(LassiGrabInfo *i, gboolean left, gboolean right)
 
     g_debug("Showing windows: left=%s, right=%s", left ? "yes" : "no", right ? "yes" : "no");
 
+#ifdef LASSI_BARRIERS
+    if (i->use_barriers) {
+        lassi_barrier_enable(&i->barrier_info, left, right, i->geometry->width, i->geometry->height);
+        return;
+    }
+#endif
+
     if (left)
         gdk_window_show(i->left_window);
     else
@@ -437,26 +925,96 @@ void lassi_grab_enable_triggers(LassiGrabInfo *i, gboolean left, gboolean right)
         gdk_window_hide(i->right_window);
 }
 
+gboolean lassi_grab_input_held(LassiGrabInfo *i) {
+    g_assert(i);
+
+    return i->buttons_down != 0 || g_hash_table_size(i->keys_down) > 0;
+}
+
 int lassi_grab_move_pointer_relative(LassiGrabInfo *i, int dx, int dy) {
     g_assert(i);
 
     if (i->grab_window)
         return -1;
 
+#ifdef LASSI_UINPUT
+    if (lassi_uinput_is_open(&i->server->uinput_info))
+        return lassi_uinput_move_pointer_relative(&i->server->uinput_info, dx, dy);
+#endif
+
+#ifdef LASSI_XCB
+    lassi_xcb_fake_motion(&i->xcb_info, TRUE, dx, dy);
+#else
     XTestFakeRelativeMotionEvent(GDK_DISPLAY_XDISPLAY(i->display), dx, dy, 0);
     XSync(GDK_DISPLAY_XDISPLAY(i->display), False);
+#endif
 
     return 0;
 }
 
+int lassi_grab_move_pointer_absolute(LassiGrabInfo *i, int x, int y) {
+    g_assert(i);
+
+    if (i->grab_window)
+        return -1;
+
+#ifdef LASSI_UINPUT
+    if (lassi_uinput_is_open(&i->server->uinput_info))
+        return lassi_uinput_move_pointer_absolute(&i->server->uinput_info, x, y, i->geometry->width, i->geometry->height);
+#endif
+
+#ifdef LASSI_XCB
+    lassi_xcb_fake_motion(&i->xcb_info, FALSE, x, y);
+#else
+    XTestFakeMotionEvent(GDK_DISPLAY_XDISPLAY(i->display), gdk_screen_get_number(i->screen), x, y, 0);
+    XSync(GDK_DISPLAY_XDISPLAY(i->display), False);
+#endif
+
+    return 0;
+}
+
+void lassi_grab_replay_event(LassiGrabInfo *i, const struct LassiRecordEvent *e) {
+    g_assert(i);
+    g_assert(e);
+
+    /* Just like filter_func() we only care while input is redirected */
+    if (!i->grab_window)
+        return;
+
+    switch (e->type) {
+
+        case LASSI_RECORD_MOTION:
+        case LASSI_RECORD_MOTION_DRAINED:
+            handle_motion(i, e->x, e->y);
+            break;
+
+        case LASSI_RECORD_BUTTON:
+            handle_button(i, e->x, e->y, e->detail, e->is_press);
+            break;
+
+        case LASSI_RECORD_KEY:
+            handle_key(i, e->x, e->y, e->detail, e->is_press);
+            break;
+    }
+}
+
 int lassi_grab_press_button(LassiGrabInfo *i, unsigned button, gboolean is_press) {
     g_assert(i);
 
     if (i->grab_window)
         return -1;
 
+#ifdef LASSI_UINPUT
+    if (lassi_uinput_is_open(&i->server->uinput_info))
+        return lassi_uinput_press_button(&i->server->uinput_info, button, is_press);
+#endif
+
+#ifdef LASSI_XCB
+    lassi_xcb_fake_button(&i->xcb_info, button, is_press);
+#else
     XTestFakeButtonEvent(GDK_DISPLAY_XDISPLAY(i->display), button, is_press, 0);
     XSync(GDK_DISPLAY_XDISPLAY(i->display), False);
+#endif
 
     return 0;
 }
@@ -466,8 +1024,18 @@ int lassi_grab_press_key(LassiGrabInfo *i, unsigned key, gboolean is_press) {
     if (i->grab_window)
         return -1;
 
+#ifdef LASSI_UINPUT
+    /* The keycode in our keymap, which the kernel numbers alike */
+    if (lassi_uinput_is_open(&i->server->uinput_info))
+        return lassi_uinput_press_key(&i->server->uinput_info, XKeysymToKeycode(GDK_DISPLAY_XDISPLAY(i->display), key), is_press);
+#endif
+
+#ifdef LASSI_XCB
+    lassi_xcb_fake_key(&i->xcb_info, key, is_press);
+#else
     XTestFakeKeyEvent(GDK_DISPLAY_XDISPLAY(i->display), XKeysymToKeycode(GDK_DISPLAY_XDISPLAY(i->display), key), is_press, 0);
     XSync(GDK_DISPLAY_XDISPLAY(i->display), False);
+#endif
 
     return 0;
 }
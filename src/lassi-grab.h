@@ -2,9 +2,21 @@
 #define foolassigrabhfoo
 
 #include <gdk/gdk.h>
+#include <X11/Xlib.h>
+
+#include "lassi-geometry.h"
+
+#ifdef LASSI_XCB
+#include "lassi-xcb.h"
+#endif
+
+#ifdef LASSI_BARRIERS
+#include "lassi-barrier.h"
+#endif
 
 typedef struct LassiGrabInfo LassiGrabInfo;
 struct LassiServer;
+struct LassiRecordEvent;
 
 struct LassiGrabInfo {
     struct LassiServer *server;
@@ -13,16 +25,49 @@ struct LassiGrabInfo {
     GdkScreen *screen;
     GdkWindow *root;
 
+    /* Refreshed whenever RandR tells us something changed */
+    LassiGeometry *geometry;
+
     GdkWindow *left_window, *right_window;
+    Window left_xid, right_xid;
     GdkCursor *empty_cursor;
     GdkWindow *grab_window;
 
     int base_x, base_y;
     int last_x, last_y;
 
+    /* Derived from the geometry, so that the motion path doesn't have
+     * to ask GDK every time */
+    int recenter_left, recenter_top, recenter_right, recenter_bottom;
+    int max_dx, max_dy;
+
     unsigned int lock_mask;
 
     gboolean left_shift, right_shift, double_shift;
+
+    /* The same for the real keyboard while a recording is replayed */
+    gboolean real_left_shift, real_right_shift, real_double_shift;
+
+    /* Keys pressed while grabbed, a press of a key that is already
+     * down is autorepeat */
+    GHashTable *keys_down;
+    guint32 buttons_down;
+
+#ifdef LASSI_XCB
+    LassiXcbInfo xcb_info;
+    guint xcb_watch_id;
+
+    /* A key release that might be half of an autorepeat */
+    xcb_generic_event_t *release;
+    guint release_id;
+#endif
+
+#ifdef LASSI_BARRIERS
+    /* Edges are pointer barriers, the trigger windows are then only
+     * there to be grabbed */
+    LassiBarrierInfo barrier_info;
+    gboolean use_barriers;
+#endif
 };
 
 #include "lassi-server.h"
@@ -34,9 +79,13 @@ int lassi_grab_start(LassiGrabInfo *i, gboolean to_left);
 void lassi_grab_stop(LassiGrabInfo *i, int y);
 
 void lassi_grab_enable_triggers(LassiGrabInfo *i, gboolean left, gboolean right);
+gboolean lassi_grab_input_held(LassiGrabInfo *i);
 
 int lassi_grab_move_pointer_relative(LassiGrabInfo *i, int dx, int dy);
+int lassi_grab_move_pointer_absolute(LassiGrabInfo *i, int x, int y);
 int lassi_grab_press_button(LassiGrabInfo *i, unsigned button, gboolean is_press);
 int lassi_grab_press_key(LassiGrabInfo *i, unsigned key, gboolean is_press);
 
+void lassi_grab_replay_event(LassiGrabInfo *i, const struct LassiRecordEvent *e);
+
 #endif
@@ -0,0 +1,502 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+
+#include <glib.h>
+
+/* A TCP proxy that makes a loopback link look like Wi-Fi or a VPN:
+ *
+ *   mango-lassi-netem --listen=7500 --connect=localhost:7421 --delay=30 --jitter=10
+ *   mango-lassi --connect=localhost:7500
+ *
+ * Whatever arrives is held back for the configured delay before it is
+ * passed on. Bytes on a TCP stream can't be lost or overtake each other,
+ * so loss shows up as a retransmission timeout on the affected chunk
+ * and everything behind it, and jitter never reorders. With --rate the
+ * chunks queue up behind each other like on a slow link.
+ *
+ * Both instances have to find each other through the proxy only, so
+ * keep Avahi from announcing them to each other, e.g. by running them in
+ * network namespaces of their own. Reconnects after a dropped link go to
+ * the address the peer announced, past the proxy. */
+
+#define BUFFER_SIZE 4096
+
+typedef struct Link Link;
+typedef struct Direction Direction;
+typedef struct Chunk Chunk;
+
+struct Chunk {
+    gint64 due;
+    gsize length, offset;
+    char data[];
+};
+
+struct Direction {
+    Link *link;
+    const char *name;
+    int from, to;
+
+    guint in_id, out_id, timer_id;
+    gboolean eof;
+
+    /* Chunks waiting for their time, oldest first */
+    GQueue *queue;
+
+    /* When the last chunk leaves, chunks never overtake it */
+    gint64 busy;
+
+    guint64 bytes, chunks, retransmits;
+    gint64 delayed_usec;
+};
+
+struct Link {
+    unsigned id;
+    Direction up, down;
+};
+
+static gchar *connect_to = NULL;
+static gint listen_port = 7500;
+static gdouble delay = 0, jitter = 0, loss = 0, rto = 200, rate = 0;
+static gchar *distribution = NULL;
+static gint seed = 0;
+
+static GRand *rand_source = NULL;
+static unsigned n_links = 0;
+
+static gint64 now_usec(void) {
+    GTimeVal tv;
+
+    g_get_current_time(&tv);
+
+    return (gint64) tv.tv_sec * G_USEC_PER_SEC + tv.tv_usec;
+}
+
+static double sample_delay(void) {
+    double d;
+
+    if (jitter <= 0)
+        return delay;
+
+    if (distribution && strcmp(distribution, "normal") == 0) {
+        double u, v;
+
+        /* Box-Muller, jitter is the standard deviation */
+        u = g_rand_double_range(rand_source, 1e-12, 1.0);
+        v = g_rand_double(rand_source);
+
+        d = delay + jitter * sqrt(-2.0 * log(u)) * cos(2.0 * G_PI * v);
+
+    } else if (distribution && strcmp(distribution, "pareto") == 0) {
+
+        /* Heavy tail with shape 2: mostly close to delay, sometimes far
+         * off, jitter is the scale */
+        d = delay + jitter * (1.0 / sqrt(g_rand_double_range(rand_source, 1e-12, 1.0)) - 1.0);
+
+    } else
+        d = delay + g_rand_double(rand_source) * jitter;
+
+    return d < 0 ? 0 : d;
+}
+
+static void link_close(Link *l);
+static gboolean out_cb(GIOChannel *c, GIOCondition cond, gpointer userdata);
+
+static GIOChannel *channel_new(int fd) {
+    GIOChannel *c;
+
+    c = g_io_channel_unix_new(fd);
+    g_io_channel_set_encoding(c, NULL, NULL);
+    g_io_channel_set_buffered(c, FALSE);
+
+    return c;
+}
+
+static void direction_schedule(Direction *d);
+
+/* Returns FALSE once the link is to be closed */
+static gboolean direction_flush(Direction *d) {
+    Direction *other;
+    Chunk *k;
+    gint64 now;
+
+    now = now_usec();
+
+    while ((k = g_queue_peek_head(d->queue)) && k->due <= now) {
+        ssize_t r;
+
+        if ((r = write(d->to, k->data + k->offset, k->length - k->offset)) < 0) {
+
+            if (errno == EAGAIN || errno == EINTR) {
+                GIOChannel *c;
+
+                /* Wait until the other end catches up */
+                if (d->out_id == 0) {
+                    c = channel_new(d->to);
+                    d->out_id = g_io_add_watch(c, G_IO_OUT|G_IO_ERR|G_IO_HUP, out_cb, d);
+                    g_io_channel_unref(c);
+                }
+
+                return TRUE;
+            }
+
+            fprintf(stderr, "link %u %s: %s\n", d->link->id, d->name, g_strerror(errno));
+            return FALSE;
+        }
+
+        k->offset += r;
+
+        if (k->offset < k->length)
+            continue;
+
+        g_queue_pop_head(d->queue);
+        g_free(k);
+    }
+
+    if (g_queue_is_empty(d->queue) && d->eof) {
+        other = d == &d->link->up ? &d->link->down : &d->link->up;
+
+        /* Nothing left to pass on either way */
+        if (other->eof && g_queue_is_empty(other->queue))
+            return FALSE;
+
+        shutdown(d->to, SHUT_WR);
+        return TRUE;
+    }
+
+    direction_schedule(d);
+    return TRUE;
+}
+
+static gboolean timer_cb(gpointer userdata) {
+    Direction *d = userdata;
+
+    d->timer_id = 0;
+
+    if (!direction_flush(d))
+        link_close(d->link);
+
+    return FALSE;
+}
+
+static gboolean out_cb(GIOChannel *c, GIOCondition cond, gpointer userdata) {
+    Direction *d = userdata;
+
+    d->out_id = 0;
+
+    if ((cond & (G_IO_ERR|G_IO_HUP)) || !direction_flush(d))
+        link_close(d->link);
+
+    return FALSE;
+}
+
+static void direction_schedule(Direction *d) {
+    Chunk *k;
+    gint64 wait;
+
+    if (d->timer_id > 0 || d->out_id > 0)
+        return;
+
+    if (!(k = g_queue_peek_head(d->queue)))
+        return;
+
+    wait = k->due - now_usec();
+    d->timer_id = g_timeout_add(wait > 0 ? (guint) ((wait + 999) / 1000) : 0, timer_cb, d);
+}
+
+static gboolean in_cb(GIOChannel *c, GIOCondition cond, gpointer userdata) {
+    Direction *d = userdata;
+    char buffer[BUFFER_SIZE];
+    ssize_t r;
+    Chunk *k;
+    gint64 now, due;
+
+    if ((r = read(d->from, buffer, sizeof(buffer))) < 0) {
+
+        if (errno == EAGAIN || errno == EINTR)
+            return TRUE;
+
+        fprintf(stderr, "link %u %s: %s\n", d->link->id, d->name, g_strerror(errno));
+        d->in_id = 0;
+        link_close(d->link);
+        return FALSE;
+    }
+
+    if (r == 0) {
+        d->in_id = 0;
+        d->eof = TRUE;
+
+        if (d->link->up.eof && d->link->down.eof && g_queue_is_empty(d->link->up.queue) && g_queue_is_empty(d->link->down.queue))
+            link_close(d->link);
+        else if (g_queue_is_empty(d->queue))
+            shutdown(d->to, SHUT_WR);
+
+        return FALSE;
+    }
+
+    now = now_usec();
+    due = now + (gint64) (sample_delay() * 1000);
+
+    /* The retransmission holds up everything behind it */
+    if (loss > 0 && g_rand_double(rand_source) < loss) {
+        due += (gint64) (rto * 1000);
+        d->retransmits++;
+    }
+
+    /* A slow link sends one chunk after the other */
+    if (rate > 0)
+        due = MAX(due, d->busy) + (gint64) (r * G_USEC_PER_SEC / rate);
+
+    /* TCP never reorders */
+    due = MAX(due, d->busy);
+    d->busy = due;
+
+    k = g_malloc(sizeof(Chunk) + r);
+    k->due = due;
+    k->length = r;
+    k->offset = 0;
+    memcpy(k->data, buffer, r);
+
+    g_queue_push_tail(d->queue, k);
+
+    d->bytes += r;
+    d->chunks++;
+    d->delayed_usec += due - now;
+
+    direction_schedule(d);
+
+    return TRUE;
+}
+
+static void direction_done(Direction *d) {
+    Chunk *k;
+
+    if (d->in_id > 0)
+        g_source_remove(d->in_id);
+
+    if (d->out_id > 0)
+        g_source_remove(d->out_id);
+
+    if (d->timer_id > 0)
+        g_source_remove(d->timer_id);
+
+    while ((k = g_queue_pop_head(d->queue)))
+        g_free(k);
+
+    g_queue_free(d->queue);
+
+    fprintf(stderr, "link %u %s: %llu bytes in %llu chunks, %llu retransmitted, %.1f ms added on average\n",
+            d->link->id, d->name,
+            (unsigned long long) d->bytes,
+            (unsigned long long) d->chunks,
+            (unsigned long long) d->retransmits,
+            d->chunks > 0 ? (double) d->delayed_usec / d->chunks / 1000 : 0.0);
+}
+
+static void link_close(Link *l) {
+    direction_done(&l->up);
+    direction_done(&l->down);
+
+    close(l->up.from);
+    close(l->up.to);
+
+    g_free(l);
+}
+
+static void direction_init(Direction *d, Link *l, const char *name, int from, int to) {
+    GIOChannel *c;
+
+    memset(d, 0, sizeof(*d));
+    d->link = l;
+    d->name = name;
+    d->from = from;
+    d->to = to;
+    d->queue = g_queue_new();
+
+    c = channel_new(from);
+    d->in_id = g_io_add_watch(c, G_IO_IN|G_IO_ERR|G_IO_HUP, in_cb, d);
+    g_io_channel_unref(c);
+}
+
+static int set_nonblock(int fd) {
+    int one = 1;
+
+    /* Leave the batching to us */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    return fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+static int connect_upstream(void) {
+    char **hp;
+    struct addrinfo hints, *ai = NULL;
+    int fd = -1, r;
+
+    hp = g_strsplit(connect_to, ":", 2);
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+
+    if ((r = getaddrinfo(hp[0], hp[1] ? hp[1] : "7421", &hints, &ai)) != 0) {
+        fprintf(stderr, "Failed to resolve %s: %s\n", connect_to, gai_strerror(r));
+        goto finish;
+    }
+
+    if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0 ||
+        connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+        fprintf(stderr, "Failed to connect to %s: %s\n", connect_to, g_strerror(errno));
+
+        if (fd >= 0)
+            close(fd);
+
+        fd = -1;
+    }
+
+finish:
+
+    if (ai)
+        freeaddrinfo(ai);
+
+    g_strfreev(hp);
+
+    return fd;
+}
+
+static gboolean accept_cb(GIOChannel *c, GIOCondition cond, gpointer userdata) {
+    int listen_fd = GPOINTER_TO_INT(userdata);
+    int fd, upstream;
+    Link *l;
+
+    if ((fd = accept(listen_fd, NULL, NULL)) < 0)
+        return TRUE;
+
+    if ((upstream = connect_upstream()) < 0) {
+        close(fd);
+        return TRUE;
+    }
+
+    set_nonblock(fd);
+    set_nonblock(upstream);
+
+    l = g_new0(Link, 1);
+    l->id = ++n_links;
+
+    direction_init(&l->up, l, "up", fd, upstream);
+    direction_init(&l->down, l, "down", upstream, fd);
+
+    fprintf(stderr, "link %u: connected to %s\n", l->id, connect_to);
+
+    return TRUE;
+}
+
+int main(int argc, char *argv[]) {
+    GOptionEntry entries[] = {
+        {
+            "listen", 'l', 0, G_OPTION_ARG_INT, &listen_port,
+            "accept connections on this local port", "PORT"
+        },
+        {
+            "connect", 'c', 0, G_OPTION_ARG_STRING, &connect_to,
+            "pass them on to this mango-lassi instance", "HOST[:PORT]"
+        },
+        {
+            "delay", 'd', 0, G_OPTION_ARG_DOUBLE, &delay,
+            "one way delay", "MSEC"
+        },
+        {
+            "jitter", 'j', 0, G_OPTION_ARG_DOUBLE, &jitter,
+            "variation of the delay", "MSEC"
+        },
+        {
+            "distribution", 0, 0, G_OPTION_ARG_STRING, &distribution,
+            "of the jitter: uniform (default), normal or pareto", "NAME"
+        },
+        {
+            "loss", 0, 0, G_OPTION_ARG_DOUBLE, &loss,
+            "fraction of chunks that need to be retransmitted", "FRACTION"
+        },
+        {
+            "rto", 0, 0, G_OPTION_ARG_DOUBLE, &rto,
+            "how long a retransmission takes, defaults to 200", "MSEC"
+        },
+        {
+            "rate", 'r', 0, G_OPTION_ARG_DOUBLE, &rate,
+            "throughput of each direction, 0 for unlimited", "BYTES/S"
+        },
+        {
+            "seed", 0, 0, G_OPTION_ARG_INT, &seed,
+            "seed of the random number generator", "SEED"
+        },
+        {NULL, 0, 0, 0, NULL, NULL, NULL}
+    };
+    GOptionContext *context;
+    GError *error = NULL;
+    GMainLoop *loop;
+    GIOChannel *c;
+    struct sockaddr_in sa;
+    int fd, one = 1;
+
+    context = g_option_context_new("- impair the link between two mango-lassi instances");
+    g_option_context_add_main_entries(context, entries, NULL);
+
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        fprintf(stderr, "%s\n", error->message);
+        g_error_free(error);
+        g_option_context_free(context);
+        return 1;
+    }
+
+    g_option_context_free(context);
+
+    if (!connect_to || listen_port <= 0 || listen_port > 65535 ||
+        delay < 0 || jitter < 0 || loss < 0 || loss >= 1 || rto < 0 || rate < 0) {
+        fprintf(stderr, "Invalid arguments.\n");
+        return 1;
+    }
+
+    rand_source = g_rand_new_with_seed((guint32) seed);
+
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        fprintf(stderr, "Failed to create socket: %s\n", g_strerror(errno));
+        return 1;
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons((guint16) listen_port);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(fd, (struct sockaddr*) &sa, sizeof(sa)) < 0 || listen(fd, 4) < 0) {
+        fprintf(stderr, "Failed to listen on port %i: %s\n", listen_port, g_strerror(errno));
+        close(fd);
+        return 1;
+    }
+
+    c = channel_new(fd);
+    g_io_add_watch(c, G_IO_IN, accept_cb, GINT_TO_POINTER(fd));
+    g_io_channel_unref(c);
+
+    loop = g_main_loop_new(NULL, FALSE);
+    g_main_loop_run(loop);
+
+    g_main_loop_unref(loop);
+    g_rand_free(rand_source);
+    close(fd);
+
+    return 0;
+}
@@ -0,0 +1,144 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <stdlib.h>
+
+#include <glib.h>
+
+#include "lassi-pointer.h"
+#include "lassi-server.h"
+
+/* Must match TRIGGER_WIDTH in lassi-grab.c, that's where the remote
+ * puts its pointer when it hands over the grab */
+#define TRIGGER_WIDTH 1
+
+static LassiGeometry *connection_get_geometry(LassiConnection *lc) {
+    g_assert(lc);
+
+    if (!lassi_connection_has_capability(lc, LASSI_CAPABILITY_ABSOLUTE_MOTION))
+        return NULL;
+
+    return lc->geometry;
+}
+
+static double accelerate(LassiPointerInfo *i, int speed) {
+    g_assert(i);
+
+    /* Linear up to the threshold, then the excess is scaled, so that
+     * the curve has no jump where acceleration kicks in */
+    if (speed <= i->threshold)
+        return speed;
+
+    return i->threshold + (double) (speed - i->threshold) * i->factor;
+}
+
+int lassi_pointer_init(LassiPointerInfo *i, LassiServer *server) {
+    g_assert(i);
+    g_assert(server);
+
+    memset(i, 0, sizeof(*i));
+    i->server = server;
+
+    i->factor = 1.0;
+    i->threshold = 4;
+
+    return 0;
+}
+
+void lassi_pointer_done(LassiPointerInfo *i) {
+    g_assert(i);
+
+    memset(i, 0, sizeof(*i));
+}
+
+void lassi_pointer_set_acceleration(LassiPointerInfo *i, double factor, int threshold) {
+    g_assert(i);
+
+    i->factor = factor > 0 ? factor : 1.0;
+    i->threshold = MAX(threshold, 0);
+
+    g_debug("Pointer acceleration %g above %i pixels", i->factor, i->threshold);
+}
+
+void lassi_pointer_enter(LassiPointerInfo *i, LassiConnection *lc, gboolean to_left, int y) {
+    LassiGeometry *g;
+
+    g_assert(i);
+    g_assert(lc);
+
+    lc->pointer_valid = FALSE;
+
+    if (!(g = connection_get_geometry(lc)))
+        return;
+
+    /* Start where lassi_grab_stop() on the other side puts the pointer:
+     * if they are to our left we enter at their right edge */
+    if (y >= 0 && y < 0xFFFF) {
+        lc->pointer_x = to_left ? g->width - TRIGGER_WIDTH - 1 : TRIGGER_WIDTH;
+        lc->pointer_y = lassi_geometry_edge_from_global(g, !to_left, y);
+    } else {
+        lc->pointer_x = g->width / 2;
+        lc->pointer_y = g->height / 2;
+    }
+
+    lc->pointer_valid = TRUE;
+}
+
+gboolean lassi_pointer_move(LassiPointerInfo *i, LassiConnection *lc, int dx, int dy, int *x, int *y, int *edge) {
+    LassiGeometry *g;
+    int speed;
+
+    g_assert(i);
+    g_assert(lc);
+    g_assert(x);
+    g_assert(y);
+    g_assert(edge);
+
+    *edge = 0;
+
+    if (!(g = connection_get_geometry(lc)))
+        return FALSE;
+
+    if (!lc->pointer_valid) {
+        lc->pointer_x = g->width / 2;
+        lc->pointer_y = g->height / 2;
+        lc->pointer_valid = TRUE;
+    }
+
+    /* Like the X server we measure speed in the L1 norm */
+    speed = abs(dx) + abs(dy);
+
+    if (speed > 0) {
+        double gain = accelerate(i, speed) / speed;
+
+        /* Cover the same physical distance on screens with a
+         * different pixel density */
+        gain *= g->dpi / i->server->grab_info.geometry->dpi;
+
+        lc->pointer_x += dx * gain;
+        lc->pointer_y += dy * gain;
+    }
+
+    lc->pointer_y = CLAMP(lc->pointer_y, 0, g->height - 1);
+
+    /* We know where their edges are, so we do the hand-off ourselves
+     * instead of waiting for their trigger windows to fire and the
+     * UpdateGrab to come back. Like the trigger windows we leave the
+     * corners alone. Stopping short of the edge keeps their trigger
+     * windows from firing as well */
+    if (lc->pointer_y >= g->height/20 && lc->pointer_y < (g->height*19)/20) {
+        if (lc->pointer_x < TRIGGER_WIDTH)
+            *edge = -1;
+        else if (lc->pointer_x > g->width - TRIGGER_WIDTH - 1)
+            *edge = 1;
+    }
+
+    lc->pointer_x = CLAMP(lc->pointer_x, TRIGGER_WIDTH, g->width - TRIGGER_WIDTH - 1);
+
+    *x = (int) lc->pointer_x;
+    *y = (int) lc->pointer_y;
+
+    return TRUE;
+}
@@ -0,0 +1,28 @@
+#ifndef foolassipointerhfoo
+#define foolassipointerhfoo
+
+#include <glib.h>
+
+typedef struct LassiPointerInfo LassiPointerInfo;
+struct LassiServer;
+
+struct LassiPointerInfo {
+    struct LassiServer *server;
+
+    /* Motion faster than threshold pixels per event is multiplied by
+     * factor, slower motion is passed through as is */
+    double factor;
+    int threshold;
+};
+
+#include "lassi-server.h"
+
+int lassi_pointer_init(LassiPointerInfo *i, LassiServer *server);
+void lassi_pointer_done(LassiPointerInfo *i);
+
+void lassi_pointer_set_acceleration(LassiPointerInfo *i, double factor, int threshold);
+
+void lassi_pointer_enter(LassiPointerInfo *i, LassiConnection *lc, gboolean to_left, int y);
+gboolean lassi_pointer_move(LassiPointerInfo *i, LassiConnection *lc, int dx, int dy, int *x, int *y, int *edge);
+
+#endif
@@ -0,0 +1,197 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "lassi-policy.h"
+#include "lassi-server.h"
+
+/* ~/.config/mango-lassi/clipboard is written by the user, e.g.
+ *
+ *   [Clipboard]
+ *   Enabled=true
+ *   Targets=UTF8_STRING;text/plain
+ *
+ *   [Primary]
+ *   Enabled=true
+ *   DebounceMsec=500
+ *
+ *   [Limits]
+ *   MaxBytes=16777216
+ *   MaxTransfersPerMinute=0
+ *
+ *   [Peer <id>]
+ *   MaxBytes=65536
+ *
+ * Missing keys fall back to the defaults below. */
+
+#define CLIPBOARD_GROUP "Clipboard"
+#define PRIMARY_GROUP "Primary"
+#define LIMITS_GROUP "Limits"
+#define PEER_GROUP_PREFIX "Peer "
+
+/* PRIMARY changes with every text selection, there is no point in
+ * telling the whole mesh about each one while the user drags */
+#define DEFAULT_PRIMARY_DEBOUNCE_MSEC 500
+
+#define DEFAULT_MAX_BYTES (16*1024*1024)
+#define DEFAULT_MAX_TRANSFERS 0
+
+#define TRANSFER_WINDOW_USEC (60*G_USEC_PER_SEC)
+
+static guint get_uint(GKeyFile *key_file, const char *group, const char *key, guint def) {
+    GError *error = NULL;
+    int v;
+
+    v = g_key_file_get_integer(key_file, group, key, &error);
+
+    if (error) {
+        g_error_free(error);
+        return def;
+    }
+
+    return v < 0 ? 0 : (guint) v;
+}
+
+static gboolean get_boolean(GKeyFile *key_file, const char *group, const char *key, gboolean def) {
+    GError *error = NULL;
+    gboolean v;
+
+    v = g_key_file_get_boolean(key_file, group, key, &error);
+
+    if (error) {
+        g_error_free(error);
+        return def;
+    }
+
+    return v;
+}
+
+static void load_selection(LassiPolicyInfo *i, LassiPolicySelection *s, const char *group, guint debounce_msec) {
+    g_assert(i);
+    g_assert(s);
+
+    s->enabled = get_boolean(i->key_file, group, "Enabled", TRUE);
+    s->debounce_msec = get_uint(i->key_file, group, "DebounceMsec", debounce_msec);
+    s->targets = g_key_file_get_string_list(i->key_file, group, "Targets", NULL, NULL);
+}
+
+static LassiPolicySelection *get_selection(LassiPolicyInfo *i, gboolean primary) {
+    g_assert(i);
+
+    return primary ? &i->primary : &i->clipboard;
+}
+
+int lassi_policy_init(LassiPolicyInfo *i, LassiServer *server) {
+    GError *error = NULL;
+
+    g_assert(i);
+    g_assert(server);
+
+    memset(i, 0, sizeof(*i));
+    i->server = server;
+
+    i->filename = g_build_filename(g_get_user_config_dir(), "mango-lassi", "clipboard", NULL);
+    i->key_file = g_key_file_new();
+
+    if (!g_key_file_load_from_file(i->key_file, i->filename, G_KEY_FILE_NONE, &error)) {
+        g_debug("No clipboard policy loaded from %s: %s", i->filename, error->message);
+        g_error_free(error);
+    }
+
+    load_selection(i, &i->clipboard, CLIPBOARD_GROUP, 0);
+    load_selection(i, &i->primary, PRIMARY_GROUP, DEFAULT_PRIMARY_DEBOUNCE_MSEC);
+
+    i->max_bytes = get_uint(i->key_file, LIMITS_GROUP, "MaxBytes", DEFAULT_MAX_BYTES);
+    i->max_transfers = get_uint(i->key_file, LIMITS_GROUP, "MaxTransfersPerMinute", DEFAULT_MAX_TRANSFERS);
+
+    return 0;
+}
+
+void lassi_policy_done(LassiPolicyInfo *i) {
+    g_assert(i);
+
+    g_strfreev(i->clipboard.targets);
+    g_strfreev(i->primary.targets);
+
+    if (i->key_file)
+        g_key_file_free(i->key_file);
+
+    g_free(i->filename);
+
+    memset(i, 0, sizeof(*i));
+}
+
+gboolean lassi_policy_selection_enabled(LassiPolicyInfo *i, gboolean primary) {
+    g_assert(i);
+
+    return get_selection(i, primary)->enabled;
+}
+
+guint lassi_policy_debounce_msec(LassiPolicyInfo *i, gboolean primary) {
+    g_assert(i);
+
+    return get_selection(i, primary)->debounce_msec;
+}
+
+gboolean lassi_policy_target_allowed(LassiPolicyInfo *i, gboolean primary, const char *target) {
+    LassiPolicySelection *s;
+    char **t;
+
+    g_assert(i);
+    g_assert(target);
+
+    s = get_selection(i, primary);
+
+    if (!s->targets)
+        return TRUE;
+
+    for (t = s->targets; *t; t++)
+        if (g_pattern_match_simple(*t, target))
+            return TRUE;
+
+    return FALSE;
+}
+
+gboolean lassi_policy_transfer_allowed(LassiPolicyInfo *i, LassiConnection *lc, int length) {
+    char *group;
+    guint max_bytes, max_transfers;
+    guint64 now;
+
+    g_assert(i);
+    g_assert(lc);
+
+    group = g_strconcat(PEER_GROUP_PREFIX, lc->id, NULL);
+    max_bytes = get_uint(i->key_file, group, "MaxBytes", i->max_bytes);
+    max_transfers = get_uint(i->key_file, group, "MaxTransfersPerMinute", i->max_transfers);
+    g_free(group);
+
+    if (max_bytes > 0 && length > 0 && (guint) length > max_bytes) {
+        g_debug("Refusing %i bytes of clipboard data for %s, limit is %u", length, lc->id, max_bytes);
+        return FALSE;
+    }
+
+    if (max_transfers == 0)
+        return TRUE;
+
+    /* A fixed window is good enough to keep a misbehaving peer from
+     * pulling the clipboard in a loop */
+    now = (guint64) lassi_stats_now();
+
+    if (now - lc->transfer_window >= TRANSFER_WINDOW_USEC) {
+        lc->transfer_window = now;
+        lc->n_transfers = 0;
+    }
+
+    if (lc->n_transfers >= max_transfers) {
+        g_debug("Refusing clipboard transfer for %s, more than %u per minute", lc->id, max_transfers);
+        return FALSE;
+    }
+
+    lc->n_transfers++;
+
+    return TRUE;
+}
@@ -0,0 +1,44 @@
+#ifndef foolassipolicyhfoo
+#define foolassipolicyhfoo
+
+#include <glib.h>
+
+typedef struct LassiPolicyInfo LassiPolicyInfo;
+typedef struct LassiPolicySelection LassiPolicySelection;
+struct LassiServer;
+struct LassiConnection;
+
+struct LassiPolicySelection {
+    gboolean enabled;
+
+    /* Wait this long for a selection to settle before announcing it */
+    guint debounce_msec;
+
+    /* Patterns of the targets we exchange, NULL for all of them */
+    char **targets;
+};
+
+struct LassiPolicyInfo {
+    struct LassiServer *server;
+
+    char *filename;
+    GKeyFile *key_file;
+
+    LassiPolicySelection clipboard, primary;
+
+    /* Defaults for peers without a group of their own, 0 is unlimited */
+    guint max_bytes, max_transfers;
+};
+
+#include "lassi-server.h"
+
+int lassi_policy_init(LassiPolicyInfo *i, LassiServer *server);
+void lassi_policy_done(LassiPolicyInfo *i);
+
+gboolean lassi_policy_selection_enabled(LassiPolicyInfo *i, gboolean primary);
+guint lassi_policy_debounce_msec(LassiPolicyInfo *i, gboolean primary);
+gboolean lassi_policy_target_allowed(LassiPolicyInfo *i, gboolean primary, const char *target);
+
+gboolean lassi_policy_transfer_allowed(LassiPolicyInfo *i, LassiConnection *lc, int length);
+
+#endif
@@ -36,7 +36,7 @@ static void on_add_button_clicked(GtkButton *widget, LassiPrefsInfo *i) {
 
         avahi_address_snprint(a, sizeof(a), aui_service_dialog_get_address(AUI_SERVICE_DIALOG(d)));
         t = g_strdup_printf("tcp:port=%u,host=%s", aui_service_dialog_get_port(AUI_SERVICE_DIALOG(d)), a);
-        lassi_server_connect(i->server,  t);
+        lassi_server_connect_async(i->server, t);
         g_free(t);
     }
 
@@ -103,7 +103,7 @@ static void on_up_button_clicked(GtkButton *widget, LassiPrefsInfo *i) {
 
     // set_order steals the order list
     lassi_server_set_order(i->server, o);
-    lassi_server_send_update_order(i->server, i->server->active_connection);
+    lassi_server_send_update_order(i->server, NULL);
 
     g_list_foreach(selected, (GFunc)gtk_tree_path_free, NULL);
     g_list_free(selected);
@@ -147,7 +147,7 @@ static void on_down_button_clicked(GtkButton *widget, LassiPrefsInfo *i) {
 
     // set_order steals the order list
     lassi_server_set_order(i->server, o);
-    lassi_server_send_update_order(i->server, i->server->active_connection);
+    lassi_server_send_update_order(i->server, NULL);
 
     g_list_foreach(selected, (GFunc)gtk_tree_path_free, NULL);
     g_list_free(selected);
@@ -230,7 +230,7 @@ static void row_deleted_cb(GtkTreeModel *model, GtkTreePath *path, gpointer user
 
     // set_order steals the order list
     lassi_server_set_order(i->server, o);
-    lassi_server_send_update_order(i->server, i->server->active_connection);
+    lassi_server_send_update_order(i->server, NULL);
 
     gtk_tree_path_free(i->inserted_path);
     i->inserted_path = NULL;
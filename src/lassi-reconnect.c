@@ -0,0 +1,269 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "lassi-reconnect.h"
+#include "lassi-server.h"
+
+/* First retry after a quarter of a second, then back off up to a minute */
+#define RETRY_MIN_MSEC 250
+#define RETRY_MAX_MSEC 60000
+
+/* How long a peer may stay away before we give up on it */
+#define GRACE_MSEC 10000
+
+static void peer_free(LassiReconnectPeer *p) {
+    g_assert(p);
+
+    if (p->retry_id > 0)
+        g_source_remove(p->retry_id);
+
+    if (p->grace_id > 0)
+        g_source_remove(p->grace_id);
+
+    g_free(p->id);
+    g_free(p->address);
+    g_free(p);
+}
+
+static void peer_cancel(LassiReconnectPeer *p) {
+    g_assert(p);
+
+    if (p->retry_id > 0) {
+        g_source_remove(p->retry_id);
+        p->retry_id = 0;
+    }
+
+    if (p->grace_id > 0) {
+        g_source_remove(p->grace_id);
+        p->grace_id = 0;
+    }
+
+    p->attempt = 0;
+}
+
+static gboolean retry_cb(gpointer userdata);
+
+static void schedule_retry(LassiReconnectPeer *p) {
+    unsigned delay;
+
+    g_assert(p);
+    g_assert(p->retry_id == 0);
+
+    /* Exponential backoff with +/- 25% jitter, so that a whole mesh
+     * that lost a switch doesn't come back in lock step */
+    delay = MIN((unsigned) RETRY_MIN_MSEC << MIN(p->attempt, 16), RETRY_MAX_MSEC);
+    delay = (unsigned) (delay * g_random_double_range(0.75, 1.25));
+
+    p->attempt++;
+    p->retry_id = g_timeout_add(delay, retry_cb, p);
+
+    g_debug("Retrying %s in %u ms", p->id, delay);
+}
+
+static gboolean retry_cb(gpointer userdata) {
+    LassiReconnectPeer *p = userdata;
+    LassiServer *ls;
+
+    g_assert(p);
+
+    ls = p->info->server;
+    p->retry_id = 0;
+
+    if (lassi_server_is_connected(ls, p->id))
+        return FALSE;
+
+    if (!lassi_server_is_known(ls, p->id)) {
+        /* Removed from the layout in the meantime */
+        lassi_reconnect_forget(p->info, p->id);
+        return FALSE;
+    }
+
+    g_debug("Reconnecting to %s (%s), attempt %u", p->id, p->address, p->attempt);
+    lassi_server_connect_async(ls, p->address);
+
+    /* Keep going until the Hello arrives and lassi_reconnect_resume()
+     * cancels us; a TCP connect alone doesn't mean the peer is back */
+    schedule_retry(p);
+
+    return FALSE;
+}
+
+static gboolean grace_cb(gpointer userdata) {
+    LassiReconnectPeer *p = userdata;
+    LassiServer *ls;
+    char *id, *address;
+
+    g_assert(p);
+
+    ls = p->info->server;
+    p->grace_id = 0;
+    p->lost = FALSE;
+
+    g_debug("%s did not come back in time", p->id);
+
+    /* Drop the selections we kept around in the hope for a quick
+     * resume, unless somebody else took them over in the meantime */
+    if (p->clipboard_generation >= 0 && !ls->clipboard_connection && ls->clipboard_generation == p->clipboard_generation)
+        lassi_clipboard_clear(&ls->clipboard_info, FALSE);
+
+    if (p->primary_generation >= 0 && !ls->primary_connection && ls->primary_generation == p->primary_generation)
+        lassi_clipboard_clear(&ls->clipboard_info, TRUE);
+
+    p->clipboard_generation = p->primary_generation = -1;
+
+    lassi_server_show_welcome(ls, p->id, p->to_left, FALSE);
+
+    /* Now it is gone for good, just like before we tried to resume.
+     * This forgets p as well, which stops the retries */
+    id = g_strdup(p->id);
+    address = g_strdup(p->address);
+
+    lassi_server_remove_lost(ls, id, address);
+
+    g_free(id);
+    g_free(address);
+
+    return FALSE;
+}
+
+int lassi_reconnect_init(LassiReconnectInfo *i, LassiServer *server) {
+    g_assert(i);
+    g_assert(server);
+
+    memset(i, 0, sizeof(*i));
+    i->server = server;
+
+    i->peers = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify) peer_free);
+
+    return 0;
+}
+
+void lassi_reconnect_done(LassiReconnectInfo *i) {
+    g_assert(i);
+
+    if (i->peers)
+        g_hash_table_destroy(i->peers);
+
+    memset(i, 0, sizeof(*i));
+}
+
+void lassi_reconnect_remember(LassiReconnectInfo *i, const char *id, const char *address) {
+    LassiReconnectPeer *p;
+
+    g_assert(i);
+    g_assert(id);
+
+    if (!(p = g_hash_table_lookup(i->peers, id))) {
+        p = g_new0(LassiReconnectPeer, 1);
+        p->info = i;
+        p->id = g_strdup(id);
+        p->clipboard_generation = p->primary_generation = -1;
+        g_hash_table_insert(i->peers, p->id, p);
+    }
+
+    if (address) {
+        g_free(p->address);
+        p->address = g_strdup(address);
+
+        lassi_state_set_address(&i->server->state_info, id, address);
+    }
+}
+
+void lassi_reconnect_forget(LassiReconnectInfo *i, const char *id) {
+    g_assert(i);
+    g_assert(id);
+
+    g_hash_table_remove(i->peers, id);
+    lassi_state_remove_peer(&i->server->state_info, id);
+}
+
+void lassi_reconnect_prewarm(LassiReconnectInfo *i) {
+    char **peers, **id;
+
+    g_assert(i);
+
+    /* Dial everybody we were connected to last time, all at once and
+     * without waiting for Avahi to find them again */
+
+    peers = lassi_state_get_peers(&i->server->state_info);
+
+    for (id = peers; *id; id++) {
+        char *address;
+        guint32 version, capabilities;
+
+        if (strcmp(*id, i->server->id) == 0)
+            continue;
+
+        if (!(address = lassi_state_get_address(&i->server->state_info, *id)))
+            continue;
+
+        lassi_reconnect_remember(i, *id, address);
+
+        /* A peer that told us last time that it knows the membership
+         * rule dials us itself if its id is the smaller one */
+        if (lassi_state_get_capabilities(&i->server->state_info, *id, &version, &capabilities) &&
+            (capabilities & LASSI_CAPABILITY_MEMBERSHIP)) {
+            g_debug("Pre-connecting to %s (%s) by the membership rule", *id, address);
+            lassi_server_add_member(i->server, *id, address, TRUE);
+        } else {
+            g_debug("Pre-connecting to %s (%s)", *id, address);
+            lassi_server_connect_async(i->server, address);
+        }
+
+        g_free(address);
+    }
+
+    g_strfreev(peers);
+}
+
+LassiReconnectPeer* lassi_reconnect_schedule(LassiReconnectInfo *i, const char *id, gboolean to_left, gboolean dial) {
+    LassiReconnectPeer *p;
+
+    g_assert(i);
+    g_assert(id);
+
+    if (!(p = g_hash_table_lookup(i->peers, id)))
+        return NULL;
+
+    peer_cancel(p);
+
+    p->lost = TRUE;
+    p->to_left = to_left;
+    p->clipboard_generation = p->primary_generation = -1;
+
+    p->grace_id = g_timeout_add(GRACE_MSEC, grace_cb, p);
+
+    /* Only one side of a link dials, otherwise both ends would open a
+     * connection at the same time and then drop one as duplicate. Behind
+     * a relay we dial nobody but the relay */
+    if (p->address && dial && strcmp(i->server->id, p->id) < 0)
+        schedule_retry(p);
+
+    return p;
+}
+
+LassiReconnectPeer* lassi_reconnect_resume(LassiReconnectInfo *i, const char *id) {
+    LassiReconnectPeer *p;
+
+    g_assert(i);
+    g_assert(id);
+
+    if (!(p = g_hash_table_lookup(i->peers, id)))
+        return NULL;
+
+    peer_cancel(p);
+
+    if (!p->lost)
+        return NULL;
+
+    p->lost = FALSE;
+
+    g_debug("Resuming session with %s", p->id);
+
+    return p;
+}
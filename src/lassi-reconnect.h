@@ -0,0 +1,45 @@
+#ifndef foolassireconnecthfoo
+#define foolassireconnecthfoo
+
+#include <glib.h>
+
+typedef struct LassiReconnectInfo LassiReconnectInfo;
+typedef struct LassiReconnectPeer LassiReconnectPeer;
+struct LassiServer;
+
+struct LassiReconnectInfo {
+    struct LassiServer *server;
+
+    /* All peers we have been connected to, indexed by id */
+    GHashTable *peers;
+};
+
+struct LassiReconnectPeer {
+    LassiReconnectInfo *info;
+
+    char *id, *address;
+
+    /* Set while the connection is down and we haven't told the user yet */
+    gboolean lost;
+    gboolean to_left;
+
+    /* Selection generations owned by this peer when the link dropped, -1 otherwise */
+    int clipboard_generation, primary_generation;
+
+    unsigned attempt;
+    guint retry_id, grace_id;
+};
+
+#include "lassi-server.h"
+
+int lassi_reconnect_init(LassiReconnectInfo *i, LassiServer *server);
+void lassi_reconnect_done(LassiReconnectInfo *i);
+
+void lassi_reconnect_remember(LassiReconnectInfo *i, const char *id, const char *address);
+void lassi_reconnect_forget(LassiReconnectInfo *i, const char *id);
+void lassi_reconnect_prewarm(LassiReconnectInfo *i);
+
+LassiReconnectPeer* lassi_reconnect_schedule(LassiReconnectInfo *i, const char *id, gboolean to_left, gboolean dial);
+LassiReconnectPeer* lassi_reconnect_resume(LassiReconnectInfo *i, const char *id);
+
+#endif
@@ -0,0 +1,288 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+
+#include <glib.h>
+#include <gtk/gtk.h>
+
+#include "lassi-record.h"
+#include "lassi-server.h"
+
+/* A file starts with this magic, followed by fixed size little endian
+ * records: u32 msec, u8 type, u8 is_press, u16 reserved, i32 x, i32 y,
+ * u32 detail (button number or keysym) */
+#define RECORD_MAGIC "MLREC001"
+#define RECORD_MAGIC_SIZE 8
+#define RECORD_SIZE 20
+
+/* How many events to feed per main loop iteration when replaying as
+ * fast as possible */
+#define REPLAY_BATCH 64
+
+static void pack(guint8 *b, const LassiRecordEvent *e) {
+    guint32 u;
+
+    u = GUINT32_TO_LE(e->msec);
+    memcpy(b, &u, 4);
+    b[4] = (guint8) e->type;
+    b[5] = (guint8) !!e->is_press;
+    b[6] = b[7] = 0;
+    u = GUINT32_TO_LE((guint32) e->x);
+    memcpy(b+8, &u, 4);
+    u = GUINT32_TO_LE((guint32) e->y);
+    memcpy(b+12, &u, 4);
+    u = GUINT32_TO_LE(e->detail);
+    memcpy(b+16, &u, 4);
+}
+
+static void unpack(LassiRecordEvent *e, const guint8 *b) {
+    guint32 u;
+
+    memcpy(&u, b, 4);
+    e->msec = GUINT32_FROM_LE(u);
+    e->type = (LassiRecordType) b[4];
+    e->is_press = !!b[5];
+    memcpy(&u, b+8, 4);
+    e->x = (gint32) GUINT32_FROM_LE(u);
+    memcpy(&u, b+12, 4);
+    e->y = (gint32) GUINT32_FROM_LE(u);
+    memcpy(&u, b+16, 4);
+    e->detail = GUINT32_FROM_LE(u);
+}
+
+static guint32 elapsed_msec(LassiRecordInfo *i) {
+    g_assert(i);
+
+    return (guint32) (g_timer_elapsed(i->timer, NULL) * 1000.0);
+}
+
+static void replay_finish(LassiRecordInfo *i) {
+    g_assert(i);
+
+    i->replaying = FALSE;
+
+    g_message("Replayed %u events in %.3f s, at most %u ms late",
+              i->n_events, g_timer_elapsed(i->timer, NULL), i->max_lateness);
+
+    gtk_main_quit();
+}
+
+static gboolean replay_cb(gpointer userdata) {
+    LassiRecordInfo *i = userdata;
+    guint32 now;
+    unsigned n = 0;
+
+    g_assert(i);
+
+    i->replay_id = 0;
+
+    /* Recorded time, scaled by the replay speed */
+    now = i->speed > 0 ? (guint32) (elapsed_msec(i) * i->speed) : G_MAXUINT32;
+
+    while (i->next_event < i->n_events && i->events[i->next_event].msec <= now) {
+        LassiRecordEvent *e = &i->events[i->next_event++];
+
+        if (i->speed > 0)
+            i->max_lateness = MAX(i->max_lateness, (guint32) ((now - e->msec) / i->speed));
+
+        lassi_grab_replay_event(&i->server->grab_info, e);
+
+        if (i->speed <= 0 && ++n >= REPLAY_BATCH)
+            break;
+    }
+
+    if (i->next_event >= i->n_events) {
+        replay_finish(i);
+        return FALSE;
+    }
+
+    if (i->speed > 0)
+        i->replay_id = g_timeout_add((guint) ((i->events[i->next_event].msec - now) / i->speed), replay_cb, i);
+    else
+        i->replay_id = g_idle_add(replay_cb, i);
+
+    return FALSE;
+}
+
+int lassi_record_init(LassiRecordInfo *i, LassiServer *server) {
+    g_assert(i);
+    g_assert(server);
+
+    memset(i, 0, sizeof(*i));
+    i->server = server;
+
+    return 0;
+}
+
+void lassi_record_done(LassiRecordInfo *i) {
+    g_assert(i);
+
+    if (i->replay_id > 0)
+        g_source_remove(i->replay_id);
+
+    if (i->file)
+        fclose(i->file);
+
+    if (i->timer)
+        g_timer_destroy(i->timer);
+
+    g_free(i->events);
+
+    memset(i, 0, sizeof(*i));
+}
+
+int lassi_record_start(LassiRecordInfo *i, const char *filename) {
+    g_assert(i);
+    g_assert(filename);
+    g_assert(!i->file);
+
+    if (!(i->file = fopen(filename, "wb"))) {
+        g_warning("Failed to open %s for recording: %s", filename, g_strerror(errno));
+        return -1;
+    }
+
+    if (fwrite(RECORD_MAGIC, 1, RECORD_MAGIC_SIZE, i->file) != RECORD_MAGIC_SIZE) {
+        g_warning("Failed to write to %s: %s", filename, g_strerror(errno));
+        fclose(i->file);
+        i->file = NULL;
+        return -1;
+    }
+
+    i->timer = g_timer_new();
+
+    g_debug("Recording input to %s", filename);
+
+    return 0;
+}
+
+int lassi_record_load(LassiRecordInfo *i, const char *filename, double speed) {
+    GError *error = NULL;
+    gchar *data;
+    gsize length;
+    unsigned j;
+
+    g_assert(i);
+    g_assert(filename);
+
+    if (!g_file_get_contents(filename, &data, &length, &error)) {
+        g_warning("Failed to load %s: %s", filename, error->message);
+        g_error_free(error);
+        return -1;
+    }
+
+    if (length < RECORD_MAGIC_SIZE ||
+        memcmp(data, RECORD_MAGIC, RECORD_MAGIC_SIZE) ||
+        (length - RECORD_MAGIC_SIZE) % RECORD_SIZE) {
+        g_warning("%s is not a valid recording.", filename);
+        g_free(data);
+        return -1;
+    }
+
+    i->n_events = (length - RECORD_MAGIC_SIZE) / RECORD_SIZE;
+    i->events = g_new(LassiRecordEvent, MAX(i->n_events, 1));
+
+    for (j = 0; j < i->n_events; j++)
+        unpack(&i->events[j], (guint8*) data + RECORD_MAGIC_SIZE + j * RECORD_SIZE);
+
+    g_free(data);
+
+    /* The recording counts from when mango-lassi was started, the
+     * replay from the first grab, which is when the first event was
+     * recorded, too */
+    for (j = 1; j < i->n_events; j++)
+        i->events[j].msec -= MIN(i->events[j].msec, i->events[0].msec);
+
+    if (i->n_events > 0)
+        i->events[0].msec = 0;
+
+    i->speed = speed;
+    i->next_event = 0;
+
+    g_debug("Loaded %u events from %s, waiting for a remote screen", i->n_events, filename);
+
+    return 0;
+}
+
+void lassi_record_grab_started(LassiRecordInfo *i) {
+    g_assert(i);
+
+    /* The replay starts as soon as input is redirected for the first
+     * time, there's nothing to send before that */
+    if (!i->events || i->replaying || i->next_event > 0)
+        return;
+
+    i->replaying = TRUE;
+    i->timer = g_timer_new();
+
+    replay_cb(i);
+}
+
+void lassi_record_cancel(LassiRecordInfo *i) {
+    g_assert(i);
+
+    if (!i->replaying)
+        return;
+
+    if (i->replay_id > 0) {
+        g_source_remove(i->replay_id);
+        i->replay_id = 0;
+    }
+
+    g_message("Replay cancelled after %u of %u events", i->next_event, i->n_events);
+    replay_finish(i);
+}
+
+void lassi_record_event(LassiRecordInfo *i, LassiRecordType type, int x, int y, unsigned detail, gboolean is_press) {
+    LassiRecordEvent e;
+    guint8 b[RECORD_SIZE];
+
+    g_assert(i);
+
+    if (!i->file)
+        return;
+
+    e.msec = elapsed_msec(i);
+    e.type = type;
+    e.is_press = is_press;
+    e.x = x;
+    e.y = y;
+    e.detail = detail;
+
+    pack(b, &e);
+
+    /* stdio buffers this for us, so the hot path doesn't do a write()
+     * for every single event */
+    if (fwrite(b, 1, RECORD_SIZE, i->file) != RECORD_SIZE) {
+        g_warning("Failed to record event: %s", g_strerror(errno));
+        fclose(i->file);
+        i->file = NULL;
+    }
+}
+
+gboolean lassi_record_next_drained(LassiRecordInfo *i, int *x, int *y) {
+    LassiRecordEvent *e;
+
+    g_assert(i);
+    g_assert(x);
+    g_assert(y);
+
+    /* During replay the motion events that were pulled from the X queue
+     * directly are taken from the recording instead */
+    if (i->next_event >= i->n_events)
+        return FALSE;
+
+    e = &i->events[i->next_event];
+
+    if (e->type != LASSI_RECORD_MOTION_DRAINED)
+        return FALSE;
+
+    *x = e->x;
+    *y = e->y;
+    i->next_event++;
+
+    return TRUE;
+}
@@ -0,0 +1,57 @@
+#ifndef foolassirecordhfoo
+#define foolassirecordhfoo
+
+#include <stdio.h>
+
+#include <glib.h>
+
+typedef struct LassiRecordInfo LassiRecordInfo;
+typedef struct LassiRecordEvent LassiRecordEvent;
+struct LassiServer;
+
+typedef enum LassiRecordType {
+    LASSI_RECORD_MOTION,
+    LASSI_RECORD_MOTION_DRAINED,
+    LASSI_RECORD_BUTTON,
+    LASSI_RECORD_KEY
+} LassiRecordType;
+
+struct LassiRecordEvent {
+    guint32 msec;
+    LassiRecordType type;
+    gboolean is_press;
+    gint32 x, y;
+    guint32 detail;
+};
+
+struct LassiRecordInfo {
+    struct LassiServer *server;
+
+    /* --record */
+    FILE *file;
+    GTimer *timer;
+
+    /* --replay */
+    LassiRecordEvent *events;
+    unsigned n_events, next_event;
+    double speed;
+    guint replay_id;
+    gboolean replaying;
+    guint32 max_lateness;
+};
+
+#include "lassi-server.h"
+
+int lassi_record_init(LassiRecordInfo *i, LassiServer *server);
+void lassi_record_done(LassiRecordInfo *i);
+
+int lassi_record_start(LassiRecordInfo *i, const char *filename);
+int lassi_record_load(LassiRecordInfo *i, const char *filename, double speed);
+
+void lassi_record_grab_started(LassiRecordInfo *i);
+void lassi_record_cancel(LassiRecordInfo *i);
+
+void lassi_record_event(LassiRecordInfo *i, LassiRecordType type, int x, int y, unsigned detail, gboolean is_press);
+gboolean lassi_record_next_drained(LassiRecordInfo *i, int *x, int *y);
+
+#endif
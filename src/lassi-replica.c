@@ -0,0 +1,141 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "lassi-replica.h"
+#include "lassi-order.h"
+
+gboolean lassi_replica_stamped(const LassiStamp *stamp, gboolean has_stamp) {
+    g_assert(stamp);
+
+    return has_stamp && stamp->time > 0;
+}
+
+void lassi_replica_merge_generation(int *generation, gint32 g) {
+    g_assert(generation);
+
+    /* What a peer says in Hello, we never go back */
+    *generation = MAX(*generation, g);
+}
+
+static void stamp_update(LassiStamp *stamp, gboolean has_stamp, guint64 time, const char *origin) {
+    if (has_stamp)
+        lassi_stamp_set(stamp, time, origin);
+    else
+        lassi_stamp_clear(stamp);
+}
+
+LassiReplicaResult lassi_replica_update_grab(int *generation, LassiStamp *stamp, const char *active,
+                                             gint32 g, const char *id,
+                                             gboolean has_stamp, guint64 time, const char *origin) {
+    g_assert(generation);
+    g_assert(stamp);
+    g_assert(active);
+    g_assert(id);
+
+    if (lassi_replica_stamped(stamp, has_stamp)) {
+
+        /* Every peer orders changes the same way, so whatever reaches
+         * us twice, e.g. relayed by older peers, is simply dropped */
+        if (lassi_stamp_compare(stamp, time, origin) <= 0)
+            return LASSI_REPLICA_IGNORED;
+
+        lassi_stamp_set(stamp, time, origin);
+        *generation = MAX(*generation, g);
+
+        return strcmp(active, id) == 0 ? LASSI_REPLICA_UNCHANGED : LASSI_REPLICA_APPLIED;
+    }
+
+    if (strcmp(active, id) == 0)
+        return LASSI_REPLICA_UNCHANGED;
+
+    /* A tie goes to the larger id */
+    if (*generation > g || (*generation == g && strcmp(active, id) > 0))
+        return LASSI_REPLICA_IGNORED;
+
+    stamp_update(stamp, has_stamp, time, origin);
+    *generation = g;
+
+    return LASSI_REPLICA_APPLIED;
+}
+
+LassiReplicaResult lassi_replica_update_order(int *generation, LassiStamp *stamp, GList *order,
+                                              gint32 g, GList *new_order,
+                                              gboolean has_stamp, guint64 time, const char *origin,
+                                              GList **merged) {
+    int c = 0;
+
+    g_assert(generation);
+    g_assert(stamp);
+    g_assert(merged);
+
+    *merged = NULL;
+
+    if (lassi_replica_stamped(stamp, has_stamp)) {
+
+        if (lassi_stamp_compare(stamp, time, origin) <= 0)
+            return LASSI_REPLICA_IGNORED;
+
+        lassi_stamp_set(stamp, time, origin);
+        *generation = MAX(*generation, g);
+
+    } else {
+
+        if (*generation > g)
+            return LASSI_REPLICA_IGNORED;
+
+        stamp_update(stamp, has_stamp, time, origin);
+
+        if ((c = lassi_list_compare(order, new_order)) == 0)
+            return LASSI_REPLICA_UNCHANGED;
+
+        /* Without a stamp the caller passes the result on before it
+         * adopts g, which older peers rely on */
+        if (*generation == g && c > 0)
+            return LASSI_REPLICA_IGNORED;
+    }
+
+    /* Nobody loses peers they know about */
+    *merged = lassi_list_merge(lassi_list_copy(new_order), order);
+
+    if (lassi_list_compare(order, *merged) == 0) {
+        lassi_list_free(*merged);
+        g_list_free(*merged);
+        *merged = NULL;
+    }
+
+    return LASSI_REPLICA_APPLIED;
+}
+
+LassiReplicaResult lassi_replica_update_selection(int *generation, LassiStamp *stamp,
+                                                  gint32 g,
+                                                  gboolean has_stamp, guint64 time, const char *origin) {
+    g_assert(generation);
+    g_assert(stamp);
+
+    if (lassi_replica_stamped(stamp, has_stamp)) {
+
+        /* When two peers take the selection at once, both of them and
+         * everybody else agree on the later one */
+        if (lassi_stamp_compare(stamp, time, origin) <= 0)
+            return LASSI_REPLICA_IGNORED;
+
+        *generation = MAX(*generation, g);
+
+    } else {
+
+        /* Between older peers a tie still goes to whoever comes last */
+        if (*generation > g)
+            return LASSI_REPLICA_IGNORED;
+
+        *generation = g;
+    }
+
+    stamp_update(stamp, has_stamp, time, origin);
+
+    return LASSI_REPLICA_APPLIED;
+}
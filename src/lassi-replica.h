@@ -0,0 +1,46 @@
+#ifndef foolassireplicahfoo
+#define foolassireplicahfoo
+
+#include <glib.h>
+
+#include "lassi-clock.h"
+
+/* The rules by which every peer decides whether to take over a change
+ * of the replicated state: the active peer, the layout order and the
+ * selection owners. Nothing here sends or touches anything but the
+ * state passed in, so that lassi-server.c and the simulator in
+ * lassi-sim.c run the very same code.
+ *
+ * has_stamp says whether the change came with a stamp from the clock of
+ * its origin. A change is only ordered by its stamp once we have a stamp
+ * of our own to compare with, otherwise the generations decide as they
+ * did between older peers. */
+
+typedef enum LassiReplicaResult {
+    /* Older than what we have, nothing changed */
+    LASSI_REPLICA_IGNORED,
+    /* Taken over, but the value stays the same */
+    LASSI_REPLICA_UNCHANGED,
+    LASSI_REPLICA_APPLIED
+} LassiReplicaResult;
+
+gboolean lassi_replica_stamped(const LassiStamp *stamp, gboolean has_stamp);
+
+void lassi_replica_merge_generation(int *generation, gint32 g);
+
+LassiReplicaResult lassi_replica_update_grab(int *generation, LassiStamp *stamp, const char *active,
+                                             gint32 g, const char *id,
+                                             gboolean has_stamp, guint64 time, const char *origin);
+
+/* Once taken over, *merged is the new order if it differs from ours.
+ * The sender might still have left out peers we know about */
+LassiReplicaResult lassi_replica_update_order(int *generation, LassiStamp *stamp, GList *order,
+                                              gint32 g, GList *new_order,
+                                              gboolean has_stamp, guint64 time, const char *origin,
+                                              GList **merged);
+
+LassiReplicaResult lassi_replica_update_selection(int *generation, LassiStamp *stamp,
+                                                  gint32 g,
+                                                  gboolean has_stamp, guint64 time, const char *origin);
+
+#endif
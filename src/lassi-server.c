@@ -3,12 +3,14 @@
 #endif
 
 #include <unistd.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <netdb.h>
 #include <libintl.h>
 
 #include <dbus/dbus-glib.h>
@@ -21,30 +23,109 @@
 #include "lassi-server.h"
 #include "lassi-grab.h"
 #include "lassi-order.h"
+#include "lassi-replica.h"
 #include "lassi-clipboard.h"
 #include "lassi-avahi.h"
 #include "lassi-tray.h"
+#include "lassi-trace.h"
 
 #include "paths.h"
 
-#define LASSI_INTERFACE "org.gnome.MangoLassi"
-
 #define PORT_MIN 7421
 #define PORT_MAX (PORT_MIN + 50)
 
 #define CONNECTIONS_MAX 16
 
+/* How many outgoing connects may block in parallel */
+#define CONNECT_THREADS_MAX 8
+
+/* How long a click or key press may wait for the motion it follows */
+#define HELD_INPUT_MSEC 20
+
+/* While the pointer sweeps across screens only the two peers involved
+ * in a hand-off hear about it right away, everybody else once it came
+ * to rest for this long */
+#define HAND_OFF_SETTLE_MSEC 150
+
+/* Size of the --trace ring buffer, roughly a minute of busy pointer */
+#define TRACE_RECORDS 65536
+
+/* How long we wait for a joining peer that is supposed to dial us
+ * before we dial it ourselves */
+#define DIAL_FALLBACK_MSEC 3000
+
+typedef struct AwaitedPeer {
+    LassiServer *server;
+    char *id, *address;
+    guint timeout_id;
+} AwaitedPeer;
+
 static void server_disconnect_all(LassiServer *ls, gboolean clear_order);
 static void server_send_update_grab(LassiServer *ls, int y);
+static void connect_thread(gpointer data, gpointer userdata);
+static struct ConnectState* connect_state_new(void);
+static void server_cancel_connects(LassiServer *ls);
+static void connection_flush_input(LassiConnection *lc, gboolean force);
+static LassiConnection* connection_add_relayed(LassiServer *ls, LassiConnection *relay, const char *id, gboolean we_are_client);
+static DBusHandlerResult message_function(DBusConnection *c, DBusMessage *m, void *userdata);
+
+static void connection_send_relayed(LassiConnection *lc, DBusMessage *m) {
+    DBusMessage *n;
+    char *data;
+    int length;
+    dbus_bool_t b;
+
+    g_assert(lc);
+    g_assert(lc->relay);
+    g_assert(m);
+
+    /* The relay only looks at the addresses and passes the frame on as
+     * it is */
+    b = dbus_message_marshal(m, &data, &length);
+    g_assert(b);
+
+    n = dbus_message_new_signal("/", LASSI_INTERFACE, "Relayed");
+    g_assert(n);
+
+    b = dbus_message_append_args(n,
+                                 DBUS_TYPE_STRING, &lc->server->id,
+                                 DBUS_TYPE_STRING, &lc->relay_to,
+                                 DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE, &data, length,
+                                 DBUS_TYPE_INVALID);
+    g_assert(b);
+
+    lassi_connection_send(lc->relay, n);
+    lassi_stats_message_sent(&lc->stats, lc->dbus_connection, m);
+
+    dbus_message_unref(n);
+    dbus_free(data);
+}
+
+void lassi_connection_send(LassiConnection *lc, DBusMessage *m) {
+    dbus_bool_t b;
+
+    g_assert(lc);
+    g_assert(m);
+
+    if (lc->relay) {
+        connection_send_relayed(lc, m);
+        return;
+    }
+
+    b = dbus_connection_send(lc->dbus_connection, m, NULL);
+    g_assert(b);
 
-static void server_broadcast(LassiServer *ls, DBusMessage *m, LassiConnection *except) {
+    lassi_stats_message_sent(&lc->stats, lc->dbus_connection, m);
+}
+
+static unsigned server_broadcast(LassiServer *ls, DBusMessage *m, LassiConnection *except) {
     GList *i;
+    unsigned n_sent = 0;
 
     g_assert(ls);
     g_assert(m);
 
     for (i = ls->connections; i; i = i->next) {
-        dbus_bool_t b;
         LassiConnection *lc = i->data;
         DBusMessage *n;
 
@@ -53,10 +134,43 @@ static void server_broadcast(LassiServer *ls, DBusMessage *m, LassiConnection *e
 
         n = dbus_message_copy(m);
         g_assert(n);
-        b = dbus_connection_send(lc->dbus_connection, n, NULL);
-        g_assert(b);
+        lassi_connection_send(lc, n);
         dbus_message_unref(n);
+
+        n_sent++;
     }
+
+    return n_sent;
+}
+
+static void connection_send_unreachable(LassiConnection *lc, const char *id) {
+    DBusMessage *n;
+    dbus_bool_t b;
+
+    g_assert(lc);
+    g_assert(id);
+
+    n = dbus_message_new_signal("/", LASSI_INTERFACE, "Unreachable");
+    g_assert(n);
+
+    b = dbus_message_append_args(n, DBUS_TYPE_STRING, &id, DBUS_TYPE_INVALID);
+    g_assert(b);
+
+    lassi_connection_send(lc, n);
+    dbus_message_unref(n);
+}
+
+/* The generations go along with the order, so that after a restart we
+ * neither lose our layout nor have our first changes ignored */
+static void server_save_state(LassiServer *ls) {
+    g_assert(ls);
+
+    lassi_state_set_order(&ls->state_info, ls->order);
+    lassi_state_set_generations(&ls->state_info,
+                                ls->active_generation,
+                                ls->order_generation,
+                                ls->clipboard_generation,
+                                ls->primary_generation);
 }
 
 static void server_layout_changed(LassiServer *ls, int y) {
@@ -137,6 +251,7 @@ void lassi_server_set_order(LassiServer *ls, GList *order) {
 
     ls->connections_right = g_list_reverse(ls->connections_right);
     server_layout_changed(ls, -1);
+    server_save_state(ls);
 
     lassi_prefs_update(&ls->prefs_info);
 }
@@ -171,12 +286,37 @@ static void server_dump(LassiServer *ls) {
     g_debug("END");
 }
 
+typedef struct HeldInput {
+    gboolean is_key;
+    guint32 code;
+    gboolean is_press;
+    guint32 serial;
+} HeldInput;
+
 static void connection_destroy(LassiConnection *lc) {
     g_assert(lc);
 
-    dbus_connection_flush(lc->dbus_connection);
-    dbus_connection_close(lc->dbus_connection);
+    if (lc->held_input_id > 0)
+        g_source_remove(lc->held_input_id);
+
+    while (!g_queue_is_empty(lc->held_input))
+        g_free(g_queue_pop_head(lc->held_input));
+
+    g_queue_free(lc->held_input);
+
+    /* The link itself belongs to the relay */
+    if (lc->relay)
+        g_hash_table_remove(lc->relay->relayed, lc->relay_to);
+    else {
+        dbus_connection_flush(lc->dbus_connection);
+        dbus_connection_close(lc->dbus_connection);
+    }
+
     dbus_connection_unref(lc->dbus_connection);
+    g_hash_table_destroy(lc->relayed);
+    g_hash_table_destroy(lc->parameters);
+    g_free(lc->relay_to);
+    lassi_geometry_free(lc->geometry);
     g_free(lc->id);
     g_free(lc->address);
     g_free(lc);
@@ -208,20 +348,84 @@ static void server_pick_active_connection(LassiServer *ls) {
     server_layout_changed(ls, -1);
 }
 
-static void server_send_update_grab(LassiServer *ls, int y) {
-    char *active;
-    DBusMessage *n;
+static void server_tick(LassiServer *ls, LassiStamp *s) {
+    g_assert(ls);
+    g_assert(s);
+
+    lassi_stamp_set(s, lassi_clock_tick(&ls->clock_info), ls->id);
+}
+
+static void message_append_stamp(DBusMessage *n, const LassiStamp *s) {
     dbus_bool_t b;
-    gint32 g;
 
-    g_assert(ls);
+    g_assert(n);
+    g_assert(s);
 
-    active = ls->active_connection ? ls->active_connection->id : ls->id;
+    /* We never changed it ourselves and got it from a peer without a
+     * clock, the generation has to do */
+    if (s->time == 0)
+        return;
+
+    /* Always the last two arguments, older peers don't look at them */
+    b = dbus_message_append_args(n, DBUS_TYPE_UINT64, &s->time, DBUS_TYPE_STRING, &s->origin, DBUS_TYPE_INVALID);
+    g_assert(b);
+}
+
+static gboolean connection_get_stamp(LassiConnection *lc, DBusMessage *m, guint64 *time, const char **origin) {
+    DBusMessageIter iter;
+    unsigned n, j;
+
+    g_assert(lc);
+    g_assert(m);
+    g_assert(time);
+    g_assert(origin);
+
+    if (!lassi_connection_has_capability(lc, LASSI_CAPABILITY_CLOCK))
+        return FALSE;
+
+    if (!dbus_message_iter_init(m, &iter))
+        return FALSE;
+
+    for (n = 1; dbus_message_iter_next(&iter); n++)
+        ;
+
+    if (n < 2)
+        return FALSE;
+
+    /* Skip the arguments of the signal itself */
+    dbus_message_iter_init(m, &iter);
+
+    for (j = 0; j < n - 2; j++)
+        dbus_message_iter_next(&iter);
+
+    if (dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_UINT64)
+        return FALSE;
+
+    dbus_message_iter_get_basic(&iter, time);
+    dbus_message_iter_next(&iter);
+
+    if (dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_STRING)
+        return FALSE;
+
+    dbus_message_iter_get_basic(&iter, origin);
+
+    if (*time == 0)
+        return FALSE;
+
+    lassi_clock_witness(&lc->server->clock_info, *time);
+
+    return TRUE;
+}
+
+static DBusMessage* update_grab_new(const char *active, gint32 g, int y) {
+    DBusMessage *n;
+    dbus_bool_t b;
+
+    g_assert(active);
 
     n = dbus_message_new_signal("/", LASSI_INTERFACE, "UpdateGrab");
     g_assert(n);
 
-    g = ++ ls->active_generation;
     b = dbus_message_append_args(
             n,
             DBUS_TYPE_INT32, &g,
@@ -230,11 +434,148 @@ static void server_send_update_grab(LassiServer *ls, int y) {
             DBUS_TYPE_INVALID);
     g_assert(b);
 
-    server_broadcast(ls, n, NULL);
+    return n;
+}
+
+static DBusMessage* server_new_update_grab(LassiServer *ls, int y) {
+    char *active;
+    gint32 g;
+
+    g_assert(ls);
+
+    active = ls->active_connection ? ls->active_connection->id : ls->id;
+
+    g = ++ ls->active_generation;
+    server_save_state(ls);
+
+    return update_grab_new(active, g, y);
+}
+
+static void server_drop_pending_grab(LassiServer *ls) {
+    g_assert(ls);
+
+    if (ls->pending_grab_id > 0) {
+        g_source_remove(ls->pending_grab_id);
+        ls->pending_grab_id = 0;
+    }
+
+    if (ls->pending_grab) {
+        dbus_message_unref(ls->pending_grab);
+        ls->pending_grab = NULL;
+    }
+}
+
+static void server_send_update_grab(LassiServer *ls, int y) {
+    DBusMessage *n;
+
+    g_assert(ls);
+
+    /* Whatever a hand-off left pending is outdated now */
+    server_drop_pending_grab(ls);
+
+    server_tick(ls, &ls->active_stamp);
+
+    n = server_new_update_grab(ls, y);
+    message_append_stamp(n, &ls->active_stamp);
+
+    ls->stats_info.updates_sent += server_broadcast(ls, n, NULL);
     dbus_message_unref(n);
 }
 
-void lassi_server_send_update_order(LassiServer *ls, LassiConnection *except) {
+static gboolean pending_grab_cb(gpointer userdata) {
+    LassiServer *ls = userdata;
+
+    g_assert(ls);
+    g_assert(ls->pending_grab);
+
+    ls->pending_grab_id = 0;
+
+    /* The peers we already told will notice that they are up to date
+     * and won't pass it on again */
+    ls->stats_info.updates_sent += server_broadcast(ls, ls->pending_grab, NULL);
+
+    dbus_message_unref(ls->pending_grab);
+    ls->pending_grab = NULL;
+
+    return FALSE;
+}
+
+static void connection_send_direct_grab(LassiConnection *lc, DBusMessage *m) {
+    DBusMessage *n;
+    dbus_bool_t b, relay = FALSE;
+
+    g_assert(lc);
+    g_assert(m);
+
+    n = dbus_message_copy(m);
+    g_assert(n);
+
+    /* Peers that know about it don't pass this on, the mesh learns about
+     * it from pending_grab_cb() */
+    if (lassi_connection_has_capability(lc, LASSI_CAPABILITY_DIRECT_GRAB)) {
+        b = dbus_message_append_args(n, DBUS_TYPE_BOOLEAN, &relay, DBUS_TYPE_INVALID);
+        g_assert(b);
+    }
+
+    /* Peers without a clock compare the exact signature */
+    if (lassi_connection_has_capability(lc, LASSI_CAPABILITY_CLOCK))
+        message_append_stamp(n, &lc->server->active_stamp);
+
+    lassi_connection_send(lc, n);
+    lc->server->stats_info.updates_sent++;
+
+    dbus_message_unref(n);
+}
+
+static void server_hand_off_grab(LassiServer *ls, LassiConnection *old, int y, int screen_y) {
+    DBusMessage *n;
+    LassiConnection *lc = ls->active_connection;
+
+    g_assert(ls);
+
+    server_tick(ls, &ls->active_stamp);
+
+    /* The stamp goes after the relay flag, see
+     * connection_send_direct_grab() */
+    n = server_new_update_grab(ls, y);
+
+    /* Tell the peer that loses and the one that gains the pointer
+     * right away, they are the only ones who have to act on it */
+    if (old)
+        connection_send_direct_grab(old, n);
+
+    if (lc && lc != old) {
+
+        /* Only the one that gains the pointer acts on y. An older one
+         * gets it on the whole height of the screen, in the same
+         * generation, so whatever else reaches it later is a
+         * duplicate */
+        if (!lassi_connection_has_capability(lc, LASSI_CAPABILITY_EDGE_Y)) {
+            DBusMessage *m;
+
+            m = update_grab_new(lc->id, ls->active_generation, screen_y);
+            connection_send_direct_grab(lc, m);
+            dbus_message_unref(m);
+        } else
+            connection_send_direct_grab(lc, n);
+    }
+
+    message_append_stamp(n, &ls->active_stamp);
+
+    /* Everybody else only needs to know where the pointer ended up,
+     * so a sweep across a row of screens costs two messages per hop */
+    if (ls->pending_grab)
+        dbus_message_unref(ls->pending_grab);
+
+    ls->pending_grab = n;
+
+    if (ls->pending_grab_id > 0)
+        g_source_remove(ls->pending_grab_id);
+
+    ls->pending_grab_id = g_timeout_add(HAND_OFF_SETTLE_MSEC, pending_grab_cb, ls);
+}
+
+static DBusMessage* server_new_update_order(LassiServer *ls) {
     DBusMessage *n;
     dbus_bool_t b;
     gint32 g;
@@ -247,6 +588,8 @@ void lassi_server_send_update_order(LassiServer *ls, LassiConnection *except) {
     g_assert(n);
 
     g = ++ ls->order_generation;
+    server_save_state(ls);
+
     b = dbus_message_append_args(
             n,
             DBUS_TYPE_INT32, &g,
@@ -266,13 +609,27 @@ void lassi_server_send_update_order(LassiServer *ls, LassiConnection *except) {
     b = dbus_message_iter_close_container(&iter, &sub);
     g_assert(b);
 
-    server_broadcast(ls, n, except);
+    message_append_stamp(n, &ls->order_stamp);
+
+    return n;
+}
+
+void lassi_server_send_update_order(LassiServer *ls, LassiConnection *except) {
+    DBusMessage *n;
+
+    g_assert(ls);
+
+    server_tick(ls, &ls->order_stamp);
+
+    n = server_new_update_order(ls);
+    ls->stats_info.updates_sent += server_broadcast(ls, n, except);
     dbus_message_unref(n);
 }
 
 int lassi_server_change_grab(LassiServer *ls, gboolean to_left, int y) {
     LassiConnection *lc;
     GList *l;
+    int screen_y;
 
     g_assert(ls);
 
@@ -283,39 +640,136 @@ int lassi_server_change_grab(LassiServer *ls, gboolean to_left, int y) {
         return -1;
 
     ls->active_connection = lc;
+    lc->stats.handoffs++;
+
+    lassi_pointer_enter(&ls->pointer_info, lc, to_left, y);
+
+    screen_y = y >= 0 && y < 0xFFFF ? lassi_geometry_edge_to_screen(ls->grab_info.geometry, to_left, y) : -1;
 
-    server_send_update_grab(ls, y);
+    server_hand_off_grab(ls, NULL, y, screen_y);
     server_layout_changed(ls, y);
     return 0;
 }
 
 int lassi_server_acquire_grab(LassiServer *ls) {
+    LassiConnection *old;
+
     g_assert(ls);
 
+    old = ls->active_connection;
     ls->active_connection = NULL;
 
-    server_send_update_grab(ls, -1);
+    server_hand_off_grab(ls, old, -1, -1);
     server_layout_changed(ls, -1);
     return 0;
 }
 
+static void server_append_motion_serial(LassiServer *ls, DBusMessage *n) {
+    dbus_bool_t b;
+
+    g_assert(ls);
+    g_assert(ls->active_connection);
+
+    if (!lassi_connection_has_capability(ls->active_connection, LASSI_CAPABILITY_MOTION_SERIAL))
+        return;
+
+    b = dbus_message_append_args(n, DBUS_TYPE_UINT32, &ls->active_connection->motion_sent, DBUS_TYPE_INVALID);
+    g_assert(b);
+}
+
+static gboolean server_cross_edge(LassiServer *ls, gboolean to_left, int y) {
+    LassiConnection *lc, *next;
+    GList *l;
+    gboolean is_left;
+    int screen_y;
+
+    g_assert(ls);
+    g_assert(ls->active_connection);
+
+    lc = ls->active_connection;
+
+    if ((l = g_list_find(ls->connections_left, lc)))
+        is_left = TRUE;
+    else if ((l = g_list_find(ls->connections_right, lc)))
+        is_left = FALSE;
+    else
+        return FALSE;
+
+    /* Like the trigger windows we don't hand off in the middle of a
+     * drag or while a key is down, the release would go elsewhere and
+     * leave it stuck on their side */
+    if (lassi_grab_input_held(&ls->grab_info))
+        return FALSE;
+
+    /* The lists are sorted by distance from us, so moving away from us
+     * means going down the list and moving towards us going up */
+    if (is_left == to_left) {
+        if (!l->next)
+            return FALSE;
+
+        next = l->next->data;
+    } else
+        next = l->prev ? l->prev->data : NULL;
+
+    y = lassi_geometry_edge_to_global(lc->geometry, to_left, y);
+    screen_y = lassi_geometry_edge_to_screen(lc->geometry, to_left, y);
+
+    g_debug("Pointer left %s to the %s", lc->id, to_left ? "left" : "right");
+
+    ls->active_connection = next;
+
+    if (next) {
+        next->stats.handoffs++;
+        lassi_pointer_enter(&ls->pointer_info, next, to_left, y);
+    }
+
+    server_hand_off_grab(ls, lc, y, screen_y);
+    server_layout_changed(ls, y);
+
+    return TRUE;
+}
+
 int lassi_server_motion_event(LassiServer *ls, int dx, int dy) {
     DBusMessage *n;
     dbus_bool_t b;
+    int x, y, edge;
 
     g_assert(ls);
 
     if (!ls->active_connection)
         return -1;
 
-    n = dbus_message_new_signal("/", LASSI_INTERFACE, "MotionEvent");
-    g_assert(n);
+    /* If we know their geometry we run the acceleration ourselves and
+     * tell them exactly where to put the pointer */
+    if (lassi_pointer_move(&ls->pointer_info, ls->active_connection, dx, dy, &x, &y, &edge)) {
 
-    b = dbus_message_append_args(n, DBUS_TYPE_INT32, &dx, DBUS_TYPE_INT32, &dy, DBUS_TYPE_INVALID);
-    g_assert(b);
+        if (edge != 0 && server_cross_edge(ls, edge < 0, y))
+            return 0;
 
-    b = dbus_connection_send(ls->active_connection->dbus_connection, n, NULL);
-    g_assert(b);
+        n = dbus_message_new_signal("/", LASSI_INTERFACE, "MotionAbsoluteEvent");
+        g_assert(n);
+
+        b = dbus_message_append_args(n, DBUS_TYPE_INT32, &x, DBUS_TYPE_INT32, &y, DBUS_TYPE_INVALID);
+        g_assert(b);
+
+        lassi_trace(LASSI_TRACE_SEND_MOTION_ABSOLUTE, x, y, ls->active_connection->motion_sent + 1);
+
+    } else {
+
+        n = dbus_message_new_signal("/", LASSI_INTERFACE, "MotionEvent");
+        g_assert(n);
+
+        b = dbus_message_append_args(n, DBUS_TYPE_INT32, &dx, DBUS_TYPE_INT32, &dy, DBUS_TYPE_INVALID);
+        g_assert(b);
+
+        lassi_trace(LASSI_TRACE_SEND_MOTION, dx, dy, ls->active_connection->motion_sent + 1);
+    }
+
+    ls->active_connection->motion_sent++;
+    server_append_motion_serial(ls, n);
+
+    lassi_connection_send(ls->active_connection, n);
+    ls->active_connection->stats.input_sent++;
 
     dbus_message_unref(n);
 
@@ -337,8 +791,10 @@ int lassi_server_button_event(LassiServer *ls, unsigned button, gboolean is_pres
     b = dbus_message_append_args(n, DBUS_TYPE_UINT32, &button, DBUS_TYPE_BOOLEAN, &is_press, DBUS_TYPE_INVALID);
     g_assert(b);
 
-    b = dbus_connection_send(ls->active_connection->dbus_connection, n, NULL);
-    g_assert(b);
+    server_append_motion_serial(ls, n);
+
+    lassi_connection_send(ls->active_connection, n);
+    ls->active_connection->stats.input_sent++;
 
     dbus_message_unref(n);
 
@@ -360,8 +816,10 @@ int lassi_server_key_event(LassiServer *ls, unsigned key, gboolean is_press) {
     b = dbus_message_append_args(n, DBUS_TYPE_UINT32, &key, DBUS_TYPE_BOOLEAN, &is_press, DBUS_TYPE_INVALID);
     g_assert(b);
 
-    b = dbus_connection_send(ls->active_connection->dbus_connection, n, NULL);
-    g_assert(b);
+    server_append_motion_serial(ls, n);
+
+    lassi_connection_send(ls->active_connection, n);
+    ls->active_connection->stats.input_sent++;
 
     dbus_message_unref(n);
 
@@ -370,22 +828,26 @@ int lassi_server_key_event(LassiServer *ls, unsigned key, gboolean is_press) {
     return 0;
 }
 
-static void show_welcome(LassiConnection *lc, gboolean is_connect) {
-    gboolean to_left;
-    LassiServer *ls;
-    char *summary, *body;
+gboolean lassi_server_peer_repeats_keys(LassiServer *ls) {
+    g_assert(ls);
 
-    g_assert(lc);
+    /* Their X server repeats keys that are held down via XTest at the
+     * rate set up over there, so all they need is press and release */
+    return ls->active_connection && lassi_connection_has_capability(ls->active_connection, LASSI_CAPABILITY_KEY_REPEAT);
+}
 
-    ls = lc->server;
-    to_left = !!g_list_find(ls->connections_left, lc);
+void lassi_server_show_welcome(LassiServer *ls, const char *id, gboolean to_left, gboolean is_connect) {
+    char *summary, *body;
+
+    g_assert(ls);
+    g_assert(id);
 
     if (is_connect) {
-        summary = g_strdup_printf(_("%s now shares input with this desktop"), lc->id);
-        body = g_strdup_printf(_("You're now sharing keyboard and mouse with <b>%s</b> which is located to the <b>%s</b>."), lc->id, to_left ? _("left") : _("right"));
+        summary = g_strdup_printf(_("%s now shares input with this desktop"), id);
+        body = g_strdup_printf(_("You're now sharing keyboard and mouse with <b>%s</b> which is located to the <b>%s</b>."), id, to_left ? _("left") : _("right"));
     } else {
-        summary = g_strdup_printf(_("%s no longer shares input with this desktop"), lc->id);
-        body = g_strdup_printf(_("You're no longer sharing keyboard and mouse with <b>%s</b> which was located to the <b>%s</b>."), lc->id, to_left ? _("left") : _("right"));
+        summary = g_strdup_printf(_("%s no longer shares input with this desktop"), id);
+        body = g_strdup_printf(_("You're no longer sharing keyboard and mouse with <b>%s</b> which was located to the <b>%s</b>."), id, to_left ? _("left") : _("right"));
     }
 
     lassi_tray_show_notification(&ls->tray_info, summary, body, to_left ? LASSI_TRAY_NOTIFICATION_LEFT : LASSI_TRAY_NOTIFICATION_RIGHT);
@@ -394,6 +856,12 @@ static void show_welcome(LassiConnection *lc, gboolean is_connect) {
     g_free(body);
 }
 
+static void show_welcome(LassiConnection *lc, gboolean is_connect) {
+    g_assert(lc);
+
+    lassi_server_show_welcome(lc->server, lc->id, !!g_list_find(lc->server->connections_left, lc), is_connect);
+}
+
 static void connection_unlink(LassiConnection *lc, gboolean remove_from_order) {
     LassiServer *ls;
     g_assert(lc);
@@ -402,7 +870,27 @@ static void connection_unlink(LassiConnection *lc, gboolean remove_from_order) {
 
     ls = lc->server;
 
-    if (lc->id) {
+    /* The peers behind a relay go down with it. Only we can't reach
+     * them any more, so nobody else needs to hear about it */
+    if (g_hash_table_size(lc->relayed) > 0) {
+        GList *relayed, *l;
+
+        relayed = g_hash_table_get_values(lc->relayed);
+
+        for (l = relayed; l; l = l->next) {
+            LassiConnection *k = l->data;
+
+            k->lost = TRUE;
+            connection_unlink(k, FALSE);
+        }
+
+        g_list_free(relayed);
+    }
+
+    /* A lost link is nobody else's business, they have their own
+     * connections to the peer and the reconnect logic will take care
+     * of us */
+    if (lc->id && !lc->lost) {
         DBusMessage *n;
         dbus_bool_t b;
 
@@ -419,13 +907,26 @@ static void connection_unlink(LassiConnection *lc, gboolean remove_from_order) {
 
         server_broadcast(ls, n, NULL);
         dbus_message_unref(n);
+
+    } else if (lc->id && ls->hub && !lc->relay) {
+        GList *l;
+
+        /* The peers that reach this one through us have no link of their
+         * own that could tell them it is gone */
+        for (l = ls->connections; l; l = l->next) {
+            LassiConnection *k = l->data;
+
+            if (k != lc && k->id && !k->relay && lassi_connection_has_capability(k, LASSI_CAPABILITY_RELAY))
+                connection_send_unreachable(k, lc->id);
+        }
     }
 
     ls->connections = g_list_remove(ls->connections, lc);
     ls->n_connections --;
 
     if (lc->id) {
-        show_welcome(lc, FALSE);
+        if (!lc->lost)
+            show_welcome(lc, FALSE);
 
         g_hash_table_remove(ls->connections_by_id, lc->id);
         ls->connections_left = g_list_remove(ls->connections_left, lc);
@@ -434,16 +935,22 @@ static void connection_unlink(LassiConnection *lc, gboolean remove_from_order) {
         if (ls->active_connection == lc)
             server_pick_active_connection(ls);
 
+        /* If we hope for a resume we leave the local selection alone
+         * for now, see connection_lost() */
         if (ls->clipboard_connection == lc) {
             ls->clipboard_connection = NULL;
             ls->clipboard_empty = TRUE;
-            lassi_clipboard_clear(&lc->server->clipboard_info, FALSE);
+
+            if (!lc->lost)
+                lassi_clipboard_clear(&lc->server->clipboard_info, FALSE);
         }
 
         if (ls->primary_connection == lc) {
             ls->primary_connection = NULL;
             ls->primary_empty = TRUE;
-            lassi_clipboard_clear(&lc->server->clipboard_info, TRUE);
+
+            if (!lc->lost)
+                lassi_clipboard_clear(&lc->server->clipboard_info, TRUE);
         }
 
         if (remove_from_order) {
@@ -451,6 +958,9 @@ static void connection_unlink(LassiConnection *lc, gboolean remove_from_order) {
 
             if (i)
                 ls->order = g_list_delete_link(ls->order, i);
+
+            lassi_reconnect_forget(&ls->reconnect_info, lc->id);
+            server_save_state(ls);
         }
 
         server_layout_changed(ls, -1);
@@ -460,9 +970,89 @@ static void connection_unlink(LassiConnection *lc, gboolean remove_from_order) {
 
     lassi_tray_update(&ls->tray_info, ls->n_connections);
 
+    /* Better inject late than leave a key stuck */
+    connection_flush_input(lc, TRUE);
+
     connection_destroy(lc);
 }
 
+static gboolean connection_is_relay(LassiConnection *lc) {
+    const char *v;
+
+    g_assert(lc);
+
+    /* Only a direct link to a peer started with --hub will do */
+    return
+        !lc->relay && lc->id &&
+        lassi_connection_has_capability(lc, LASSI_CAPABILITY_RELAY) &&
+        (v = lassi_connection_get_parameter(lc, "relay")) &&
+        strcmp(v, "yes") == 0;
+}
+
+static LassiConnection* server_find_relay(LassiServer *ls, LassiConnection *except) {
+    GList *l;
+
+    g_assert(ls);
+
+    for (l = ls->connections; l; l = l->next) {
+        LassiConnection *lc = l->data;
+
+        if (lc != except && connection_is_relay(lc))
+            return lc;
+    }
+
+    return NULL;
+}
+
+static void connection_lost(LassiConnection *lc) {
+    LassiServer *ls;
+    LassiReconnectPeer *p;
+    LassiConnection *relay = NULL;
+    GList *rerouted = NULL, *l;
+
+    g_assert(lc);
+
+    ls = lc->server;
+
+    /* If we have a second relay we move the peers behind this one over */
+    if (g_hash_table_size(lc->relayed) > 0 && (relay = server_find_relay(ls, lc))) {
+        GHashTableIter k;
+        gpointer key;
+
+        g_hash_table_iter_init(&k, lc->relayed);
+        while (g_hash_table_iter_next(&k, &key, NULL))
+            rerouted = g_list_prepend(rerouted, g_strdup(key));
+    }
+
+    if (lc->id &&
+        (p = lassi_reconnect_schedule(&ls->reconnect_info, lc->id, !!g_list_find(ls->connections_left, lc),
+                                      !ls->relay_mode || connection_is_relay(lc)))) {
+
+        g_debug("Lost connection to %s, trying to resume", lc->id);
+
+        lc->lost = TRUE;
+
+        if (ls->clipboard_connection == lc)
+            p->clipboard_generation = ls->clipboard_generation;
+
+        if (ls->primary_connection == lc)
+            p->primary_generation = ls->primary_generation;
+    }
+
+    connection_unlink(lc, FALSE);
+
+    for (l = rerouted; l; l = l->next) {
+        const char *id = l->data;
+
+        if (!g_hash_table_lookup(ls->connections_by_id, id) && !g_hash_table_lookup(relay->relayed, id))
+            connection_add_relayed(ls, relay, id, TRUE);
+
+        g_free(l->data);
+    }
+
+    g_list_free(rerouted);
+}
+
 static void server_position_connection(LassiServer *ls, LassiConnection *lc) {
     GList *l;
     LassiConnection *last = NULL;
@@ -509,6 +1099,8 @@ static void server_position_connection(LassiServer *ls, LassiConnection *lc) {
         ls->order = g_list_append(ls->order, g_strdup(lc->id));
         /* No spot found, let's add it to the right end */
         ls->connections_right = g_list_append(ls->connections_right, lc);
+
+        server_save_state(ls);
     }
 }
 
@@ -537,6 +1129,10 @@ int lassi_server_acquire_clipboard(LassiServer *ls, gboolean primary, char**targ
     else
         g = ++ ls->clipboard_generation;
 
+    server_save_state(ls);
+
+    server_tick(ls, primary ? &ls->primary_stamp : &ls->clipboard_stamp);
+
     b = dbus_message_append_args(n, DBUS_TYPE_INT32, &g, DBUS_TYPE_BOOLEAN, &primary, DBUS_TYPE_INVALID);
     g_assert(b);
 
@@ -554,8 +1150,9 @@ int lassi_server_acquire_clipboard(LassiServer *ls, gboolean primary, char**targ
     b = dbus_message_iter_close_container(&iter, &sub);
     g_assert(b);
 
-    server_broadcast(ls, n, NULL);
-    g_assert(b);
+    message_append_stamp(n, primary ? &ls->primary_stamp : &ls->clipboard_stamp);
+
+    ls->stats_info.updates_sent += server_broadcast(ls, n, NULL);
 
     dbus_message_unref(n);
     return 0;
@@ -563,7 +1160,7 @@ int lassi_server_acquire_clipboard(LassiServer *ls, gboolean primary, char**targ
 
 int lassi_server_return_clipboard(LassiServer *ls, gboolean primary) {
     DBusMessage *n;
-    guint32 g;
+    gint32 g;
     gboolean b;
 
     g_assert(ls);
@@ -593,10 +1190,17 @@ int lassi_server_return_clipboard(LassiServer *ls, gboolean primary) {
     else
         g = ++ ls->clipboard_generation;
 
-    b = dbus_message_append_args(n, DBUS_TYPE_UINT32, &g, DBUS_TYPE_BOOLEAN, &primary, DBUS_TYPE_INVALID);
+    server_save_state(ls);
+
+    server_tick(ls, primary ? &ls->primary_stamp : &ls->clipboard_stamp);
+
+    /* The receiving end has always expected a signed generation */
+    b = dbus_message_append_args(n, DBUS_TYPE_INT32, &g, DBUS_TYPE_BOOLEAN, &primary, DBUS_TYPE_INVALID);
     g_assert(b);
 
-    server_broadcast(ls, n, NULL);
+    message_append_stamp(n, primary ? &ls->primary_stamp : &ls->clipboard_stamp);
+
+    ls->stats_info.updates_sent += server_broadcast(ls, n, NULL);
 
     dbus_message_unref(n);
     return 0;
@@ -604,31 +1208,43 @@ int lassi_server_return_clipboard(LassiServer *ls, gboolean primary) {
 
 int lassi_server_get_clipboard(LassiServer *ls, gboolean primary, const char *t, int *f, gpointer *p, int *l) {
     DBusMessage *n, *reply;
+    LassiConnection *lc;
     DBusConnection *c;
     DBusError e;
     int ret = -1;
     DBusMessageIter iter, sub;
     gboolean b;
+    gint64 started;
 
     g_assert(ls);
 
     dbus_error_init(&e);
 
+    if (!lassi_policy_selection_enabled(&ls->policy_info, primary))
+        return -1;
+
     if (primary) {
 
         if (ls->primary_empty || !ls->primary_connection)
             return -1;
 
-        c = ls->primary_connection->dbus_connection;
+        lc = ls->primary_connection;
 
     } else {
 
         if (ls->clipboard_empty || !ls->clipboard_connection)
             return -1;
 
-        c = ls->clipboard_connection->dbus_connection;
+        lc = ls->clipboard_connection;
     }
 
+    /* Method calls can't be relayed */
+    if (lc->relay)
+        return -1;
+
+    c = lc->dbus_connection;
+    started = lassi_stats_now();
+
     n = dbus_message_new_method_call(NULL, "/", LASSI_INTERFACE, "GetClipboard");
     g_assert(n);
 
@@ -652,6 +1268,14 @@ int lassi_server_get_clipboard(LassiServer *ls, gboolean primary, const char *t,
     dbus_message_iter_recurse(&iter, &sub);
     dbus_message_iter_get_fixed_array(&sub, p, l);
 
+    lassi_stats_clipboard(&lc->stats, *l, lassi_stats_now() - started);
+
+    /* Peers without a policy of their own might send more than we want */
+    if (!lassi_policy_transfer_allowed(&ls->policy_info, lc, *l)) {
+        *p = NULL;
+        goto finish;
+    }
+
     *p = g_memdup(*p, *l);
 
     ret = 0;
@@ -668,238 +1292,867 @@ finish:
     return ret;
 }
 
-static int signal_hello(LassiConnection *lc, DBusMessage *m) {
-    const char *id, *address;
-    DBusError e;
-    GList *i;
-    dbus_bool_t b;
-    DBusMessage *n;
-    gint32 active_generation, order_generation, clipboard_generation;
+static char *connection_peer_address(LassiConnection *lc, const char *announced) {
+    DBusAddressEntry **entries;
+    const char *port = NULL;
+    struct sockaddr_storage sa;
+    socklen_t sa_len = sizeof(sa);
+    char host[NI_MAXHOST];
+    char *r = NULL;
+    int n, j, fd = -1;
 
-    dbus_error_init(&e);
+    g_assert(lc);
+    g_assert(announced);
 
-    if (lc->id) {
-        g_debug("Received duplicate HelloNode.");
-        return -1;
-    }
+    /* The address a peer announces is what it listens on, usually
+     * 0.0.0.0, so combine its port with where the connection actually
+     * comes from */
 
-    if (!(dbus_message_get_args(
-                  m, &e,
-                  DBUS_TYPE_STRING, &id,
-                  DBUS_TYPE_STRING, &address,
-                  DBUS_TYPE_INT32, &active_generation,
-                  DBUS_TYPE_INT32, &order_generation,
-                  DBUS_TYPE_INT32, &clipboard_generation,
-                  DBUS_TYPE_INVALID))) {
-        g_warning("Received invalid message: %s", e.message);
-        dbus_error_free(&e);
-        return -1;
-    }
+    if (!dbus_parse_address(announced, &entries, &n, NULL))
+        return NULL;
 
-    if (strcmp(id, lc->server->id) == 0) {
-        g_debug("Dropping looped back connection.");
-        return -1;
-    }
+    for (j = 0; j < n && !port; j++)
+        if (strcmp(dbus_address_entry_get_method(entries[j]), "tcp") == 0)
+            port = dbus_address_entry_get_value(entries[j], "port");
 
-    if (g_hash_table_lookup(lc->server->connections_by_id, id)) {
-        g_debug("Dropping duplicate connection.");
-        return -1;
-    }
+    if (port &&
+        dbus_connection_get_socket(lc->dbus_connection, &fd) &&
+        getpeername(fd, (struct sockaddr*) &sa, &sa_len) >= 0 &&
+        getnameinfo((struct sockaddr*) &sa, sa_len, host, sizeof(host), NULL, 0, NI_NUMERICHOST) == 0)
+        r = g_strdup_printf("tcp:port=%s,host=%s", port, host);
 
-    lc->server->active_generation = MAX(lc->server->active_generation, active_generation);
-    lc->server->order_generation = MAX(lc->server->order_generation, order_generation);
-    lc->server->clipboard_generation = MAX(lc->server->clipboard_generation, clipboard_generation);
+    dbus_address_entries_free(entries);
 
-    g_debug("Got welcome from %s (%s)", id, address);
+    return r;
+}
 
-    lc->id = g_strdup(id);
-    lc->address = g_strdup(address);
-    g_hash_table_insert(lc->server->connections_by_id, lc->id, lc);
-    server_position_connection(lc->server, lc);
+static int connection_parse_parameters(LassiConnection *lc, DBusMessageIter *iter) {
+    DBusMessageIter sub;
 
-    /* Notify all old nodes of the new one */
-    n = dbus_message_new_signal("/", LASSI_INTERFACE, "NodeAdded");
-    g_assert(n);
+    g_assert(lc);
+    g_assert(iter);
 
-    b = dbus_message_append_args(n, DBUS_TYPE_STRING, &id, DBUS_TYPE_STRING, &address, DBUS_TYPE_INVALID);
-    g_assert(b);
+    if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_ARRAY || dbus_message_iter_get_element_type(iter) != DBUS_TYPE_DICT_ENTRY)
+        return -1;
 
-    server_broadcast(lc->server, n, lc);
-    dbus_message_unref(n);
+    dbus_message_iter_recurse(iter, &sub);
 
-    /* Notify new node about old nodes */
-    for (i = lc->server->connections; i; i = i->next) {
-        LassiConnection *k = i->data;
+    while (dbus_message_iter_get_arg_type(&sub) == DBUS_TYPE_DICT_ENTRY) {
+        DBusMessageIter entry;
+        const char *key, *value;
 
-        if (k == lc || !k->id)
-            continue;
+        dbus_message_iter_recurse(&sub, &entry);
 
-        n = dbus_message_new_signal("/", LASSI_INTERFACE, "NodeAdded");
-        g_assert(n);
+        if (dbus_message_iter_get_arg_type(&entry) != DBUS_TYPE_STRING)
+            return -1;
 
-        b = dbus_message_append_args(n, DBUS_TYPE_STRING, &id, DBUS_TYPE_STRING, &address, DBUS_TYPE_INVALID);
-        g_assert(b);
+        dbus_message_iter_get_basic(&entry, &key);
+        dbus_message_iter_next(&entry);
 
-        b = dbus_connection_send(lc->dbus_connection, n, NULL);
-        g_assert(b);
+        if (dbus_message_iter_get_arg_type(&entry) != DBUS_TYPE_STRING)
+            return -1;
 
-        dbus_message_unref(n);
+        dbus_message_iter_get_basic(&entry, &value);
+
+        g_hash_table_replace(lc->parameters, g_strdup(key), g_strdup(value));
+        dbus_message_iter_next(&sub);
     }
 
-    if (lc->we_are_client) {
-        server_send_update_grab(lc->server, -1);
-        lassi_server_send_update_order(lc->server, NULL);
+    /* Keep derived state in sync with what the peer told us */
+    lassi_geometry_free(lc->geometry);
+    lc->geometry = lassi_geometry_new_from_parameters(lc->parameters);
 
-        lc->delayed_welcome = FALSE;
-        show_welcome(lc, TRUE);
-    } else
-        lc->delayed_welcome = TRUE;
+    return 0;
+}
 
-    server_layout_changed(lc->server, -1);
-    lassi_prefs_update(&lc->server->prefs_info);
+static int connection_parse_capabilities(LassiConnection *lc, DBusMessage *m) {
+    DBusMessageIter iter;
+    guint32 version, capabilities;
+    int j;
 
-    server_dump(lc->server);
+    g_assert(lc);
+    g_assert(m);
 
-    return 0;
-}
+    dbus_message_iter_init(m, &iter);
 
-static int signal_node_added(LassiConnection *lc, DBusMessage *m) {
-    const char *id, *address;
-    DBusError e;
+    /* Skip the fixed arguments every version sends */
+    for (j = 0; j < 5; j++)
+        dbus_message_iter_next(&iter);
 
-    dbus_error_init(&e);
+    if (dbus_message_iter_get_arg_type(&iter) == DBUS_TYPE_INVALID) {
+        g_debug("Peer doesn't negotiate capabilities");
+        lc->protocol_version = 0;
+        lc->capabilities = 0;
+        return 0;
+    }
 
-    if (!(dbus_message_get_args(m, &e, DBUS_TYPE_STRING, &id, DBUS_TYPE_STRING, &address, DBUS_TYPE_INVALID))) {
-        g_warning("Received invalid message: %s", e.message);
-        dbus_error_free(&e);
+    if (dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_UINT32)
         return -1;
-    }
 
-    if (strcmp(id, lc->server->id) == 0)
-        return 0;
+    dbus_message_iter_get_basic(&iter, &version);
+    dbus_message_iter_next(&iter);
 
-    if (g_hash_table_lookup(lc->server->connections_by_id, id))
-        return 0;
+    if (dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_UINT32)
+        return -1;
 
-    if (!(lassi_server_connect(lc->server, address))) {
-        DBusMessage *n;
-        dbus_bool_t b;
+    dbus_message_iter_get_basic(&iter, &capabilities);
+    dbus_message_iter_next(&iter);
 
-        /* Failed to connnect to this client, tell everyone */
-        n = dbus_message_new_signal("/", LASSI_INTERFACE, "NodeRemoved");
-        g_assert(n);
+    if (connection_parse_parameters(lc, &iter) < 0)
+        return -1;
 
-        b = dbus_message_append_args(n, DBUS_TYPE_STRING, &id, DBUS_TYPE_STRING, &address, DBUS_TYPE_INVALID);
-        g_assert(b);
+    /* Newer versions may append more, we just ignore it */
 
-        server_broadcast(lc->server, n, NULL);
-        dbus_message_unref(n);
-    }
+    lc->protocol_version = MIN(version, LASSI_PROTOCOL_VERSION);
+    lc->capabilities = capabilities & LASSI_CAPABILITIES;
+
+    g_debug("Negotiated protocol version %u, capabilities 0x%x", lc->protocol_version, lc->capabilities);
 
     return 0;
 }
 
-static int signal_node_removed(LassiConnection *lc, DBusMessage *m) {
-    const char *id, *address;
-    DBusError e;
-    LassiConnection *k;
-    gboolean remove_from_order;
-    LassiServer *ls = lc->server;
+static void connection_sync_state(LassiConnection *lc) {
+    LassiServer *ls;
+    DBusMessage *n;
 
-    dbus_error_init(&e);
+    g_assert(lc);
 
-    if (!(dbus_message_get_args(m, &e,
-                                DBUS_TYPE_STRING, &id,
-                                DBUS_TYPE_STRING, &address,
-                                DBUS_TYPE_BOOLEAN, &remove_from_order,
-                                DBUS_TYPE_INVALID))) {
-        g_warning("Received invalid message: %s", e.message);
-        dbus_error_free(&e);
-        return -1;
-    }
+    ls = lc->server;
 
-    if (strcmp(id, lc->server->id) == 0) {
-        g_debug("We've been kicked ourselves.");
+    /* Stamped updates aren't passed on, so a peer that wasn't linked to
+     * us yet missed ours. Sending them again is no change, they keep
+     * their stamps and are dropped if the peer knows better. The grab
+     * only makes sense to the peer if it is with one of us two */
+    if (ls->active_stamp.time > 0 && (!ls->active_connection || ls->active_connection == lc)) {
+        n = server_new_update_grab(ls, -1);
+        message_append_stamp(n, &ls->active_stamp);
+        lassi_connection_send(lc, n);
+        dbus_message_unref(n);
 
-        server_disconnect_all(lc->server, TRUE);
-        return 0;
+        ls->stats_info.updates_sent++;
     }
 
-    if (remove_from_order) {
-        GList *i = g_list_find_custom(ls->order, id, (GCompareFunc) strcmp);
+    if (ls->order_stamp.time > 0) {
+        n = server_new_update_order(ls);
+        lassi_connection_send(lc, n);
+        dbus_message_unref(n);
 
-        if (i)
-            ls->order = g_list_delete_link(ls->order, i);
+        ls->stats_info.updates_sent++;
     }
+}
 
-    if ((k = g_hash_table_lookup(lc->server->connections_by_id, id)))
-        connection_unlink(k, remove_from_order);
-
-    server_broadcast(ls, m, lc == k ? NULL : lc);
+static void connection_resume(LassiConnection *lc, LassiReconnectPeer *p, gboolean behind_active, gboolean behind_order) {
+    LassiServer *ls;
+    DBusMessage *n;
 
-    return 0;
-}
+    g_assert(lc);
+    g_assert(p);
 
-static int signal_update_grab(LassiConnection *lc, DBusMessage *m) {
-    const char*id, *current_id;
-    gint32 generation;
-    LassiConnection *k = NULL;
-    DBusError e;
-    int y;
+    ls = lc->server;
 
-    dbus_error_init(&e);
+    /* Pick up the selections again if nobody claimed them while the
+     * peer was gone */
+    if (p->clipboard_generation >= 0 && !ls->clipboard_connection && ls->clipboard_generation == p->clipboard_generation) {
+        ls->clipboard_connection = lc;
+        ls->clipboard_empty = FALSE;
+    }
 
-    if (!(dbus_message_get_args(
-                  m, &e,
-                  DBUS_TYPE_INT32, &generation,
-                  DBUS_TYPE_STRING, &id,
-                  DBUS_TYPE_INT32, &y,
-                  DBUS_TYPE_INVALID))) {
-        g_warning("Received invalid message: %s", e.message);
-        dbus_error_free(&e);
-        return -1;
+    if (p->primary_generation >= 0 && !ls->primary_connection && ls->primary_generation == p->primary_generation) {
+        ls->primary_connection = lc;
+        ls->primary_empty = FALSE;
     }
 
-    g_debug("received grab request for %s (%i vs %i)", id, lc->server->active_generation, generation);
+    p->clipboard_generation = p->primary_generation = -1;
 
-    if (strcmp(id, lc->server->id) && !(k = g_hash_table_lookup(lc->server->connections_by_id, id))) {
-        g_debug("Unknown connection");
-        return -1;
+    /* The rest of the mesh never noticed the drop, so only bring the
+     * peer itself up to date, and only where it fell behind */
+
+    /* Nothing changed, so the state keeps its stamp */
+    if (behind_active) {
+        n = server_new_update_grab(ls, -1);
+        message_append_stamp(n, &ls->active_stamp);
+        lassi_connection_send(lc, n);
+        dbus_message_unref(n);
     }
 
-    if (k == lc->server->active_connection) {
-        g_debug("Connection already active");
-        return 0;
+    if (behind_order) {
+        n = server_new_update_order(ls);
+        lassi_connection_send(lc, n);
+        dbus_message_unref(n);
     }
+}
 
-    current_id = lc->server->active_connection ? lc->server->active_connection->id : lc->server->id;
+static void awaited_peer_free(gpointer data) {
+    AwaitedPeer *a = data;
 
-    if ((lc->server->active_generation > generation || (lc->server->active_generation == generation && strcmp(current_id, id) > 0))) {
-        g_debug("Ignoring request for active connection");
-        return 0;
-    }
+    if (a->timeout_id > 0)
+        g_source_remove(a->timeout_id);
 
-    lc->server->active_connection = k;
-    lc->server->active_generation = generation;
+    g_free(a->id);
+    g_free(a->address);
+    g_free(a);
+}
 
-    if (!k)
-        g_debug("We're now the active server.");
-    else
-        g_debug("Connection '%s' activated.", k->id);
+static gboolean dial_fallback_cb(gpointer userdata) {
+    AwaitedPeer *a = userdata;
+    LassiServer *ls = a->server;
 
-    server_broadcast(lc->server, m, lc);
-    server_layout_changed(lc->server, y);
+    a->timeout_id = 0;
 
-    return 0;
+    if (!g_hash_table_lookup(ls->connections_by_id, a->id)) {
+        g_debug("%s didn't dial us, dialing it ourselves", a->id);
+        ls->stats_info.dials++;
+        lassi_server_connect_async(ls, a->address);
+    }
+
+    g_hash_table_remove(ls->awaited, a->id);
+
+    return FALSE;
 }
 
-static int signal_update_order(LassiConnection *lc, DBusMessage *m) {
-    gint32 generation;
+static void server_add_relayed(LassiServer *ls, LassiConnection *relay, const char *id) {
+    g_assert(ls);
+    g_assert(relay);
+    g_assert(id);
+
+    if (strcmp(id, ls->id) == 0 ||
+        g_hash_table_lookup(ls->connections_by_id, id) ||
+        g_hash_table_lookup(relay->relayed, id))
+        return;
+
+    connection_add_relayed(ls, relay, id, TRUE);
+}
+
+void lassi_server_add_member(LassiServer *ls, const char *id, const char *address, gboolean follows_rule) {
+    AwaitedPeer *a;
+
+    g_assert(ls);
+    g_assert(id);
+    g_assert(address);
+
+    if (strcmp(id, ls->id) == 0 || g_hash_table_lookup(ls->connections_by_id, id))
+        return;
+
+    if (ls->relay_mode)
+        return;
+
+    /* Of two peers that both know the rule only the one with the
+     * smaller id dials, so that we never open two connections and
+     * throw one away */
+    if (follows_rule && strcmp(ls->id, id) < 0) {
+        ls->stats_info.dials++;
+        lassi_server_connect_async(ls, address);
+        return;
+    }
+
+    /* Whoever dials might not get through to us, so don't wait forever */
+    a = g_new(AwaitedPeer, 1);
+    a->server = ls;
+    a->id = g_strdup(id);
+    a->address = g_strdup(address);
+    a->timeout_id = g_timeout_add(DIAL_FALLBACK_MSEC, dial_fallback_cb, a);
+
+    g_hash_table_replace(ls->awaited, a->id, a);
+}
+
+static void connection_send_members(LassiConnection *lc) {
+    DBusMessage *n;
+    DBusMessageIter iter, sub, entry;
+    dbus_bool_t b;
+    GList *i;
+
+    g_assert(lc);
+
+    n = dbus_message_new_signal("/", LASSI_INTERFACE, "Members");
+    g_assert(n);
+
+    dbus_message_iter_init_append(n, &iter);
+
+    b = dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "(ssu)", &sub);
+    g_assert(b);
+
+    for (i = lc->server->connections; i; i = i->next) {
+        LassiConnection *k = i->data;
+
+        /* Nobody but the relay can reach peers behind it */
+        if (k == lc || !k->id || k->relay)
+            continue;
+
+        b = dbus_message_iter_open_container(&sub, DBUS_TYPE_STRUCT, NULL, &entry);
+        g_assert(b);
+
+        b = dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &k->id);
+        g_assert(b);
+
+        b = dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &k->address);
+        g_assert(b);
+
+        b = dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT32, &k->capabilities);
+        g_assert(b);
+
+        b = dbus_message_iter_close_container(&sub, &entry);
+        g_assert(b);
+    }
+
+    b = dbus_message_iter_close_container(&iter, &sub);
+    g_assert(b);
+
+    lassi_connection_send(lc, n);
+    lc->server->stats_info.membership_sent++;
+
+    dbus_message_unref(n);
+}
+
+static void connection_announce(LassiConnection *lc) {
+    DBusMessage *n;
+    dbus_bool_t b;
+
+    g_assert(lc);
+    g_assert(lc->id);
+
+    /* Notify all old nodes of the new one. Its capabilities tell them
+     * whether it knows who dials whom, older peers ignore them */
+    n = dbus_message_new_signal("/", LASSI_INTERFACE, "NodeAdded");
+    g_assert(n);
+
+    b = dbus_message_append_args(n,
+                                 DBUS_TYPE_STRING, &lc->id,
+                                 DBUS_TYPE_STRING, &lc->address,
+                                 DBUS_TYPE_UINT32, &lc->capabilities,
+                                 DBUS_TYPE_INVALID);
+    g_assert(b);
+
+    lc->server->stats_info.membership_sent += server_broadcast(lc->server, n, lc);
+    dbus_message_unref(n);
+
+    /* Notify new node about old nodes in one go. Older peers are dialed
+     * by everybody who hears about them, so they don't need the list */
+    if (lassi_connection_has_capability(lc, LASSI_CAPABILITY_MEMBERSHIP))
+        connection_send_members(lc);
+}
+
+static int signal_hello(LassiConnection *lc, DBusMessage *m) {
+    const char *id, *address;
+    DBusError e;
+    gint32 active_generation, order_generation, clipboard_generation;
+    gint32 our_active_generation, our_order_generation;
+    LassiReconnectPeer *resumed;
+    char *peer_address;
+
+    dbus_error_init(&e);
+
+    if (lc->id) {
+        g_debug("Received duplicate HelloNode.");
+        return -1;
+    }
+
+    if (!(dbus_message_get_args(
+                  m, &e,
+                  DBUS_TYPE_STRING, &id,
+                  DBUS_TYPE_STRING, &address,
+                  DBUS_TYPE_INT32, &active_generation,
+                  DBUS_TYPE_INT32, &order_generation,
+                  DBUS_TYPE_INT32, &clipboard_generation,
+                  DBUS_TYPE_INVALID))) {
+        g_warning("Received invalid message: %s", e.message);
+        dbus_error_free(&e);
+        return -1;
+    }
+
+    if (strcmp(id, lc->server->id) == 0) {
+        g_debug("Dropping looped back connection.");
+        return -1;
+    }
+
+    if (g_hash_table_lookup(lc->server->connections_by_id, id)) {
+        g_debug("Dropping duplicate connection.");
+        lc->server->stats_info.duplicates++;
+        return -1;
+    }
+
+    if (lc->relay && strcmp(id, lc->relay_to)) {
+        g_debug("Relayed Hello from %s claims to be %s.", lc->relay_to, id);
+        return -1;
+    }
+
+    if (connection_parse_capabilities(lc, m) < 0) {
+        g_warning("Received invalid capabilities.");
+        return -1;
+    }
+
+    our_active_generation = lc->server->active_generation;
+    our_order_generation = lc->server->order_generation;
+
+    lassi_replica_merge_generation(&lc->server->active_generation, active_generation);
+    lassi_replica_merge_generation(&lc->server->order_generation, order_generation);
+    lassi_replica_merge_generation(&lc->server->clipboard_generation, clipboard_generation);
+    server_save_state(lc->server);
+
+    g_debug("Got welcome from %s (%s)", id, address);
+
+    lc->id = g_strdup(id);
+    lc->address = g_strdup(address);
+    g_hash_table_insert(lc->server->connections_by_id, lc->id, lc);
+    g_hash_table_remove(lc->server->awaited, lc->id);
+    server_position_connection(lc->server, lc);
+
+    /* We can't dial peers we only reach through a relay */
+    if (!lc->relay) {
+        peer_address = connection_peer_address(lc, address);
+        lassi_reconnect_remember(&lc->server->reconnect_info, id, peer_address);
+        g_free(peer_address);
+    }
+
+    /* Lets the pre-connect on our next start apply the same rules */
+    lassi_state_set_capabilities(&lc->server->state_info, id, lc->protocol_version, lc->capabilities);
+
+    if ((resumed = lassi_reconnect_resume(&lc->server->reconnect_info, id))) {
+        connection_resume(lc, resumed,
+                          active_generation < our_active_generation,
+                          order_generation < our_order_generation);
+
+        lc->delayed_welcome = FALSE;
+
+        /* While it was gone we told the peers we relay for that they
+         * can't reach it, and it dropped the ones behind us */
+        if (lc->server->hub && !lc->relay)
+            connection_announce(lc);
+
+        server_layout_changed(lc->server, -1);
+        lassi_prefs_update(&lc->server->prefs_info);
+        lassi_tray_update(&lc->server->tray_info, lc->server->n_connections);
+
+        server_dump(lc->server);
+
+        return 0;
+    }
+
+    /* Peers behind a relay are announced by the relay */
+    if (!lc->relay)
+        connection_announce(lc);
+
+    if (lassi_connection_has_capability(lc, LASSI_CAPABILITY_CLOCK))
+        connection_sync_state(lc);
+
+    if (lc->we_are_client) {
+        server_send_update_grab(lc->server, -1);
+        lassi_server_send_update_order(lc->server, NULL);
+
+        lc->delayed_welcome = FALSE;
+        show_welcome(lc, TRUE);
+    } else
+        lc->delayed_welcome = TRUE;
+
+    server_layout_changed(lc->server, -1);
+    lassi_prefs_update(&lc->server->prefs_info);
+
+    server_dump(lc->server);
+
+    return 0;
+}
+
+static int signal_node_added(LassiConnection *lc, DBusMessage *m) {
+    const char *id, *address;
+    guint32 capabilities = 0;
+    DBusError e;
+
+    dbus_error_init(&e);
+
+    if (!(dbus_message_get_args(m, &e, DBUS_TYPE_STRING, &id, DBUS_TYPE_STRING, &address, DBUS_TYPE_INVALID))) {
+        g_warning("Received invalid message: %s", e.message);
+        dbus_error_free(&e);
+        return -1;
+    }
+
+    lc->server->stats_info.membership_received++;
+
+    if (strcmp(id, lc->server->id) == 0)
+        return 0;
+
+    if (g_hash_table_lookup(lc->server->connections_by_id, id))
+        return 0;
+
+    /* Behind a relay only the relay itself tells us about peers */
+    if (lc->relay)
+        return 0;
+
+    if (lc->server->relay_mode && connection_is_relay(lc)) {
+        server_add_relayed(lc->server, lc, id);
+        return 0;
+    }
+
+    /* We only dial our relays, they tell us about everybody else */
+    if (lc->server->relay_mode)
+        return 0;
+
+    if (lassi_connection_has_capability(lc, LASSI_CAPABILITY_MEMBERSHIP)) {
+
+        if (!dbus_message_get_args(m, &e, DBUS_TYPE_STRING, &id, DBUS_TYPE_STRING, &address, DBUS_TYPE_UINT32, &capabilities, DBUS_TYPE_INVALID)) {
+            g_warning("Received invalid message: %s", e.message);
+            dbus_error_free(&e);
+            return -1;
+        }
+
+        /* A newcomer that knows the rule got a member list and will
+         * dial us if it is its turn */
+        if (capabilities & LASSI_CAPABILITY_MEMBERSHIP) {
+            lassi_server_add_member(lc->server, id, address, TRUE);
+            return 0;
+        }
+    }
+
+    lc->server->stats_info.dials++;
+
+    if (!(lassi_server_connect(lc->server, address))) {
+        DBusMessage *n;
+        dbus_bool_t b;
+
+        /* Failed to connnect to this client, tell everyone */
+        n = dbus_message_new_signal("/", LASSI_INTERFACE, "NodeRemoved");
+        g_assert(n);
+
+        b = dbus_message_append_args(n, DBUS_TYPE_STRING, &id, DBUS_TYPE_STRING, &address, DBUS_TYPE_INVALID);
+        g_assert(b);
+
+        server_broadcast(lc->server, n, NULL);
+        dbus_message_unref(n);
+    }
+
+    return 0;
+}
+
+static int signal_members(LassiConnection *lc, DBusMessage *m) {
+    DBusMessageIter iter, sub, entry;
+
+    dbus_message_iter_init(m, &iter);
+
+    if (dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY || dbus_message_iter_get_element_type(&iter) != DBUS_TYPE_STRUCT) {
+        g_debug("Bad member list");
+        return -1;
+    }
+
+    lc->server->stats_info.membership_received++;
+
+    if (lc->relay)
+        return 0;
+
+    dbus_message_iter_recurse(&iter, &sub);
+
+    while (dbus_message_iter_get_arg_type(&sub) != DBUS_TYPE_INVALID) {
+        const char *id, *address;
+        guint32 capabilities;
+
+        dbus_message_iter_recurse(&sub, &entry);
+
+        if (dbus_message_iter_get_arg_type(&entry) != DBUS_TYPE_STRING)
+            return -1;
+        dbus_message_iter_get_basic(&entry, &id);
+        dbus_message_iter_next(&entry);
+
+        if (dbus_message_iter_get_arg_type(&entry) != DBUS_TYPE_STRING)
+            return -1;
+        dbus_message_iter_get_basic(&entry, &address);
+        dbus_message_iter_next(&entry);
+
+        if (dbus_message_iter_get_arg_type(&entry) != DBUS_TYPE_UINT32)
+            return -1;
+        dbus_message_iter_get_basic(&entry, &capabilities);
+
+        /* Older members dial everybody they hear about, including us */
+        if (lc->server->relay_mode && connection_is_relay(lc))
+            server_add_relayed(lc->server, lc, id);
+        else
+            lassi_server_add_member(lc->server, id, address, !!(capabilities & LASSI_CAPABILITY_MEMBERSHIP));
+
+        dbus_message_iter_next(&sub);
+    }
+
+    return 0;
+}
+
+static int signal_relayed(LassiConnection *lc, DBusMessage *m) {
+    const char *from, *to;
+    char *data;
+    int length;
+    DBusError e;
+    DBusMessage *n;
+    LassiConnection *k;
+
+    dbus_error_init(&e);
+
+    if (!(dbus_message_get_args(m, &e,
+                                DBUS_TYPE_STRING, &from,
+                                DBUS_TYPE_STRING, &to,
+                                DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE, &data, &length,
+                                DBUS_TYPE_INVALID))) {
+        g_warning("Received invalid message: %s", e.message);
+        dbus_error_free(&e);
+        return -1;
+    }
+
+    if (lc->relay) {
+        g_debug("Dropping frame relayed twice.");
+        return 0;
+    }
+
+    if (!lc->id || !strcmp(from, lc->server->id)) {
+        g_debug("Dropping relayed frame with bogus sender %s.", from);
+        return 0;
+    }
+
+    if (strcmp(to, lc->server->id)) {
+
+        if (!lc->server->hub || strcmp(from, lc->id)) {
+            g_debug("Not relaying for %s.", from);
+            return 0;
+        }
+
+        if (!(k = g_hash_table_lookup(lc->server->connections_by_id, to)) ||
+            k->relay ||
+            !lassi_connection_has_capability(k, LASSI_CAPABILITY_RELAY)) {
+            g_debug("Can't relay from %s to %s.", from, to);
+            connection_send_unreachable(lc, to);
+            return 0;
+        }
+
+        /* Cut through: pass it on untouched */
+        n = dbus_message_copy(m);
+        g_assert(n);
+
+        lassi_connection_send(k, n);
+        dbus_message_unref(n);
+
+        return 0;
+    }
+
+    /* Only a hub speaks for others, anybody else could claim to be
+     * whoever we aren't linked to */
+    if (!connection_is_relay(lc)) {
+        g_debug("Dropping frame for us relayed by %s, which is no hub.", lc->id);
+        return 0;
+    }
+
+    if (!(k = g_hash_table_lookup(lc->relayed, from))) {
+
+        /* We already have a link of our own to it */
+        if (g_hash_table_lookup(lc->server->connections_by_id, from))
+            return 0;
+
+        k = connection_add_relayed(lc->server, lc, from, FALSE);
+    }
+
+    if (!(n = dbus_message_demarshal(data, length, &e))) {
+        g_warning("Received invalid relayed frame from %s: %s", from, e.message);
+        dbus_error_free(&e);
+        return 0;
+    }
+
+    message_function(k->dbus_connection, n, k);
+    dbus_message_unref(n);
+
+    return 0;
+}
+
+static int signal_unreachable(LassiConnection *lc, DBusMessage *m) {
+    const char *id;
+    DBusError e;
+    LassiConnection *k;
+    LassiServer *ls;
+    gboolean to_left, clipboard, primary;
+
+    dbus_error_init(&e);
+
+    if (!(dbus_message_get_args(m, &e, DBUS_TYPE_STRING, &id, DBUS_TYPE_INVALID))) {
+        g_warning("Received invalid message: %s", e.message);
+        dbus_error_free(&e);
+        return -1;
+    }
+
+    if (lc->relay || !(k = g_hash_table_lookup(lc->relayed, id)))
+        return 0;
+
+    g_debug("%s can't reach %s for us any more", lc->id, id);
+
+    ls = lc->server;
+    to_left = !!g_list_find(ls->connections_left, k);
+    clipboard = ls->clipboard_connection == k;
+    primary = ls->primary_connection == k;
+
+    /* Like a lost link, so that nobody else hears about it: they have
+     * their own way to the peer. The relay announces it again if it
+     * comes back, so there is nothing to wait for */
+    k->lost = TRUE;
+    connection_unlink(k, FALSE);
+
+    if (clipboard)
+        lassi_clipboard_clear(&ls->clipboard_info, FALSE);
+
+    if (primary)
+        lassi_clipboard_clear(&ls->clipboard_info, TRUE);
+
+    lassi_server_show_welcome(ls, id, to_left, FALSE);
+
+    return 0;
+}
+
+static int signal_node_removed(LassiConnection *lc, DBusMessage *m) {
+    const char *id, *address;
+    DBusError e;
+    LassiConnection *k;
+    gboolean remove_from_order, changed = FALSE;
+    LassiServer *ls = lc->server;
+
+    dbus_error_init(&e);
+
+    if (!(dbus_message_get_args(m, &e,
+                                DBUS_TYPE_STRING, &id,
+                                DBUS_TYPE_STRING, &address,
+                                DBUS_TYPE_BOOLEAN, &remove_from_order,
+                                DBUS_TYPE_INVALID))) {
+        g_warning("Received invalid message: %s", e.message);
+        dbus_error_free(&e);
+        return -1;
+    }
+
+    if (strcmp(id, lc->server->id) == 0) {
+        g_debug("We've been kicked ourselves.");
+
+        server_disconnect_all(lc->server, TRUE);
+        return 0;
+    }
+
+    if (remove_from_order) {
+        GList *i = g_list_find_custom(ls->order, id, (GCompareFunc) strcmp);
+
+        if (i) {
+            ls->order = g_list_delete_link(ls->order, i);
+            server_save_state(ls);
+            changed = TRUE;
+        }
+    }
+
+    if ((k = g_hash_table_lookup(lc->server->connections_by_id, id))) {
+        connection_unlink(k, remove_from_order);
+        changed = TRUE;
+    }
+
+    /* Only pass it on the first time, otherwise it circles through the
+     * mesh forever */
+    if (changed)
+        server_broadcast(ls, m, lc == k ? NULL : lc);
+
+    return 0;
+}
+
+static int signal_update_grab(LassiConnection *lc, DBusMessage *m) {
+    const char*id, *current_id, *origin;
+    gint32 generation;
+    LassiConnection *k = NULL;
+    DBusError e;
+    DBusMessageIter iter;
+    int y;
+    gboolean relay = TRUE, has_stamp, stamped;
+    guint64 time;
+    LassiServer *ls = lc->server;
+
+    dbus_error_init(&e);
+
+    if (!dbus_message_get_args(
+                m, &e,
+                DBUS_TYPE_INT32, &generation,
+                DBUS_TYPE_STRING, &id,
+                DBUS_TYPE_INT32, &y,
+                DBUS_TYPE_INVALID)) {
+        g_warning("Received invalid message: %s", e.message);
+        dbus_error_free(&e);
+        return -1;
+    }
+
+    /* A direct hand-off has the relay flag right after that, and the
+     * stamp might follow */
+    if (lassi_connection_has_capability(lc, LASSI_CAPABILITY_DIRECT_GRAB)) {
+        dbus_message_iter_init(m, &iter);
+        dbus_message_iter_next(&iter);
+        dbus_message_iter_next(&iter);
+
+        if (dbus_message_iter_next(&iter) && dbus_message_iter_get_arg_type(&iter) == DBUS_TYPE_BOOLEAN)
+            dbus_message_iter_get_basic(&iter, &relay);
+    }
+
+    /* Older peers place y on the whole height of their screen. We get
+     * the pointer back through the edge we grabbed it on */
+    if (!lassi_connection_has_capability(lc, LASSI_CAPABILITY_EDGE_Y) && y >= 0 && y < 0xFFFF)
+        y = lassi_geometry_screen_to_edge(ls->grab_info.geometry, ls->grab_info.grab_window == ls->grab_info.left_window, y);
+
+    has_stamp = connection_get_stamp(lc, m, &time, &origin);
+    stamped = lassi_replica_stamped(&ls->active_stamp, has_stamp);
+
+    g_debug("received grab request for %s (%i vs %i)", id, ls->active_generation, generation);
+
+    if (strcmp(id, ls->id) && !(k = g_hash_table_lookup(ls->connections_by_id, id))) {
+        g_debug("Unknown connection");
+
+        /* Nobody passes stamped updates on, so while joining we hear
+         * about peers we aren't linked to yet straight from the others */
+        return has_stamp ? 0 : -1;
+    }
+
+    current_id = ls->active_connection ? ls->active_connection->id : ls->id;
+
+    switch (lassi_replica_update_grab(&ls->active_generation, &ls->active_stamp, current_id,
+                                      generation, id, has_stamp, time, origin)) {
+
+        case LASSI_REPLICA_IGNORED:
+            g_debug("Ignoring request for active connection");
+            ls->stats_info.updates_ignored++;
+            return 0;
+
+        case LASSI_REPLICA_UNCHANGED:
+            g_debug("Connection already active");
+            server_save_state(ls);
+            return 0;
+
+        case LASSI_REPLICA_APPLIED:
+            break;
+    }
+
+    server_save_state(ls);
+
+    /* A stamped change was told to every peer by its origin itself */
+    if (stamped)
+        relay = FALSE;
+
+    ls->active_connection = k;
+    ls->stats_info.updates_applied++;
+
+    if (!k)
+        g_debug("We're now the active server.");
+    else {
+        g_debug("Connection '%s' activated.", k->id);
+        k->stats.handoffs++;
+    }
+
+    /* A newer state from somewhere else supersedes what we still
+     * wanted to tell the others */
+    server_drop_pending_grab(ls);
+
+    if (relay)
+        ls->stats_info.updates_sent += server_broadcast(ls, m, lc);
+
+    server_layout_changed(ls, y);
+
+    return 0;
+}
+
+static int signal_update_order(LassiConnection *lc, DBusMessage *m) {
+    gint32 generation;
     DBusError e;
     DBusMessageIter iter, sub;
     GList *new_order = NULL, *merged_order = NULL;
     int r = 0;
-    int c = 0;
+    gboolean has_stamp, stamped;
+    guint64 time;
+    const char *origin;
 
     dbus_error_init(&e);
 
@@ -920,11 +2173,6 @@ static int signal_update_order(LassiConnection *lc, DBusMessage *m) {
         return -1;
     }
 
-    if (lc->server->order_generation > generation) {
-        g_debug("Ignoring request for layout");
-        return 0;
-    }
-
     dbus_message_iter_recurse(&iter, &sub);
 
     while (dbus_message_iter_get_arg_type(&sub) != DBUS_TYPE_INVALID) {
@@ -942,28 +2190,48 @@ static int signal_update_order(LassiConnection *lc, DBusMessage *m) {
         goto finish;
     }
 
-    c = lassi_list_compare(lc->server->order, new_order);
+    has_stamp = connection_get_stamp(lc, m, &time, &origin);
+    stamped = lassi_replica_stamped(&lc->server->order_stamp, has_stamp);
 
-    if (c == 0) {
-        g_debug("Requested order identical to ours.");
-        goto finish;
-    }
+    switch (lassi_replica_update_order(&lc->server->order_generation, &lc->server->order_stamp, lc->server->order,
+                                       generation, new_order, has_stamp, time, origin, &merged_order)) {
 
-    if (lc->server->order_generation == generation &&  c > 0) {
-        g_debug("Ignoring request for layout 2");
-        goto finish;
-    }
+        case LASSI_REPLICA_IGNORED:
+            g_debug("Ignoring request for layout");
+            lc->server->stats_info.updates_ignored++;
+            goto finish;
+
+        case LASSI_REPLICA_UNCHANGED:
+            g_debug("Requested order identical to ours.");
+            lc->server->stats_info.updates_applied++;
+            goto finish;
 
-    merged_order = lassi_list_merge(lassi_list_copy(new_order), lc->server->order);
+        case LASSI_REPLICA_APPLIED:
+            lc->server->stats_info.updates_applied++;
+            break;
+    }
 
-    if (lassi_list_compare(lc->server->order, merged_order)) {
+    if (merged_order) {
         lassi_server_set_order(lc->server, merged_order);
         merged_order = NULL;
     }
 
+    if (stamped) {
+        server_save_state(lc->server);
+
+        /* Its origin told every peer itself. Only if we know about
+         * peers it left out we have news of our own, stamped later than
+         * what we just merged, so this is the last round */
+        if (lassi_list_compare(lc->server->order, new_order))
+            lassi_server_send_update_order(lc->server, NULL);
+
+        goto finish;
+    }
+
     lassi_server_send_update_order(lc->server, lassi_list_compare(lc->server->order, new_order) ? NULL : lc);
 
     lc->server->order_generation = generation;
+    server_save_state(lc->server);
 
 finish:
 
@@ -978,62 +2246,210 @@ finish:
     return r;
 }
 
-static int signal_key_event(LassiConnection *lc, DBusMessage *m) {
+static gboolean held_input_cb(gpointer userdata) {
+    LassiConnection *lc = userdata;
+
+    g_assert(lc);
+
+    lc->held_input_id = 0;
+
+    g_debug("Motion didn't arrive in time, injecting held input anyway");
+    connection_flush_input(lc, TRUE);
+
+    return FALSE;
+}
+
+static void connection_flush_input(LassiConnection *lc, gboolean force) {
+    HeldInput *h;
+    int r;
+
+    g_assert(lc);
+
+    /* Inject in order everything whose motion has been applied; serials
+     * wrap around, hence the signed difference */
+    while ((h = g_queue_peek_head(lc->held_input))) {
+
+        if (!force && (gint32) (h->serial - lc->motion_applied) > 0)
+            break;
+
+        lassi_trace(h->is_key ? LASSI_TRACE_INJECT_KEY : LASSI_TRACE_INJECT_BUTTON, h->code, h->is_press, force);
+
+        if (h->is_key)
+            r = lassi_grab_press_key(&lc->server->grab_info, h->code, h->is_press);
+        else
+            r = lassi_grab_press_button(&lc->server->grab_info, h->code, h->is_press);
+
+        if (r < 0)
+            lc->stats.drops++;
+        else if (force)
+            lc->stats.late++;
+
+        g_free(g_queue_pop_head(lc->held_input));
+    }
+
+    if (g_queue_is_empty(lc->held_input)) {
+        if (lc->held_input_id > 0) {
+            g_source_remove(lc->held_input_id);
+            lc->held_input_id = 0;
+        }
+    } else if (lc->held_input_id == 0)
+        lc->held_input_id = g_timeout_add(HELD_INPUT_MSEC, held_input_cb, lc);
+}
+
+static int connection_input_event(LassiConnection *lc, DBusMessage *m, gboolean is_key) {
     DBusError e;
-    guint32 key;
+    guint32 code, serial = 0;
     gboolean is_press;
+    HeldInput *h;
+    dbus_bool_t b;
 
     dbus_error_init(&e);
 
-    if (!(dbus_message_get_args(m, &e, DBUS_TYPE_UINT32, &key, DBUS_TYPE_BOOLEAN, &is_press, DBUS_TYPE_INVALID))) {
+    if (lassi_connection_has_capability(lc, LASSI_CAPABILITY_MOTION_SERIAL))
+        b = dbus_message_get_args(m, &e, DBUS_TYPE_UINT32, &code, DBUS_TYPE_BOOLEAN, &is_press, DBUS_TYPE_UINT32, &serial, DBUS_TYPE_INVALID);
+    else
+        b = dbus_message_get_args(m, &e, DBUS_TYPE_UINT32, &code, DBUS_TYPE_BOOLEAN, &is_press, DBUS_TYPE_INVALID);
+
+    if (!b) {
         g_warning("Received invalid message: %s", e.message);
         dbus_error_free(&e);
         return -1;
     }
 
-/*     g_debug("got dbus key %i %i", key, !!is_press); */
-    lassi_grab_press_key(&lc->server->grab_info, key, is_press);
+    /* Without serials every event counts as following the motion
+     * already applied */
+    if (!lassi_connection_has_capability(lc, LASSI_CAPABILITY_MOTION_SERIAL))
+        serial = lc->motion_applied;
+
+    lassi_trace(is_key ? LASSI_TRACE_RECV_KEY : LASSI_TRACE_RECV_BUTTON, code, is_press, serial);
+
+    lc->stats.input_received++;
+
+    h = g_new(HeldInput, 1);
+    h->is_key = is_key;
+    h->code = code;
+    h->is_press = is_press;
+    h->serial = serial;
+    g_queue_push_tail(lc->held_input, h);
+
+    connection_flush_input(lc, FALSE);
 
     return 0;
 }
 
+static int signal_key_event(LassiConnection *lc, DBusMessage *m) {
+    return connection_input_event(lc, m, TRUE);
+}
+
 static int signal_motion_event(LassiConnection *lc, DBusMessage *m) {
     DBusError e;
     int dx, dy;
+    guint32 serial;
+    dbus_bool_t b;
 
     dbus_error_init(&e);
 
-    if (!(dbus_message_get_args(m, &e, DBUS_TYPE_INT32, &dx, DBUS_TYPE_INT32, &dy, DBUS_TYPE_INVALID))) {
+    if (lassi_connection_has_capability(lc, LASSI_CAPABILITY_MOTION_SERIAL))
+        b = dbus_message_get_args(m, &e, DBUS_TYPE_INT32, &dx, DBUS_TYPE_INT32, &dy, DBUS_TYPE_UINT32, &serial, DBUS_TYPE_INVALID);
+    else
+        b = dbus_message_get_args(m, &e, DBUS_TYPE_INT32, &dx, DBUS_TYPE_INT32, &dy, DBUS_TYPE_INVALID);
+
+    if (!b) {
         g_warning("Received invalid message: %s", e.message);
         dbus_error_free(&e);
         return -1;
     }
 
-/*     g_debug("got dbus motion %i %i", dx, dy); */
-    lassi_grab_move_pointer_relative(&lc->server->grab_info, dx, dy);
+    lassi_trace(LASSI_TRACE_RECV_MOTION, dx, dy, lassi_connection_has_capability(lc, LASSI_CAPABILITY_MOTION_SERIAL) ? serial : 0);
+    lc->stats.input_received++;
+
+    if (lassi_grab_move_pointer_relative(&lc->server->grab_info, dx, dy) < 0)
+        lc->stats.drops++;
+
+    if (lassi_connection_has_capability(lc, LASSI_CAPABILITY_MOTION_SERIAL))
+        lc->motion_applied = serial;
+
+    connection_flush_input(lc, FALSE);
 
     return 0;
 }
 
-static int signal_button_event(LassiConnection *lc, DBusMessage *m) {
+static int signal_motion_absolute_event(LassiConnection *lc, DBusMessage *m) {
     DBusError e;
-    guint32 button;
-    gboolean is_press;
+    int x, y;
+    guint32 serial;
+    dbus_bool_t b;
 
     dbus_error_init(&e);
 
-    if (!(dbus_message_get_args(m, &e, DBUS_TYPE_UINT32, &button, DBUS_TYPE_BOOLEAN, &is_press, DBUS_TYPE_INVALID))) {
+    if (lassi_connection_has_capability(lc, LASSI_CAPABILITY_MOTION_SERIAL))
+        b = dbus_message_get_args(m, &e, DBUS_TYPE_INT32, &x, DBUS_TYPE_INT32, &y, DBUS_TYPE_UINT32, &serial, DBUS_TYPE_INVALID);
+    else
+        b = dbus_message_get_args(m, &e, DBUS_TYPE_INT32, &x, DBUS_TYPE_INT32, &y, DBUS_TYPE_INVALID);
+
+    if (!b) {
         g_warning("Received invalid message: %s", e.message);
         dbus_error_free(&e);
         return -1;
     }
 
-/*     g_debug("got dbus button %i %i", button, !!is_press); */
-    lassi_grab_press_button(&lc->server->grab_info, button, is_press);
+    lassi_trace(LASSI_TRACE_RECV_MOTION_ABSOLUTE, x, y, lassi_connection_has_capability(lc, LASSI_CAPABILITY_MOTION_SERIAL) ? serial : 0);
+    lc->stats.input_received++;
+
+    if (lassi_grab_move_pointer_absolute(&lc->server->grab_info, x, y) < 0)
+        lc->stats.drops++;
+
+    if (lassi_connection_has_capability(lc, LASSI_CAPABILITY_MOTION_SERIAL))
+        lc->motion_applied = serial;
+
+    connection_flush_input(lc, FALSE);
+
+    return 0;
+}
+
+static int signal_button_event(LassiConnection *lc, DBusMessage *m) {
+    return connection_input_event(lc, m, FALSE);
+}
+
+static int signal_update_parameters(LassiConnection *lc, DBusMessage *m) {
+    DBusMessageIter iter;
+
+    dbus_message_iter_init(m, &iter);
+
+    if (connection_parse_parameters(lc, &iter) < 0) {
+        g_warning("Received invalid parameters.");
+        return -1;
+    }
+
+    g_debug("%s updated its parameters", lc->id);
 
     return 0;
 }
 
+static gboolean connection_update_selection(LassiConnection *lc, DBusMessage *m, gboolean primary, gint32 g) {
+    LassiServer *ls = lc->server;
+    LassiStamp *s;
+    int *generation;
+    gboolean has_stamp;
+    guint64 time;
+    const char *origin;
+
+    s = primary ? &ls->primary_stamp : &ls->clipboard_stamp;
+    generation = primary ? &ls->primary_generation : &ls->clipboard_generation;
+
+    has_stamp = connection_get_stamp(lc, m, &time, &origin);
+
+    if (lassi_replica_update_selection(generation, s, g, has_stamp, time, origin) == LASSI_REPLICA_IGNORED) {
+        ls->stats_info.updates_ignored++;
+        return FALSE;
+    }
+
+    server_save_state(ls);
+
+    ls->stats_info.updates_applied++;
+    return TRUE;
+}
+
 static int signal_acquire_clipboard(LassiConnection *lc, DBusMessage *m) {
     DBusError e;
     gint32 g;
@@ -1050,12 +2466,16 @@ static int signal_acquire_clipboard(LassiConnection *lc, DBusMessage *m) {
         return -1;
     }
 
-    if ((primary ? lc->server->primary_generation : lc->server->clipboard_generation) > g) {
+    if (!connection_update_selection(lc, m, primary, g)) {
         g_debug("Ignoring request for clipboard.");
         return 0;
     }
 
-    /* FIXME, tie break missing */
+    /* We don't share this selection, but keep up with the generation so
+     * that we don't fall behind the mesh. Clipboard data can't be fetched
+     * through relays, so the same goes for peers behind one */
+    if (!lassi_policy_selection_enabled(&lc->server->policy_info, primary) || lc->relay)
+        return 0;
 
     dbus_message_iter_init(m, &iter);
     dbus_message_iter_next(&iter);
@@ -1082,7 +2502,9 @@ static int signal_acquire_clipboard(LassiConnection *lc, DBusMessage *m) {
 
         g_assert(j < alloc_targets);
 
-        targets[j++] = (char*) t;
+        if (lassi_policy_target_allowed(&lc->server->policy_info, primary, t))
+            targets[j++] = (char*) t;
+
         dbus_message_iter_next(&sub);
 
         g_debug("Received target %s on %s", t, lc->id);
@@ -1097,11 +2519,9 @@ static int signal_acquire_clipboard(LassiConnection *lc, DBusMessage *m) {
     if (primary) {
         lc->server->primary_connection = lc;
         lc->server->primary_empty = FALSE;
-        lc->server->primary_generation = g;
     } else {
         lc->server->clipboard_connection = lc;
         lc->server->clipboard_empty = FALSE;
-        lc->server->clipboard_generation = g;
     }
 
     return 0;
@@ -1120,23 +2540,19 @@ static int signal_return_clipboard(LassiConnection *lc, DBusMessage *m) {
         return -1;
     }
 
-    if ((primary ? lc->server->primary_generation : lc->server->clipboard_generation) > g) {
+    if (!connection_update_selection(lc, m, primary, g)) {
         g_debug("Ignoring request for clipboard empty.");
         return 0;
     }
 
-    /* FIXME, tie break missing */
-
     lassi_clipboard_clear(&lc->server->clipboard_info, primary);
 
     if (primary) {
         lc->server->primary_connection = NULL;
         lc->server->primary_empty = TRUE;
-        lc->server->primary_generation = g;
     } else {
         lc->server->clipboard_connection = NULL;
         lc->server->clipboard_empty = TRUE;
-        lc->server->clipboard_generation = g;
     }
 
     return 0;
@@ -1167,11 +2583,22 @@ static int method_get_clipboard(LassiConnection *lc, DBusMessage *m) {
         goto finish;
     }
 
+    if (!lassi_policy_selection_enabled(&lc->server->policy_info, primary) ||
+        !lassi_policy_target_allowed(&lc->server->policy_info, primary, type)) {
+        n = dbus_message_new_error(m, LASSI_INTERFACE ".Refused", "Clipboard target not shared");
+        goto finish;
+    }
+
     if (lassi_clipboard_get(&lc->server->clipboard_info, primary, type, &f, &p, &l) < 0) {
         n = dbus_message_new_error(m, LASSI_INTERFACE ".ClipboardFailure", "Failed to read clipboard data");
         goto finish;
     }
 
+    if (!lassi_policy_transfer_allowed(&lc->server->policy_info, lc, l)) {
+        n = dbus_message_new_error(m, LASSI_INTERFACE ".Refused", "Clipboard transfer refused by policy");
+        goto finish;
+    }
+
     if (l > dbus_connection_get_max_message_size(lc->dbus_connection)*9/10) {
         n = dbus_message_new_error(m, LASSI_INTERFACE ".TooLarge", "Clipboard data too large");
         goto finish;
@@ -1196,7 +2623,7 @@ static int method_get_clipboard(LassiConnection *lc, DBusMessage *m) {
 finish:
     g_assert(n);
 
-    dbus_connection_send(lc->dbus_connection, n, NULL);
+    lassi_connection_send(lc, n);
     dbus_message_unref(n);
 
     g_free(p);
@@ -1221,10 +2648,14 @@ static DBusHandlerResult message_function(DBusConnection *c, DBusMessage *m, voi
 /*             dbus_message_get_member(m), */
 /*             dbus_message_get_serial(m)); */
 
-    if (dbus_message_is_signal(m, DBUS_INTERFACE_LOCAL, "Disconnected"))
-        goto fail;
+    if (dbus_message_is_signal(m, DBUS_INTERFACE_LOCAL, "Disconnected")) {
+        connection_lost(lc);
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+    }
 
-    else if (dbus_message_is_signal(m, LASSI_INTERFACE, "Hello")) {
+    lassi_stats_message_received(&lc->stats, m);
+
+    if (dbus_message_is_signal(m, LASSI_INTERFACE, "Hello")) {
         if (signal_hello(lc, m) < 0)
             goto fail;
 
@@ -1235,6 +2666,21 @@ static DBusHandlerResult message_function(DBusConnection *c, DBusMessage *m, voi
             if (signal_node_added(lc, m) < 0)
                 goto fail;
 
+        } else if (dbus_message_is_signal(m, LASSI_INTERFACE, "Members")) {
+
+            if (signal_members(lc, m) < 0)
+                goto fail;
+
+        } else if (dbus_message_is_signal(m, LASSI_INTERFACE, "Relayed")) {
+
+            if (signal_relayed(lc, m) < 0)
+                goto fail;
+
+        } else if (dbus_message_is_signal(m, LASSI_INTERFACE, "Unreachable")) {
+
+            if (signal_unreachable(lc, m) < 0)
+                goto fail;
+
         } else if (dbus_message_is_signal(m, LASSI_INTERFACE, "NodeRemoved")) {
 
             if (signal_node_removed(lc, m) < 0)
@@ -1260,6 +2706,16 @@ static DBusHandlerResult message_function(DBusConnection *c, DBusMessage *m, voi
             if (signal_motion_event(lc, m) < 0)
                 goto fail;
 
+        } else if (dbus_message_is_signal(m, LASSI_INTERFACE, "MotionAbsoluteEvent")) {
+
+            if (signal_motion_absolute_event(lc, m) < 0)
+                goto fail;
+
+        } else if (dbus_message_is_signal(m, LASSI_INTERFACE, "UpdateParameters")) {
+
+            if (signal_update_parameters(lc, m) < 0)
+                goto fail;
+
         } else if (dbus_message_is_signal(m, LASSI_INTERFACE, "ButtonEvent")) {
 
             if (signal_button_event(lc, m) < 0)
@@ -1275,6 +2731,16 @@ static DBusHandlerResult message_function(DBusConnection *c, DBusMessage *m, voi
             if (signal_return_clipboard(lc, m) < 0)
                 goto fail;
 
+        } else if (dbus_message_is_signal(m, LASSI_INTERFACE, "Ping")) {
+
+            if (lassi_stats_handle_ping(&lc->server->stats_info, lc, m) < 0)
+                goto fail;
+
+        } else if (dbus_message_is_signal(m, LASSI_INTERFACE, "Pong")) {
+
+            if (lassi_stats_handle_pong(&lc->server->stats_info, lc, m) < 0)
+                goto fail;
+
         } else if (dbus_message_is_method_call(m, LASSI_INTERFACE, "GetClipboard")) {
 
             if (method_get_clipboard(lc, m) < 0)
@@ -1297,12 +2763,64 @@ fail:
     return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 }
 
-static LassiConnection* connection_add(LassiServer *ls, DBusConnection *c, gboolean we_are_client) {
-    LassiConnection *lc;
+static void server_append_parameters(LassiServer *ls, DBusMessageIter *iter) {
+    DBusMessageIter sub, entry;
+    GHashTableIter k;
+    gpointer key, value;
     dbus_bool_t b;
-    DBusMessage *m;
-    gint32 ag, og, cg;
-    int fd, one = 1;
+
+    g_assert(ls);
+    g_assert(iter);
+
+    b = dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY,
+                                         DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+                                         DBUS_TYPE_STRING_AS_STRING
+                                         DBUS_TYPE_STRING_AS_STRING
+                                         DBUS_DICT_ENTRY_END_CHAR_AS_STRING,
+                                         &sub);
+    g_assert(b);
+
+    g_hash_table_iter_init(&k, ls->parameters);
+
+    while (g_hash_table_iter_next(&k, &key, &value)) {
+        b = dbus_message_iter_open_container(&sub, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+        g_assert(b);
+
+        b = dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+        g_assert(b);
+
+        b = dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &value);
+        g_assert(b);
+
+        b = dbus_message_iter_close_container(&sub, &entry);
+        g_assert(b);
+    }
+
+    b = dbus_message_iter_close_container(iter, &sub);
+    g_assert(b);
+}
+
+static void server_append_capabilities(LassiServer *ls, DBusMessage *m) {
+    DBusMessageIter iter;
+    guint32 version = LASSI_PROTOCOL_VERSION, capabilities = LASSI_CAPABILITIES;
+    dbus_bool_t b;
+
+    g_assert(ls);
+    g_assert(m);
+
+    dbus_message_iter_init_append(m, &iter);
+
+    b = dbus_message_iter_append_basic(&iter, DBUS_TYPE_UINT32, &version);
+    g_assert(b);
+
+    b = dbus_message_iter_append_basic(&iter, DBUS_TYPE_UINT32, &capabilities);
+    g_assert(b);
+
+    server_append_parameters(ls, &iter);
+}
+
+static LassiConnection* connection_new(LassiServer *ls, DBusConnection *c, gboolean we_are_client) {
+    LassiConnection *lc;
 
     g_assert(ls);
     g_assert(c);
@@ -1313,13 +2831,33 @@ static LassiConnection* connection_add(LassiServer *ls, DBusConnection *c, gbool
     lc->id = lc->address = NULL;
     lc->we_are_client = we_are_client;
     lc->delayed_welcome = FALSE;
+    lc->relay = NULL;
+    lc->relay_to = NULL;
+    lc->relayed = g_hash_table_new(g_str_hash, g_str_equal);
+    lc->lost = FALSE;
+    lc->protocol_version = 0;
+    lc->capabilities = 0;
+    lc->parameters = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    lc->geometry = NULL;
+    lc->motion_sent = lc->motion_applied = 0;
+    lc->held_input = g_queue_new();
+    lc->held_input_id = 0;
+    lc->pointer_valid = FALSE;
+    memset(&lc->stats, 0, sizeof(lc->stats));
+    lc->transfer_window = 0;
+    lc->n_transfers = 0;
     ls->connections = g_list_prepend(ls->connections, lc);
     ls->n_connections++;
 
-    dbus_connection_setup_with_g_main(c, NULL);
+    return lc;
+}
+
+static DBusMessage* server_new_hello(LassiServer *ls) {
+    DBusMessage *m;
+    dbus_bool_t b;
+    gint32 ag, og, cg;
 
-    b = dbus_connection_add_filter(c, message_function, lc, NULL);
-    g_assert(b);
+    g_assert(ls);
 
     m = dbus_message_new_signal("/", LASSI_INTERFACE, "Hello");
     g_assert(m);
@@ -1338,6 +2876,28 @@ static LassiConnection* connection_add(LassiServer *ls, DBusConnection *c, gbool
             DBUS_TYPE_INVALID);
     g_assert(b);
 
+    /* Older peers read the arguments above and ignore the rest */
+    server_append_capabilities(ls, m);
+
+    return m;
+}
+
+static LassiConnection* connection_add(LassiServer *ls, DBusConnection *c, gboolean we_are_client) {
+    LassiConnection *lc;
+    dbus_bool_t b;
+    DBusMessage *m;
+    int fd, one = 1;
+
+    g_assert(ls);
+    g_assert(c);
+
+    lc = connection_new(ls, c, we_are_client);
+
+    dbus_connection_setup_with_g_main(c, NULL);
+
+    b = dbus_connection_add_filter(c, message_function, lc, NULL);
+    g_assert(b);
+
     fd = -1;
     dbus_connection_get_socket(c, &fd);
     g_assert(fd >= 0);
@@ -1345,9 +2905,30 @@ static LassiConnection* connection_add(LassiServer *ls, DBusConnection *c, gbool
     if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0)
         g_warning("Failed to enable TCP_NODELAY");
 
-    b = dbus_connection_send(c, m, NULL);
-    g_assert(b);
+    m = server_new_hello(ls);
+    lassi_connection_send(lc, m);
+    dbus_message_unref(m);
+
+    lassi_tray_update(&ls->tray_info, ls->n_connections);
+    return lc;
+}
+
+static LassiConnection* connection_add_relayed(LassiServer *ls, LassiConnection *relay, const char *id, gboolean we_are_client) {
+    LassiConnection *lc;
+    DBusMessage *m;
+
+    g_assert(ls);
+    g_assert(relay);
+    g_assert(id);
+
+    /* Everything else is end to end, including Hello */
+    lc = connection_new(ls, relay->dbus_connection, we_are_client);
+    lc->relay = relay;
+    lc->relay_to = g_strdup(id);
+    g_hash_table_insert(relay->relayed, lc->relay_to, lc);
 
+    m = server_new_hello(ls);
+    lassi_connection_send(lc, m);
     dbus_message_unref(m);
 
     lassi_tray_update(&ls->tray_info, ls->n_connections);
@@ -1409,6 +2990,20 @@ static int server_init(LassiServer *ls) {
     dbus_server_set_new_connection_function(ls->dbus_server, new_connection, ls, NULL);
 
     ls->connections_by_id = g_hash_table_new(g_str_hash, g_str_equal);
+    ls->awaited = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, awaited_peer_free);
+    ls->parameters = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+    lassi_server_set_parameter(ls, "package", PACKAGE_STRING);
+
+    ls->connect_state = connect_state_new();
+    ls->connect_pool = g_thread_pool_new(connect_thread, ls->connect_state, CONNECT_THREADS_MAX, FALSE, NULL);
+    ls->connecting = g_hash_table_new(g_str_hash, g_str_equal);
+
+    if (lassi_state_init(&ls->state_info, ls) < 0)
+        goto finish;
+
+    if (lassi_reconnect_init(&ls->reconnect_info, ls) < 0)
+        goto finish;
 
     ls->id = g_strdup_printf(_("%s's desktop on %s"), g_get_user_name(), g_get_host_name());
 
@@ -1418,23 +3013,59 @@ static int server_init(LassiServer *ls) {
     /* The initialization of Avahi might have changed ls->id! */
 
     ls->address = dbus_server_get_address(ls->dbus_server);
-    ls->order = g_list_prepend(NULL, g_strdup(ls->id));
+
+    /* Start out with the layout and generations we had when we quit,
+     * so that the mesh converges right away instead of renegotiating */
+    ls->order = lassi_state_get_order(&ls->state_info);
+
+    if (!lassi_server_is_known(ls, ls->id))
+        ls->order = g_list_prepend(ls->order, g_strdup(ls->id));
+
+    lassi_state_get_generations(&ls->state_info,
+                                &ls->active_generation,
+                                &ls->order_generation,
+                                &ls->clipboard_generation,
+                                &ls->primary_generation);
+
+    if (lassi_clock_init(&ls->clock_info, ls) < 0)
+        goto finish;
+
+    if (lassi_record_init(&ls->record_info, ls) < 0)
+        goto finish;
 
     if (lassi_grab_init(&ls->grab_info, ls) < 0)
         goto finish;
 
+#ifdef LASSI_UINPUT
+    if (lassi_uinput_init(&ls->uinput_info, ls) < 0)
+        goto finish;
+#endif
+
+    /* Tell the others our geometry so that they can map positions
+     * exactly and drive our pointer with absolute coordinates */
+    lassi_geometry_to_parameters(ls->grab_info.geometry, ls->parameters);
+
+    if (lassi_pointer_init(&ls->pointer_info, ls) < 0)
+        goto finish;
+
     if (lassi_osd_init(&ls->osd_info) < 0)
         goto finish;
 
     if (lassi_tray_init(&ls->tray_info, ls) < 0)
         goto finish;
 
+    if (lassi_policy_init(&ls->policy_info, ls) < 0)
+        goto finish;
+
     if (lassi_clipboard_init(&ls->clipboard_info, ls) < 0)
         goto finish;
 
     if (lassi_prefs_init(&ls->prefs_info, ls) < 0)
         goto finish;
 
+    if (lassi_stats_init(&ls->stats_info, ls) < 0)
+        goto finish;
+
     r = 0;
 
 finish:
@@ -1455,9 +3086,50 @@ void lassi_server_disconnect(LassiServer *ls, const char *id, gboolean remove_fr
 
         if (i)
             ls->order = g_list_delete_link(ls->order, i);
+
+        lassi_reconnect_forget(&ls->reconnect_info, id);
+        server_save_state(ls);
     }
 }
 
+void lassi_server_remove_lost(LassiServer *ls, const char *id, const char *address) {
+    DBusMessage *n;
+    dbus_bool_t b;
+    gboolean remove_from_order = TRUE;
+    GList *i;
+
+    g_assert(ls);
+    g_assert(id);
+
+    /* What connection_unlink() does for a peer whose link is gone
+     * already and which didn't come back */
+    n = dbus_message_new_signal("/", LASSI_INTERFACE, "NodeRemoved");
+    g_assert(n);
+
+    if (!address)
+        address = "";
+
+    b = dbus_message_append_args(n,
+                                 DBUS_TYPE_STRING, &id,
+                                 DBUS_TYPE_STRING, &address,
+                                 DBUS_TYPE_BOOLEAN, &remove_from_order,
+                                 DBUS_TYPE_INVALID);
+    g_assert(b);
+
+    server_broadcast(ls, n, NULL);
+    dbus_message_unref(n);
+
+    if ((i = g_list_find_custom(ls->order, id, (GCompareFunc) strcmp)))
+        ls->order = g_list_delete_link(ls->order, i);
+
+    lassi_reconnect_forget(&ls->reconnect_info, id);
+    server_save_state(ls);
+
+    server_layout_changed(ls, -1);
+    lassi_prefs_update(&ls->prefs_info);
+    server_dump(ls);
+}
+
 static void server_disconnect_all(LassiServer *ls, gboolean clear_order) {
 
     while (ls->connections)
@@ -1466,6 +3138,7 @@ static void server_disconnect_all(LassiServer *ls, gboolean clear_order) {
     if (clear_order) {
         lassi_list_free(ls->order);
         ls->order = NULL;
+        server_save_state(ls);
     }
 }
 
@@ -1478,26 +3151,95 @@ static void server_done(LassiServer *ls) {
         dbus_server_unref(ls->dbus_server);
     }
 
+    if (ls->connect_pool)
+        server_cancel_connects(ls);
+
+    server_drop_pending_grab(ls);
+
     server_disconnect_all(ls, FALSE);
 
     if (ls->connections_by_id)
         g_hash_table_destroy(ls->connections_by_id);
 
+    if (ls->awaited)
+        g_hash_table_destroy(ls->awaited);
+
+    if (ls->parameters)
+        g_hash_table_destroy(ls->parameters);
+
     g_free(ls->id);
     g_free(ls->address);
 
     lassi_list_free(ls->order);
 
     lassi_grab_done(&ls->grab_info);
+#ifdef LASSI_UINPUT
+    lassi_uinput_done(&ls->uinput_info);
+#endif
+    lassi_pointer_done(&ls->pointer_info);
+    lassi_record_done(&ls->record_info);
     lassi_osd_done(&ls->osd_info);
     lassi_clipboard_done(&ls->clipboard_info);
+    lassi_policy_done(&ls->policy_info);
     lassi_avahi_done(&ls->avahi_info);
     lassi_tray_done(&ls->tray_info);
     lassi_prefs_done(&ls->prefs_info);
+    lassi_stats_done(&ls->stats_info);
+    lassi_reconnect_done(&ls->reconnect_info);
+
+    lassi_stamp_clear(&ls->active_stamp);
+    lassi_stamp_clear(&ls->order_stamp);
+    lassi_stamp_clear(&ls->clipboard_stamp);
+    lassi_stamp_clear(&ls->primary_stamp);
+    lassi_clock_done(&ls->clock_info);
+
+    lassi_state_done(&ls->state_info);
 
     memset(ls, 0, sizeof(*ls));
 }
 
+void lassi_server_geometry_changed(LassiServer *ls) {
+    DBusMessage *n;
+    DBusMessageIter iter;
+
+    g_assert(ls);
+
+    lassi_geometry_to_parameters(ls->grab_info.geometry, ls->parameters);
+
+    n = dbus_message_new_signal("/", LASSI_INTERFACE, "UpdateParameters");
+    g_assert(n);
+
+    dbus_message_iter_init_append(n, &iter);
+    server_append_parameters(ls, &iter);
+
+    server_broadcast(ls, n, NULL);
+    dbus_message_unref(n);
+}
+
+void lassi_server_set_parameter(LassiServer *ls, const char *key, const char *value) {
+    g_assert(ls);
+    g_assert(key);
+
+    /* Only connections established after this will see the new value */
+    if (value)
+        g_hash_table_replace(ls->parameters, g_strdup(key), g_strdup(value));
+    else
+        g_hash_table_remove(ls->parameters, key);
+}
+
+gboolean lassi_connection_has_capability(LassiConnection *lc, guint32 capability) {
+    g_assert(lc);
+
+    return (lc->capabilities & capability) == capability;
+}
+
+const char *lassi_connection_get_parameter(LassiConnection *lc, const char *key) {
+    g_assert(lc);
+    g_assert(key);
+
+    return g_hash_table_lookup(lc->parameters, key);
+}
+
 gboolean lassi_server_is_connected(LassiServer *ls, const char *id) {
     g_assert(ls);
     g_assert(id);
@@ -1538,6 +3280,210 @@ finish:
     return lc;
 }
 
+/* Shared by the main loop and the connect threads, and kept alive by
+ * whoever still uses it. Connects hang for minutes on dead peers, so on
+ * shutdown we don't wait for them: a thread that finishes after that
+ * finds it cancelled and cleans up after itself */
+typedef struct ConnectState {
+    GMutex *mutex;
+    unsigned ref;
+    gboolean cancelled;
+
+    /* Requests that no thread picked up yet */
+    GHashTable *queued;
+} ConnectState;
+
+typedef struct ConnectRequest {
+    LassiServer *server;
+    char *address;
+
+    DBusConnection *connection;
+    char *error;
+
+    /* Handed back to the main loop */
+    gboolean finished;
+} ConnectRequest;
+
+static ConnectState* connect_state_new(void) {
+    ConnectState *s;
+
+    s = g_new0(ConnectState, 1);
+    s->mutex = g_mutex_new();
+    s->ref = 1;
+    s->queued = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+    return s;
+}
+
+static void connect_state_unref(ConnectState *s) {
+    unsigned ref;
+
+    g_assert(s);
+
+    g_mutex_lock(s->mutex);
+    ref = -- s->ref;
+    g_mutex_unlock(s->mutex);
+
+    if (ref > 0)
+        return;
+
+    g_hash_table_destroy(s->queued);
+    g_mutex_free(s->mutex);
+    g_free(s);
+}
+
+static void connect_request_free(ConnectRequest *r) {
+    g_assert(r);
+
+    if (r->connection) {
+        dbus_connection_close(r->connection);
+        dbus_connection_unref(r->connection);
+    }
+
+    g_free(r->address);
+    g_free(r->error);
+    g_free(r);
+}
+
+static gboolean connect_finish(gpointer userdata) {
+    ConnectRequest *r = userdata;
+    LassiServer *ls = r->server;
+
+    g_hash_table_remove(ls->connecting, r->address);
+
+    if (r->connection) {
+
+        if (ls->n_connections < CONNECTIONS_MAX)
+            connection_add(ls, r->connection, TRUE);
+        else
+            dbus_connection_close(r->connection);
+
+        dbus_connection_unref(r->connection);
+        r->connection = NULL;
+    } else
+        g_debug("Failed to connect to %s: %s", r->address, r->error);
+
+    connect_request_free(r);
+
+    return FALSE;
+}
+
+static void connect_thread(gpointer data, gpointer userdata) {
+    ConnectRequest *r = data;
+    ConnectState *s = userdata;
+    gboolean picked;
+    DBusError e;
+
+    /* Runs in the pool: the TCP connect and the D-Bus authentication
+     * may block for a long time on a dead peer, so keep them off the
+     * main loop and hand the result back from an idle callback */
+
+    /* Once cancelled, queued requests are freed already and we may not
+     * touch r */
+    g_mutex_lock(s->mutex);
+    picked = g_hash_table_remove(s->queued, r);
+    g_mutex_unlock(s->mutex);
+
+    if (!picked)
+        goto finish;
+
+    dbus_error_init(&e);
+
+    if (!(r->connection = dbus_connection_open_private(r->address, &e)))
+        r->error = g_strdup(e.message);
+
+    dbus_error_free(&e);
+
+    g_mutex_lock(s->mutex);
+
+    if (!s->cancelled) {
+        r->finished = TRUE;
+        g_idle_add(connect_finish, r);
+        r = NULL;
+    }
+
+    g_mutex_unlock(s->mutex);
+
+    /* The server is gone */
+    if (r)
+        connect_request_free(r);
+
+finish:
+    connect_state_unref(s);
+}
+
+void lassi_server_connect_async(LassiServer *ls, const char *a) {
+    ConnectRequest *r;
+
+    g_assert(ls);
+    g_assert(a);
+
+    if (ls->n_connections >= CONNECTIONS_MAX)
+        return;
+
+    /* Reconnects, Avahi and the pre-connect all dial the same peers,
+     * one blocking connect per address is enough */
+    if (g_hash_table_lookup(ls->connecting, a)) {
+        g_debug("Already connecting to %s", a);
+        return;
+    }
+
+    r = g_new0(ConnectRequest, 1);
+    r->server = ls;
+    r->address = g_strdup(a);
+
+    g_hash_table_insert(ls->connecting, r->address, r);
+
+    /* Every request the pool runs drops a reference when done */
+    g_mutex_lock(ls->connect_state->mutex);
+    g_hash_table_insert(ls->connect_state->queued, r, r);
+    ls->connect_state->ref++;
+    g_mutex_unlock(ls->connect_state->mutex);
+
+    g_thread_pool_push(ls->connect_pool, r, NULL);
+}
+
+static void server_cancel_connects(LassiServer *ls) {
+    ConnectState *s;
+    GList *requests, *l;
+
+    g_assert(ls);
+
+    s = ls->connect_state;
+
+    /* Queued and finished requests are ours to free, the ones being
+     * dialed right now are left to their thread */
+    g_mutex_lock(s->mutex);
+    s->cancelled = TRUE;
+
+    requests = g_hash_table_get_values(ls->connecting);
+
+    for (l = requests; l; l = l->next) {
+        ConnectRequest *r = l->data;
+
+        if (!g_hash_table_remove(s->queued, r) && !r->finished)
+            continue;
+
+        g_source_remove_by_user_data(r);
+        connect_request_free(r);
+    }
+
+    g_mutex_unlock(s->mutex);
+
+    g_list_free(requests);
+
+    /* Don't wait for connects still hanging on dead peers. What is left
+     * in the queue is skipped as soon as a thread gets to it */
+    g_thread_pool_free(ls->connect_pool, FALSE, FALSE);
+    ls->connect_pool = NULL;
+
+    g_hash_table_destroy(ls->connecting);
+    ls->connecting = NULL;
+
+    connect_state_unref(s);
+    ls->connect_state = NULL;
+}
+
 static void log_handler(gchar const* log_domain, GLogLevelFlags log_level, gchar const* message, gpointer user_data) {
     gboolean* verbose = user_data;
 
@@ -1547,13 +3493,95 @@ static void log_handler(gchar const* log_domain, GLogLevelFlags log_level, gchar
     g_log_default_handler (log_domain, log_level, message, NULL);
 }
 
+static char *host_to_address(const char *s) {
+    char **hp, *a;
+    guint port = PORT_MIN;
+
+    hp = g_strsplit(s, ":", 2);
+
+    if (hp[1])
+        port = (guint) atoi(hp[1]);
+
+    a = g_strdup_printf("tcp:port=%u,host=%s", port, hp[0]);
+    g_strfreev(hp);
+
+    return a;
+}
+
 int main(int argc, char *argv[]) {
     gboolean verbose = FALSE;
+    gdouble acceleration = 1.0;
+    gint threshold = 4;
+    gchar *record = NULL, *replay = NULL;
+    gdouble replay_speed = 1.0;
+    gchar *trace = NULL;
+    gboolean hub = FALSE;
+#ifdef LASSI_UINPUT
+    gboolean uinput = FALSE;
+#endif
+#ifdef LASSI_BARRIERS
+    gint edge_pressure = 30, edge_dwell = 0;
+#endif
+    gchar **relays = NULL, **connects = NULL, **r;
     GOptionEntry  entries[] = {
         {
             "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose,
             N_("display information useful for debugging"), NULL
         },
+        {
+            "acceleration", 0, 0, G_OPTION_ARG_DOUBLE, &acceleration,
+            N_("accelerate the pointer on remote screens by this factor"), N_("FACTOR")
+        },
+        {
+            "threshold", 0, 0, G_OPTION_ARG_INT, &threshold,
+            N_("only accelerate motion faster than this many pixels per event"), N_("PIXELS")
+        },
+        {
+            "record", 0, 0, G_OPTION_ARG_FILENAME, &record,
+            N_("record redirected input to a file"), N_("FILE")
+        },
+        {
+            "replay", 0, 0, G_OPTION_ARG_FILENAME, &replay,
+            N_("replay recorded input once it is redirected, then quit"), N_("FILE")
+        },
+        {
+            "replay-speed", 0, 0, G_OPTION_ARG_DOUBLE, &replay_speed,
+            N_("replay faster or slower by this factor, 0 for as fast as possible"), N_("FACTOR")
+        },
+        {
+            "hub", 0, 0, G_OPTION_ARG_NONE, &hub,
+            N_("pass on input between peers that are relayed through us"), NULL
+        },
+        {
+            "relay", 0, 0, G_OPTION_ARG_STRING_ARRAY, &relays,
+            N_("reach the mesh through this hub instead of dialing every peer"), N_("HOST[:PORT]")
+        },
+        {
+            "connect", 0, 0, G_OPTION_ARG_STRING_ARRAY, &connects,
+            N_("connect to a peer that isn't announced on the local network"), N_("HOST[:PORT]")
+        },
+#ifdef LASSI_BARRIERS
+        {
+            "edge-pressure", 0, 0, G_OPTION_ARG_INT, &edge_pressure,
+            N_("push the pointer this far against an edge to move to the next screen"), N_("PIXELS")
+        },
+        {
+            "edge-dwell", 0, 0, G_OPTION_ARG_INT, &edge_dwell,
+            N_("and keep pushing for at least this long"), N_("MSEC")
+        },
+#endif
+#ifdef LASSI_UINPUT
+        {
+            "uinput", 0, 0, G_OPTION_ARG_NONE, &uinput,
+            N_("inject input from other screens through a virtual input device"), NULL
+        },
+#endif
+#ifdef LASSI_TRACING
+        {
+            "trace", 0, 0, G_OPTION_ARG_FILENAME, &trace,
+            N_("record trace points and dump them to a file on exit or SIGUSR1"), N_("FILE")
+        },
+#endif
         {NULL, 0, 0, 0, NULL, NULL, NULL}
     };
     LassiServer ls;
@@ -1565,6 +3593,12 @@ int main(int argc, char *argv[]) {
      * http://bugs.gnome.org/622068 */
     g_setenv ("GNOME_DISABLE_CRASH_DIALOG", "1", TRUE);
 
+    /* Outgoing connects are done from a thread pool */
+#if !GLIB_CHECK_VERSION(2,32,0)
+    g_thread_init(NULL);
+#endif
+    dbus_threads_init_default();
+
     /* Initialize the i18n stuff */
     bindtextdomain(GETTEXT_PACKAGE, LOCALEDIR);
     bind_textdomain_codeset(GETTEXT_PACKAGE, "UTF-8");
@@ -1589,11 +3623,71 @@ int main(int argc, char *argv[]) {
     if (server_init(&ls) < 0)
         goto fail;
 
+    lassi_pointer_set_acceleration(&ls.pointer_info, acceleration, threshold);
+
+#ifdef LASSI_BARRIERS
+    lassi_barrier_set_thresholds(&ls.grab_info.barrier_info, (unsigned) MAX(edge_pressure, 0), (unsigned) MAX(edge_dwell, 0));
+#endif
+
+    if (record && replay) {
+        g_warning("Can't record and replay at the same time.");
+        goto fail;
+    }
+
+    if (record && lassi_record_start(&ls.record_info, record) < 0)
+        goto fail;
+
+    if (replay && lassi_record_load(&ls.record_info, replay, replay_speed) < 0)
+        goto fail;
+
+    if (trace)
+        lassi_trace_start(trace, TRACE_RECORDS);
+
+#ifdef LASSI_UINPUT
+    if (uinput && lassi_uinput_open(&ls.uinput_info) < 0)
+        goto fail;
+#endif
+
+    if (hub) {
+        ls.hub = TRUE;
+        lassi_server_set_parameter(&ls, "relay", "yes");
+    }
+
+    for (r = relays; r && *r; r++) {
+        char *a;
+
+        a = host_to_address(*r);
+        ls.relay_mode = TRUE;
+        lassi_server_connect_async(&ls, a);
+        g_free(a);
+    }
+
+    for (r = connects; r && *r; r++) {
+        char *a;
+
+        a = host_to_address(*r);
+        lassi_server_connect_async(&ls, a);
+        g_free(a);
+    }
+
+    /* Avahi will find the others eventually, don't wait for it. Behind a
+     * relay we dial nobody but the relay */
+    if (!ls.relay_mode)
+        lassi_reconnect_prewarm(&ls.reconnect_info);
+
     gtk_main();
 
 fail:
 
     server_done(&ls);
 
+    lassi_trace_stop();
+
+    g_free(record);
+    g_free(replay);
+    g_free(trace);
+    g_strfreev(relays);
+    g_strfreev(connects);
+
     return 0;
 }
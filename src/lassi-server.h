@@ -7,18 +7,61 @@
 typedef struct LassiServer LassiServer;
 typedef struct LassiConnection LassiConnection;
 
+#define LASSI_INTERFACE "org.gnome.MangoLassi"
+
+/* Announced in Hello after the fixed arguments. Peers that predate
+ * this send neither and are treated as version 0 without capabilities */
+#define LASSI_PROTOCOL_VERSION 1
+
+/* Optional protocol features, each one is only used on a connection
+ * if both ends announced it */
+#define LASSI_CAPABILITY_MOTION_SERIAL (1U << 0)
+#define LASSI_CAPABILITY_ABSOLUTE_MOTION (1U << 1)
+#define LASSI_CAPABILITY_DIRECT_GRAB (1U << 2)
+#define LASSI_CAPABILITY_PING (1U << 3)
+#define LASSI_CAPABILITY_MEMBERSHIP (1U << 4)
+#define LASSI_CAPABILITY_RELAY (1U << 5)
+#define LASSI_CAPABILITY_CLOCK (1U << 6)
+#define LASSI_CAPABILITY_KEY_REPEAT (1U << 7)
+/* The y in UpdateGrab covers the monitors along the crossed edge rather
+ * than the whole height of the screen */
+#define LASSI_CAPABILITY_EDGE_Y (1U << 8)
+
+#define LASSI_CAPABILITIES (LASSI_CAPABILITY_MOTION_SERIAL|LASSI_CAPABILITY_ABSOLUTE_MOTION|LASSI_CAPABILITY_DIRECT_GRAB|LASSI_CAPABILITY_PING|LASSI_CAPABILITY_MEMBERSHIP|LASSI_CAPABILITY_RELAY|LASSI_CAPABILITY_CLOCK|LASSI_CAPABILITY_KEY_REPEAT|LASSI_CAPABILITY_EDGE_Y)
+
 #include "lassi-grab.h"
 #include "lassi-osd.h"
 #include "lassi-clipboard.h"
 #include "lassi-avahi.h"
 #include "lassi-tray.h"
 #include "lassi-prefs.h"
+#include "lassi-reconnect.h"
+#include "lassi-state.h"
+#include "lassi-pointer.h"
+#include "lassi-geometry.h"
+#include "lassi-record.h"
+#include "lassi-stats.h"
+#include "lassi-policy.h"
+#include "lassi-clock.h"
+
+#ifdef LASSI_UINPUT
+#include "lassi-uinput.h"
+#endif
 
 struct LassiServer {
     DBusServer *dbus_server;
 
+    /* Runs the blocking part of outgoing connects. Addresses that are
+     * queued or being dialed map to their request */
+    GThreadPool *connect_pool;
+    GHashTable *connecting;
+    struct ConnectState *connect_state;
+
     char *id, *address;
     uint16_t port;
+
+    /* Key/value pairs we announce in Hello */
+    GHashTable *parameters;
     
     /* All connections */
     GList *connections;
@@ -26,23 +69,42 @@ struct LassiServer {
 
     /* Configured connections */
     GHashTable *connections_by_id;
+
+    /* Peers we expect to dial us when joining, indexed by id */
+    GHashTable *awaited;
+
+    /* --hub: pass on Relayed frames between our peers. --relay: reach
+     * the peers our relays know about through them instead of dialing */
+    gboolean hub, relay_mode;
     GList *connections_left, *connections_right; /* stored from right to left, resp, left to right */
 
+    /* Every replicated state below has a generation for older peers
+     * and a stamp of the hybrid logical clock for everybody else */
+    LassiClockInfo clock_info;
+
     /* Active display management */
     int active_generation;
+    LassiStamp active_stamp;
     LassiConnection *active_connection;
 
+    /* The UpdateGrab the rest of the mesh hasn't heard yet */
+    DBusMessage *pending_grab;
+    guint pending_grab_id;
+
     /* Layout management */
     int order_generation;
+    LassiStamp order_stamp;
     GList *order;
 
     /* Clipboard CLIPBOARD management */
     int clipboard_generation;
+    LassiStamp clipboard_stamp;
     LassiConnection *clipboard_connection;
     gboolean clipboard_empty;
 
     /* Clipboard PRIMARY management */
     int primary_generation;
+    LassiStamp primary_stamp;
     LassiConnection *primary_connection;
     gboolean primary_empty;
     
@@ -52,6 +114,15 @@ struct LassiServer {
     LassiAvahiInfo avahi_info;
     LassiTrayInfo tray_info;
     LassiPrefsInfo prefs_info;
+    LassiReconnectInfo reconnect_info;
+    LassiStateInfo state_info;
+    LassiPointerInfo pointer_info;
+    LassiRecordInfo record_info;
+    LassiStatsInfo stats_info;
+    LassiPolicyInfo policy_info;
+#ifdef LASSI_UINPUT
+    LassiUinputInfo uinput_info;
+#endif
 };
 
 struct LassiConnection {
@@ -62,6 +133,44 @@ struct LassiConnection {
 
     gboolean we_are_client;
     gboolean delayed_welcome;
+
+    /* Peers we only reach through a relay share its DBusConnection and
+     * are addressed by relay_to. On the link to the relay itself,
+     * relayed holds those peers indexed by id */
+    LassiConnection *relay;
+    char *relay_to;
+    GHashTable *relayed;
+
+    /* Negotiated in Hello: the lower protocol version, the common
+     * capabilities and whatever parameters the peer announced */
+    guint32 protocol_version;
+    guint32 capabilities;
+    GHashTable *parameters;
+
+    /* Parsed from their parameters, NULL if they didn't announce it */
+    LassiGeometry *geometry;
+
+    /* Serial of the last MotionEvent we sent to respectively injected
+     * from this peer. Button and key events carry the serial of the
+     * motion they follow and are held back until it has been applied */
+    guint32 motion_sent, motion_applied;
+    GQueue *held_input;
+    guint held_input_id;
+
+    /* Where we think their pointer is while we drive it with absolute
+     * coordinates, see lassi-pointer.c */
+    gboolean pointer_valid;
+    double pointer_x, pointer_y;
+
+    LassiStats stats;
+
+    /* Clipboard transfers with this peer since transfer_window, see
+     * lassi-policy.c */
+    guint64 transfer_window;
+    unsigned n_transfers;
+
+    /* The link dropped and we're hoping for a quick resume */
+    gboolean lost;
 };
 
 void lassi_server_set_order(LassiServer *ls, GList *order);
@@ -73,15 +182,29 @@ int lassi_server_acquire_grab(LassiServer *s);
 int lassi_server_motion_event(LassiServer *s, int dx, int dy);
 int lassi_server_button_event(LassiServer *ls, unsigned button, gboolean is_press);
 int lassi_server_key_event(LassiServer *ls, unsigned key, gboolean is_press);
+gboolean lassi_server_peer_repeats_keys(LassiServer *ls);
 
 int lassi_server_acquire_clipboard(LassiServer *ls, gboolean primary, char**targets);
 int lassi_server_return_clipboard(LassiServer *ls, gboolean primary);
 int lassi_server_get_clipboard(LassiServer *ls, gboolean primary, const char *t, int *f, gpointer *p, int *l);
 
 LassiConnection* lassi_server_connect(LassiServer *ls, const char *a);
+void lassi_server_connect_async(LassiServer *ls, const char *a);
 void lassi_server_disconnect(LassiServer *ls, const char *id, gboolean remove_from_order);
+void lassi_server_add_member(LassiServer *ls, const char *id, const char *address, gboolean follows_rule);
+void lassi_server_remove_lost(LassiServer *ls, const char *id, const char *address);
         
+void lassi_connection_send(LassiConnection *lc, DBusMessage *m);
+
+void lassi_server_set_parameter(LassiServer *ls, const char *key, const char *value);
+void lassi_server_geometry_changed(LassiServer *ls);
+
+gboolean lassi_connection_has_capability(LassiConnection *lc, guint32 capability);
+const char *lassi_connection_get_parameter(LassiConnection *lc, const char *key);
+
 gboolean lassi_server_is_connected(LassiServer *ls, const char *id);
 gboolean lassi_server_is_known(LassiServer *ls, const char *id);
 
+void lassi_server_show_welcome(LassiServer *ls, const char *id, gboolean to_left, gboolean is_connect);
+
 #endif
@@ -0,0 +1,847 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <stdio.h>
+
+#include <glib.h>
+
+#include "lassi-order.h"
+#include "lassi-clock.h"
+#include "lassi-replica.h"
+
+/* Runs a mesh of simulated peers in one process and counts what it costs
+ * to agree on the layout, the grab and the clipboard owner, and to let a
+ * new peer join. The peers apply updates with the same rules in
+ * lassi-replica.c as the signal handlers in lassi-server.c, with the real
+ * list merge and clock, but only keep the replicated state and talk
+ * over an in-memory transport with virtual time. Links are FIFO like TCP
+ * unless --reorder lets frames overtake each other. Byte counts are
+ * estimates of what the signals take on the wire. */
+
+/* Roughly what the fixed header of one of our signals takes on the wire:
+ * path, interface, member and signature */
+#define HEADER_BYTES 80
+
+/* Mirror lassi-server.c */
+#define DIAL_FALLBACK_MSEC 3000
+
+/* Give up on a run that obviously doesn't settle */
+#define DEFAULT_MAX_MESSAGES 1000000
+
+typedef enum SimType {
+    SIM_HELLO,
+    SIM_NODE_ADDED,
+    SIM_MEMBERS,
+    SIM_UPDATE_ORDER,
+    SIM_UPDATE_GRAB,
+    SIM_ACQUIRE_CLIPBOARD,
+    SIM_DIAL_FALLBACK,
+    SIM_MAX
+} SimType;
+
+typedef struct SimEvent {
+    SimType type;
+    unsigned from, to;
+    double at;
+    guint64 seq;
+
+    gint32 generation;
+    guint64 time;
+    char *origin;
+
+    /* Hello: whether the sender dialed, and the generations besides the
+     * active one */
+    gboolean client;
+    gint32 order_generation, clipboard_generation;
+
+    /* Active peer of UpdateGrab, new peer of NodeAdded */
+    char *id;
+
+    /* Layout of UpdateOrder, peers of Members */
+    GList *list;
+} SimEvent;
+
+typedef struct SimNode {
+    char *id;
+
+    LassiClockInfo clock;
+
+    GList *order;
+    int order_generation;
+    LassiStamp order_stamp;
+
+    char *active;
+    int active_generation;
+    LassiStamp active_stamp;
+
+    char *owner;
+    int clipboard_generation;
+    LassiStamp clipboard_stamp;
+} SimNode;
+
+typedef struct Sim {
+    SimNode *nodes;
+    unsigned n_nodes;
+
+    /* linked[i*n+j]: i got the Hello of j, dialing[i*n+j]: i dialed or
+     * awaits j */
+    gboolean *linked, *dialing;
+
+    /* When the last frame on each link arrives, to keep them in order */
+    double *link_free;
+
+    GQueue *events;
+    guint64 seq;
+    double now;
+
+    GRand *rand;
+    double delay, jitter, loss, reorder;
+    gboolean legacy;
+    guint64 max_messages;
+
+    guint64 messages[SIM_MAX], bytes, dropped;
+    double settled;
+} Sim;
+
+static const char * const type_names[SIM_MAX] = {
+    [SIM_HELLO] = "Hello",
+    [SIM_NODE_ADDED] = "NodeAdded",
+    [SIM_MEMBERS] = "Members",
+    [SIM_UPDATE_ORDER] = "UpdateOrder",
+    [SIM_UPDATE_GRAB] = "UpdateGrab",
+    [SIM_ACQUIRE_CLIPBOARD] = "AcquireClipboard",
+    [SIM_DIAL_FALLBACK] = "dial fallback"
+};
+
+static unsigned string_size(const char *s) {
+    return 4 + strlen(s) + 1;
+}
+
+static unsigned event_size(SimEvent *e) {
+    unsigned size = HEADER_BYTES;
+    GList *l;
+
+    switch (e->type) {
+        case SIM_HELLO:
+            /* id, address, three generations, version, capabilities */
+            size += string_size(e->id) + string_size("tcp:host=192.168.0.1,port=7421") + 5*4;
+            break;
+
+        case SIM_NODE_ADDED:
+            size += string_size(e->id) + string_size("tcp:host=192.168.0.1,port=7421") + 4;
+            break;
+
+        case SIM_MEMBERS:
+            size += 4;
+            for (l = e->list; l; l = l->next)
+                size += 8 + string_size(l->data) + string_size("tcp:host=192.168.0.1,port=7421") + 4;
+            break;
+
+        case SIM_UPDATE_ORDER:
+            size += 4 + 4;
+            for (l = e->list; l; l = l->next)
+                size += string_size(l->data);
+            break;
+
+        case SIM_UPDATE_GRAB:
+            size += 4 + string_size(e->id) + 4;
+            break;
+
+        case SIM_ACQUIRE_CLIPBOARD:
+            /* A typical list of text targets */
+            size += 4 + 4 + 4 + 5 * string_size("UTF8_STRING");
+            break;
+
+        default:
+            g_assert_not_reached();
+    }
+
+    if (e->time > 0)
+        size += 8 + string_size(e->origin);
+
+    return size;
+}
+
+static void event_free(SimEvent *e) {
+    g_free(e->origin);
+    g_free(e->id);
+    lassi_list_free(e->list);
+    g_list_free(e->list);
+    g_free(e);
+}
+
+static gint event_compare(gconstpointer a, gconstpointer b, gpointer userdata) {
+    const SimEvent *x = a, *y = b;
+
+    if (x->at != y->at)
+        return x->at < y->at ? -1 : 1;
+
+    return x->seq < y->seq ? -1 : 1;
+}
+
+static void sim_schedule(Sim *s, SimEvent *e, double at) {
+    e->at = at;
+    e->seq = s->seq++;
+    g_queue_insert_sorted(s->events, e, event_compare, NULL);
+}
+
+static SimEvent *event_new(SimType type, unsigned from, LassiStamp *stamp, gint32 generation) {
+    SimEvent *e;
+
+    e = g_new0(SimEvent, 1);
+    e->type = type;
+    e->from = from;
+    e->generation = generation;
+
+    if (stamp && stamp->time > 0) {
+        e->time = stamp->time;
+        e->origin = g_strdup(stamp->origin);
+    }
+
+    return e;
+}
+
+static void sim_send(Sim *s, unsigned from, unsigned to, SimEvent *template) {
+    SimEvent *e;
+    double at;
+    unsigned link;
+
+    e = g_new(SimEvent, 1);
+    *e = *template;
+    e->from = from;
+    e->to = to;
+    e->origin = g_strdup(template->origin);
+    e->id = g_strdup(template->id);
+    e->list = lassi_list_copy(template->list);
+
+    s->messages[e->type]++;
+    s->bytes += event_size(e);
+
+    /* Connection setup is left to TCP */
+    if (e->type != SIM_HELLO && g_rand_double(s->rand) < s->loss) {
+        s->dropped++;
+        event_free(e);
+        return;
+    }
+
+    at = s->now + s->delay + g_rand_double(s->rand) * s->jitter;
+
+    link = e->from * s->n_nodes + to;
+
+    if (g_rand_double(s->rand) >= s->reorder) {
+        at = MAX(at, s->link_free[link]);
+        s->link_free[link] = at;
+    }
+
+    sim_schedule(s, e, at);
+}
+
+static void sim_broadcast(Sim *s, unsigned from, unsigned except, SimEvent *template) {
+    unsigned j;
+
+    for (j = 0; j < s->n_nodes; j++)
+        if (j != from && j != except && s->linked[from * s->n_nodes + j])
+            sim_send(s, from, j, template);
+}
+
+static int node_index(Sim *s, const char *id) {
+    unsigned j;
+
+    for (j = 0; j < s->n_nodes; j++)
+        if (strcmp(s->nodes[j].id, id) == 0)
+            return j;
+
+    return -1;
+}
+
+static void node_tick(SimNode *n, LassiStamp *stamp) {
+    lassi_stamp_set(stamp, lassi_clock_tick(&n->clock), n->id);
+}
+
+static gboolean event_stamped(Sim *s, SimNode *n, SimEvent *e) {
+
+    if (s->legacy || e->time == 0)
+        return FALSE;
+
+    lassi_clock_witness(&n->clock, e->time);
+    return TRUE;
+}
+
+static void node_send_update_order(Sim *s, unsigned i, unsigned except) {
+    SimNode *n = &s->nodes[i];
+    SimEvent *e;
+
+    if (!s->legacy)
+        node_tick(n, &n->order_stamp);
+
+    e = event_new(SIM_UPDATE_ORDER, i, &n->order_stamp, ++ n->order_generation);
+    e->list = lassi_list_copy(n->order);
+    sim_broadcast(s, i, except, e);
+    event_free(e);
+}
+
+static void node_send_update_grab(Sim *s, unsigned i) {
+    SimNode *n = &s->nodes[i];
+    SimEvent *e;
+
+    if (!s->legacy)
+        node_tick(n, &n->active_stamp);
+
+    e = event_new(SIM_UPDATE_GRAB, i, &n->active_stamp, ++ n->active_generation);
+    e->id = g_strdup(n->active);
+    sim_broadcast(s, i, i, e);
+    event_free(e);
+}
+
+static void node_acquire_clipboard(Sim *s, unsigned i) {
+    SimNode *n = &s->nodes[i];
+    SimEvent *e;
+
+    g_free(n->owner);
+    n->owner = g_strdup(n->id);
+
+    if (!s->legacy)
+        node_tick(n, &n->clipboard_stamp);
+
+    e = event_new(SIM_ACQUIRE_CLIPBOARD, i, &n->clipboard_stamp, ++ n->clipboard_generation);
+    sim_broadcast(s, i, i, e);
+    event_free(e);
+}
+
+static SimEvent *hello_new(Sim *s, unsigned i, gboolean client) {
+    SimNode *n = &s->nodes[i];
+    SimEvent *e;
+
+    e = event_new(SIM_HELLO, i, NULL, n->active_generation);
+    e->id = g_strdup(n->id);
+    e->client = client;
+    e->order_generation = n->order_generation;
+    e->clipboard_generation = n->clipboard_generation;
+
+    return e;
+}
+
+static void sim_dial(Sim *s, unsigned i, unsigned j) {
+    SimEvent *e;
+
+    s->dialing[i * s->n_nodes + j] = s->dialing[j * s->n_nodes + i] = TRUE;
+
+    /* Both ends say Hello once the link is up. The dialer is the client */
+    e = hello_new(s, i, TRUE);
+    sim_send(s, i, j, e);
+    event_free(e);
+
+    e = hello_new(s, j, FALSE);
+    sim_send(s, j, i, e);
+    event_free(e);
+}
+
+static void node_add_member(Sim *s, unsigned i, const char *id) {
+    SimNode *n = &s->nodes[i];
+    SimEvent *e;
+    int j;
+
+    if ((j = node_index(s, id)) < 0 || (unsigned) j == i)
+        return;
+
+    if (s->linked[i * s->n_nodes + j] || s->dialing[i * s->n_nodes + j])
+        return;
+
+    if (strcmp(n->id, id) < 0) {
+        sim_dial(s, i, j);
+        return;
+    }
+
+    s->dialing[i * s->n_nodes + j] = TRUE;
+
+    e = event_new(SIM_DIAL_FALLBACK, j, NULL, 0);
+    e->to = i;
+    sim_schedule(s, e, s->now + DIAL_FALLBACK_MSEC);
+}
+
+static void node_sync_state(Sim *s, unsigned i, unsigned to) {
+    SimNode *n = &s->nodes[i];
+    SimEvent *e;
+
+    if (n->active_stamp.time > 0 && (strcmp(n->active, n->id) == 0 || strcmp(n->active, s->nodes[to].id) == 0)) {
+        e = event_new(SIM_UPDATE_GRAB, i, &n->active_stamp, ++ n->active_generation);
+        e->id = g_strdup(n->active);
+        sim_send(s, i, to, e);
+        event_free(e);
+    }
+
+    if (n->order_stamp.time > 0) {
+        e = event_new(SIM_UPDATE_ORDER, i, &n->order_stamp, ++ n->order_generation);
+        e->list = lassi_list_copy(n->order);
+        sim_send(s, i, to, e);
+        event_free(e);
+    }
+}
+
+static void recv_hello(Sim *s, SimNode *n, unsigned i, SimEvent *e) {
+    SimEvent *m;
+    GList *l;
+    unsigned j;
+
+    if (s->linked[i * s->n_nodes + e->from])
+        return;
+
+    s->linked[i * s->n_nodes + e->from] = TRUE;
+
+    lassi_replica_merge_generation(&n->active_generation, e->generation);
+    lassi_replica_merge_generation(&n->order_generation, e->order_generation);
+    lassi_replica_merge_generation(&n->clipboard_generation, e->clipboard_generation);
+
+    for (l = n->order; l; l = l->next)
+        if (strcmp(l->data, e->id) == 0)
+            break;
+
+    if (!l)
+        n->order = g_list_append(n->order, g_strdup(e->id));
+
+    m = event_new(SIM_NODE_ADDED, i, NULL, 0);
+    m->id = g_strdup(e->id);
+    sim_broadcast(s, i, e->from, m);
+    event_free(m);
+
+    m = event_new(SIM_MEMBERS, i, NULL, 0);
+
+    for (j = 0; j < s->n_nodes; j++)
+        if (j != e->from && s->linked[i * s->n_nodes + j])
+            m->list = g_list_prepend(m->list, g_strdup(s->nodes[j].id));
+
+    sim_send(s, i, e->from, m);
+    event_free(m);
+
+    if (!s->legacy)
+        node_sync_state(s, i, e->from);
+
+    if (!e->client) {
+        node_send_update_grab(s, i);
+        node_send_update_order(s, i, i);
+    }
+}
+
+static gboolean recv_update_order(Sim *s, SimNode *n, unsigned i, SimEvent *e) {
+    GList *merged;
+    gboolean has_stamp, stamped;
+
+    has_stamp = event_stamped(s, n, e);
+    stamped = lassi_replica_stamped(&n->order_stamp, has_stamp);
+
+    if (lassi_replica_update_order(&n->order_generation, &n->order_stamp, n->order,
+                                   e->generation, e->list, has_stamp, e->time, e->origin, &merged) != LASSI_REPLICA_APPLIED)
+        return FALSE;
+
+    if (merged) {
+        lassi_list_free(n->order);
+        g_list_free(n->order);
+        n->order = merged;
+    }
+
+    if (stamped) {
+        if (lassi_list_compare(n->order, e->list))
+            node_send_update_order(s, i, i);
+
+        return TRUE;
+    }
+
+    node_send_update_order(s, i, lassi_list_compare(n->order, e->list) ? i : e->from);
+    n->order_generation = e->generation;
+
+    return TRUE;
+}
+
+static gboolean recv_update_grab(Sim *s, SimNode *n, unsigned i, SimEvent *e) {
+    gboolean has_stamp, stamped;
+    int k;
+
+    /* lassi-server.c drops the link for this unless it is stamped */
+    if ((k = node_index(s, e->id)) < 0 || ((unsigned) k != i && !s->linked[i * s->n_nodes + k]))
+        return FALSE;
+
+    has_stamp = event_stamped(s, n, e);
+    stamped = lassi_replica_stamped(&n->active_stamp, has_stamp);
+
+    switch (lassi_replica_update_grab(&n->active_generation, &n->active_stamp, n->active,
+                                      e->generation, e->id, has_stamp, e->time, e->origin)) {
+
+        case LASSI_REPLICA_IGNORED:
+            return FALSE;
+
+        case LASSI_REPLICA_UNCHANGED:
+            /* A stamped one still moved the stamp on */
+            return stamped;
+
+        case LASSI_REPLICA_APPLIED:
+            break;
+    }
+
+    g_free(n->active);
+    n->active = g_strdup(e->id);
+
+    if (!stamped)
+        sim_broadcast(s, i, e->from, e);
+
+    return TRUE;
+}
+
+static gboolean recv_acquire_clipboard(Sim *s, SimNode *n, unsigned i, SimEvent *e) {
+
+    if (lassi_replica_update_selection(&n->clipboard_generation, &n->clipboard_stamp,
+                                       e->generation, event_stamped(s, n, e), e->time, e->origin) == LASSI_REPLICA_IGNORED)
+        return FALSE;
+
+    g_free(n->owner);
+    n->owner = g_strdup(s->nodes[e->from].id);
+
+    return TRUE;
+}
+
+static void sim_deliver(Sim *s, SimEvent *e) {
+    SimNode *n = &s->nodes[e->to];
+    gboolean changed = FALSE;
+    GList *l;
+
+    switch (e->type) {
+        case SIM_HELLO:
+            recv_hello(s, n, e->to, e);
+            changed = TRUE;
+            break;
+
+        case SIM_NODE_ADDED:
+            node_add_member(s, e->to, e->id);
+            break;
+
+        case SIM_MEMBERS:
+            for (l = e->list; l; l = l->next)
+                node_add_member(s, e->to, l->data);
+            break;
+
+        case SIM_UPDATE_ORDER:
+            changed = recv_update_order(s, n, e->to, e);
+            break;
+
+        case SIM_UPDATE_GRAB:
+            changed = recv_update_grab(s, n, e->to, e);
+            break;
+
+        case SIM_ACQUIRE_CLIPBOARD:
+            changed = recv_acquire_clipboard(s, n, e->to, e);
+            break;
+
+        case SIM_DIAL_FALLBACK:
+            if (!s->linked[e->to * s->n_nodes + e->from])
+                sim_dial(s, e->to, e->from);
+            break;
+
+        default:
+            g_assert_not_reached();
+    }
+
+    if (changed)
+        s->settled = s->now;
+}
+
+static guint64 sim_total(Sim *s) {
+    guint64 total = 0;
+    unsigned t;
+
+    for (t = 0; t < SIM_MAX; t++)
+        total += s->messages[t];
+
+    return total;
+}
+
+static gboolean sim_run(Sim *s) {
+    SimEvent *e;
+
+    while ((e = g_queue_pop_head(s->events))) {
+        s->now = e->at;
+        sim_deliver(s, e);
+        event_free(e);
+
+        if (sim_total(s) > s->max_messages)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean sim_converged(Sim *s) {
+    unsigned i, j;
+
+    for (i = 0; i < s->n_nodes; i++) {
+        SimNode *a = &s->nodes[i], *b = &s->nodes[0];
+
+        for (j = 0; j < s->n_nodes; j++)
+            if (i != j && !s->linked[i * s->n_nodes + j])
+                return FALSE;
+
+        /* A newcomer doesn't hear about the clipboard before it changes */
+        if (lassi_list_compare(a->order, b->order) ||
+            strcmp(a->active, b->active) ||
+            (a->owner && b->owner && strcmp(a->owner, b->owner)))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+static Sim *sim_new(unsigned n_nodes, gboolean joined, gboolean legacy) {
+    Sim *s;
+    unsigned i, j;
+    LassiStamp stamp = { 0, NULL };
+
+    s = g_new0(Sim, 1);
+    s->n_nodes = n_nodes;
+    s->nodes = g_new0(SimNode, n_nodes);
+    s->linked = g_new0(gboolean, n_nodes * n_nodes);
+    s->dialing = g_new0(gboolean, n_nodes * n_nodes);
+    s->link_free = g_new0(double, n_nodes * n_nodes);
+    s->events = g_queue_new();
+    s->legacy = legacy;
+
+    for (i = 0; i < n_nodes; i++)
+        s->nodes[i].id = g_strdup_printf("node-%04u", i);
+
+    /* Everybody but the last one agrees on the state we start from */
+    for (i = 0; i < n_nodes; i++) {
+        SimNode *n = &s->nodes[i];
+
+        /* Nothing but the last time seen to set up */
+        memset(&n->clock, 0, sizeof(n->clock));
+
+        if (!joined && i == n_nodes - 1) {
+            n->order = g_list_append(NULL, g_strdup(n->id));
+            n->active = g_strdup(n->id);
+            continue;
+        }
+
+        if (!legacy && !stamp.origin)
+            lassi_stamp_set(&stamp, lassi_clock_tick(&n->clock), n->id);
+
+        for (j = 0; j < (joined ? n_nodes : n_nodes - 1); j++) {
+            n->order = g_list_append(n->order, g_strdup(s->nodes[j].id));
+
+            if (j != i)
+                s->linked[i * n_nodes + j] = TRUE;
+        }
+
+        n->active = g_strdup(s->nodes[0].id);
+        n->owner = g_strdup(s->nodes[0].id);
+        n->order_generation = n->active_generation = n->clipboard_generation = 1;
+
+        if (legacy)
+            continue;
+
+        lassi_stamp_set(&n->order_stamp, stamp.time, stamp.origin);
+        lassi_stamp_set(&n->active_stamp, stamp.time, stamp.origin);
+        lassi_stamp_set(&n->clipboard_stamp, stamp.time, stamp.origin);
+    }
+
+    lassi_stamp_clear(&stamp);
+
+    return s;
+}
+
+static void sim_free(Sim *s) {
+    unsigned i;
+    SimEvent *e;
+
+    while ((e = g_queue_pop_head(s->events)))
+        event_free(e);
+
+    g_queue_free(s->events);
+
+    for (i = 0; i < s->n_nodes; i++) {
+        SimNode *n = &s->nodes[i];
+
+        g_free(n->id);
+        lassi_list_free(n->order);
+        g_list_free(n->order);
+        g_free(n->active);
+        g_free(n->owner);
+        lassi_stamp_clear(&n->order_stamp);
+        lassi_stamp_clear(&n->active_stamp);
+        lassi_stamp_clear(&n->clipboard_stamp);
+    }
+
+    g_free(s->nodes);
+    g_free(s->linked);
+    g_free(s->dialing);
+    g_free(s->link_free);
+    g_free(s);
+}
+
+static void sim_start(Sim *s, const char *op, unsigned concurrent) {
+    unsigned i;
+
+    if (strcmp(op, "join") == 0) {
+        /* The newcomer knows one member and learns about the rest */
+        sim_dial(s, s->n_nodes - 1, 0);
+        return;
+    }
+
+    for (i = 0; i < concurrent; i++) {
+        SimNode *n = &s->nodes[i];
+
+        if (strcmp(op, "order") == 0) {
+            GList *l;
+
+            /* Everybody moves itself to the left end at once */
+            l = g_list_find_custom(n->order, n->id, (GCompareFunc) strcmp);
+            n->order = g_list_remove_link(n->order, l);
+            n->order = g_list_concat(l, n->order);
+
+            node_send_update_order(s, i, i);
+
+        } else if (strcmp(op, "grab") == 0) {
+            g_free(n->active);
+            n->active = g_strdup(n->id);
+
+            node_send_update_grab(s, i);
+
+        } else if (strcmp(op, "clipboard") == 0)
+            node_acquire_clipboard(s, i);
+        else
+            g_assert_not_reached();
+    }
+}
+
+int main(int argc, char *argv[]) {
+    gint nodes = 8, concurrent = 2, seed = 0;
+    gint64 max_messages = DEFAULT_MAX_MESSAGES;
+    gdouble delay = 1.0, jitter = 0.0, loss = 0.0, reorder = 0.0;
+    gboolean scale = FALSE, legacy = FALSE, verbose = FALSE;
+    gchar *op = NULL;
+    GOptionEntry entries[] = {
+        {
+            "op", 'o', 0, G_OPTION_ARG_STRING, &op,
+            "operation to simulate: order, grab, clipboard, join or all", "OP"
+        },
+        {
+            "nodes", 'n', 0, G_OPTION_ARG_INT, &nodes,
+            "number of peers in the mesh", "N"
+        },
+        {
+            "scale", 0, 0, G_OPTION_ARG_NONE, &scale,
+            "run with 2, 4, 8, ... up to --nodes peers", NULL
+        },
+        {
+            "concurrent", 'c', 0, G_OPTION_ARG_INT, &concurrent,
+            "number of peers changing the state at the same time", "N"
+        },
+        {
+            "delay", 0, 0, G_OPTION_ARG_DOUBLE, &delay,
+            "one way delay of every link", "MSEC"
+        },
+        {
+            "jitter", 0, 0, G_OPTION_ARG_DOUBLE, &jitter,
+            "add up to this much random delay", "MSEC"
+        },
+        {
+            "loss", 0, 0, G_OPTION_ARG_DOUBLE, &loss,
+            "drop this fraction of frames, Hello excepted", "FRACTION"
+        },
+        {
+            "reorder", 0, 0, G_OPTION_ARG_DOUBLE, &reorder,
+            "let this fraction of frames overtake earlier ones", "FRACTION"
+        },
+        {
+            "seed", 0, 0, G_OPTION_ARG_INT, &seed,
+            "seed of the random number generator", "SEED"
+        },
+        {
+            "legacy", 0, 0, G_OPTION_ARG_NONE, &legacy,
+            "simulate peers without the clock, using generations only", NULL
+        },
+        {
+            "max-messages", 0, 0, G_OPTION_ARG_INT64, &max_messages,
+            "give up on a run after this many messages", "N"
+        },
+        {
+            "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose,
+            "show the messages per signal", NULL
+        },
+        {NULL, 0, 0, 0, NULL, NULL, NULL}
+    };
+    static const char * const ops[] = { "order", "grab", "clipboard", "join", NULL };
+    GOptionContext *context;
+    GError *error = NULL;
+    const char * const *o;
+    unsigned n;
+
+    context = g_option_context_new("- simulate a mango-lassi mesh");
+    g_option_context_add_main_entries(context, entries, NULL);
+
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        fprintf(stderr, "%s\n", error->message);
+        g_error_free(error);
+        g_option_context_free(context);
+        return 1;
+    }
+
+    g_option_context_free(context);
+
+    if (nodes < 2 || concurrent < 1 || delay < 0 || jitter < 0 ||
+        loss < 0 || loss >= 1 || reorder < 0 || reorder > 1 || max_messages < 1) {
+        fprintf(stderr, "Invalid arguments.\n");
+        return 1;
+    }
+
+    printf("%-10s %6s %10s %10s %12s %10s %10s %s\n",
+           "op", "nodes", "messages", "per-node", "bytes", "dropped", "msec", "result");
+
+    for (o = ops; *o; o++) {
+
+        if (op && strcmp(op, "all") && strcmp(op, *o))
+            continue;
+
+        for (n = scale ? 2 : (unsigned) nodes; n <= (unsigned) nodes; n = scale ? n * 2 : n + 1) {
+            Sim *s;
+            gboolean finished, converged;
+            guint64 total;
+
+            s = sim_new(n, strcmp(*o, "join") != 0, legacy);
+            s->rand = g_rand_new_with_seed((guint32) seed);
+            s->delay = delay;
+            s->jitter = jitter;
+            s->loss = loss;
+            s->reorder = reorder;
+            s->max_messages = (guint64) max_messages;
+
+            sim_start(s, *o, MIN((unsigned) concurrent, n));
+
+            finished = sim_run(s);
+            converged = finished && sim_converged(s);
+            total = sim_total(s);
+
+            printf("%-10s %6u %10llu %10.1f %12llu %10llu %10.1f %s\n",
+                   *o, n,
+                   (unsigned long long) total,
+                   (double) total / n,
+                   (unsigned long long) s->bytes,
+                   (unsigned long long) s->dropped,
+                   s->settled,
+                   !finished ? "storm" : converged ? "converged" : "diverged");
+
+            if (verbose) {
+                unsigned t;
+
+                for (t = 0; t < SIM_MAX; t++)
+                    if (s->messages[t] > 0)
+                        printf("    %-20s %10llu\n", type_names[t], (unsigned long long) s->messages[t]);
+            }
+
+            g_rand_free(s->rand);
+            sim_free(s);
+        }
+    }
+
+    g_free(op);
+
+    return 0;
+}
@@ -0,0 +1,293 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "lassi-state.h"
+#include "lassi-server.h"
+#include "lassi-order.h"
+
+#define LAYOUT_GROUP "Layout"
+#define PEER_GROUP_PREFIX "Peer "
+
+/* Coalesce bursts of changes (e.g. a whole mesh saying Hello) into a single write */
+#define SAVE_DELAY_MSEC 1000
+
+static char *peer_group(const char *id) {
+    const char *c;
+
+    g_assert(id);
+
+    /* Key file group names must not contain brackets or control characters */
+    for (c = id; *c; c++)
+        if (*c == '[' || *c == ']' || (unsigned char) *c < 0x20)
+            return NULL;
+
+    return g_strconcat(PEER_GROUP_PREFIX, id, NULL);
+}
+
+static void state_write(LassiStateInfo *i) {
+    GError *error = NULL;
+    char *data, *dirname;
+    gsize length;
+
+    g_assert(i);
+
+    dirname = g_path_get_dirname(i->filename);
+    g_mkdir_with_parents(dirname, 0700);
+    g_free(dirname);
+
+    data = g_key_file_to_data(i->key_file, &length, NULL);
+
+    /* g_file_set_contents() writes to a temporary file and renames it
+     * into place, so a crash never leaves a half written state behind */
+    if (!g_file_set_contents(i->filename, data, length, &error)) {
+        g_warning("Failed to save state to %s: %s", i->filename, error->message);
+        g_error_free(error);
+    }
+
+    g_free(data);
+}
+
+static gboolean save_cb(gpointer userdata) {
+    LassiStateInfo *i = userdata;
+
+    g_assert(i);
+
+    i->save_id = 0;
+    state_write(i);
+
+    return FALSE;
+}
+
+static void state_changed(LassiStateInfo *i) {
+    g_assert(i);
+
+    if (i->save_id == 0)
+        i->save_id = g_timeout_add(SAVE_DELAY_MSEC, save_cb, i);
+}
+
+int lassi_state_init(LassiStateInfo *i, LassiServer *server) {
+    GError *error = NULL;
+
+    g_assert(i);
+    g_assert(server);
+
+    memset(i, 0, sizeof(*i));
+    i->server = server;
+
+    i->filename = g_build_filename(g_get_user_config_dir(), "mango-lassi", "state", NULL);
+    i->key_file = g_key_file_new();
+
+    if (!g_key_file_load_from_file(i->key_file, i->filename, G_KEY_FILE_NONE, &error)) {
+        g_debug("No saved state loaded from %s: %s", i->filename, error->message);
+        g_error_free(error);
+    }
+
+    return 0;
+}
+
+void lassi_state_done(LassiStateInfo *i) {
+    g_assert(i);
+
+    if (i->save_id > 0) {
+        g_source_remove(i->save_id);
+        state_write(i);
+    }
+
+    if (i->key_file)
+        g_key_file_free(i->key_file);
+
+    g_free(i->filename);
+
+    memset(i, 0, sizeof(*i));
+}
+
+char **lassi_state_get_peers(LassiStateInfo *i) {
+    char **groups, **g;
+    GPtrArray *peers;
+
+    g_assert(i);
+
+    peers = g_ptr_array_new();
+    groups = g_key_file_get_groups(i->key_file, NULL);
+
+    for (g = groups; *g; g++)
+        if (g_str_has_prefix(*g, PEER_GROUP_PREFIX))
+            g_ptr_array_add(peers, g_strdup(*g + strlen(PEER_GROUP_PREFIX)));
+
+    g_strfreev(groups);
+
+    g_ptr_array_add(peers, NULL);
+    return (char**) g_ptr_array_free(peers, FALSE);
+}
+
+char *lassi_state_get_address(LassiStateInfo *i, const char *id) {
+    char *group, *address;
+
+    g_assert(i);
+    g_assert(id);
+
+    if (!(group = peer_group(id)))
+        return NULL;
+
+    address = g_key_file_get_string(i->key_file, group, "Address", NULL);
+    g_free(group);
+
+    return address;
+}
+
+void lassi_state_set_address(LassiStateInfo *i, const char *id, const char *address) {
+    char *group, *old;
+
+    g_assert(i);
+    g_assert(id);
+    g_assert(address);
+
+    if (!(group = peer_group(id)))
+        return;
+
+    old = g_key_file_get_string(i->key_file, group, "Address", NULL);
+
+    if (!old || strcmp(old, address)) {
+        g_key_file_set_string(i->key_file, group, "Address", address);
+        state_changed(i);
+    }
+
+    g_free(old);
+    g_free(group);
+}
+
+gboolean lassi_state_get_capabilities(LassiStateInfo *i, const char *id, guint32 *version, guint32 *capabilities) {
+    char *group;
+    gboolean known;
+
+    g_assert(i);
+    g_assert(id);
+    g_assert(version);
+    g_assert(capabilities);
+
+    if (!(group = peer_group(id)))
+        return FALSE;
+
+    /* What the peer announced in its last Hello, so that we know how to
+     * treat it before it says Hello again */
+    if ((known = g_key_file_has_key(i->key_file, group, "Capabilities", NULL))) {
+        *version = (guint32) g_key_file_get_integer(i->key_file, group, "ProtocolVersion", NULL);
+        *capabilities = (guint32) g_key_file_get_integer(i->key_file, group, "Capabilities", NULL);
+    }
+
+    g_free(group);
+
+    return known;
+}
+
+void lassi_state_set_capabilities(LassiStateInfo *i, const char *id, guint32 version, guint32 capabilities) {
+    char *group;
+
+    g_assert(i);
+    g_assert(id);
+
+    if (!(group = peer_group(id)))
+        return;
+
+    if (!g_key_file_has_key(i->key_file, group, "Capabilities", NULL) ||
+        (guint32) g_key_file_get_integer(i->key_file, group, "ProtocolVersion", NULL) != version ||
+        (guint32) g_key_file_get_integer(i->key_file, group, "Capabilities", NULL) != capabilities) {
+
+        g_key_file_set_integer(i->key_file, group, "ProtocolVersion", (gint) version);
+        g_key_file_set_integer(i->key_file, group, "Capabilities", (gint) capabilities);
+        state_changed(i);
+    }
+
+    g_free(group);
+}
+
+void lassi_state_remove_peer(LassiStateInfo *i, const char *id) {
+    char *group;
+
+    g_assert(i);
+    g_assert(id);
+
+    if (!(group = peer_group(id)))
+        return;
+
+    if (g_key_file_has_group(i->key_file, group)) {
+        g_key_file_remove_group(i->key_file, group, NULL);
+        state_changed(i);
+    }
+
+    g_free(group);
+}
+
+GList *lassi_state_get_order(LassiStateInfo *i) {
+    char **ids;
+    gsize n, j;
+    GList *order = NULL;
+
+    g_assert(i);
+
+    if (!(ids = g_key_file_get_string_list(i->key_file, LAYOUT_GROUP, "Order", &n, NULL)))
+        return NULL;
+
+    for (j = 0; j < n; j++)
+        order = g_list_prepend(order, g_strdup(ids[j]));
+
+    g_strfreev(ids);
+
+    order = g_list_reverse(order);
+
+    if (!lassi_list_nodups(order)) {
+        g_warning("Ignoring saved layout with duplicate entries.");
+        lassi_list_free(order);
+        g_list_free(order);
+        return NULL;
+    }
+
+    return order;
+}
+
+void lassi_state_set_order(LassiStateInfo *i, GList *order) {
+    const char **ids;
+    GList *l;
+    gsize n = 0;
+
+    g_assert(i);
+
+    ids = g_new(const char*, g_list_length(order) + 1);
+
+    for (l = order; l; l = l->next)
+        ids[n++] = l->data;
+
+    ids[n] = NULL;
+
+    g_key_file_set_string_list(i->key_file, LAYOUT_GROUP, "Order", ids, n);
+    g_free(ids);
+
+    state_changed(i);
+}
+
+void lassi_state_get_generations(LassiStateInfo *i, int *active, int *order, int *clipboard, int *primary) {
+    g_assert(i);
+
+    /* Missing keys read as 0, which is what a fresh server starts with anyway */
+    *active = g_key_file_get_integer(i->key_file, LAYOUT_GROUP, "ActiveGeneration", NULL);
+    *order = g_key_file_get_integer(i->key_file, LAYOUT_GROUP, "OrderGeneration", NULL);
+    *clipboard = g_key_file_get_integer(i->key_file, LAYOUT_GROUP, "ClipboardGeneration", NULL);
+    *primary = g_key_file_get_integer(i->key_file, LAYOUT_GROUP, "PrimaryGeneration", NULL);
+}
+
+void lassi_state_set_generations(LassiStateInfo *i, int active, int order, int clipboard, int primary) {
+    g_assert(i);
+
+    g_key_file_set_integer(i->key_file, LAYOUT_GROUP, "ActiveGeneration", active);
+    g_key_file_set_integer(i->key_file, LAYOUT_GROUP, "OrderGeneration", order);
+    g_key_file_set_integer(i->key_file, LAYOUT_GROUP, "ClipboardGeneration", clipboard);
+    g_key_file_set_integer(i->key_file, LAYOUT_GROUP, "PrimaryGeneration", primary);
+
+    state_changed(i);
+}
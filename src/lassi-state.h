@@ -0,0 +1,36 @@
+#ifndef foolassistatehfoo
+#define foolassistatehfoo
+
+#include <glib.h>
+
+typedef struct LassiStateInfo LassiStateInfo;
+struct LassiServer;
+
+struct LassiStateInfo {
+    struct LassiServer *server;
+
+    char *filename;
+    GKeyFile *key_file;
+
+    guint save_id;
+};
+
+#include "lassi-server.h"
+
+int lassi_state_init(LassiStateInfo *i, LassiServer *server);
+void lassi_state_done(LassiStateInfo *i);
+
+char **lassi_state_get_peers(LassiStateInfo *i);
+char *lassi_state_get_address(LassiStateInfo *i, const char *id);
+void lassi_state_set_address(LassiStateInfo *i, const char *id, const char *address);
+void lassi_state_remove_peer(LassiStateInfo *i, const char *id);
+gboolean lassi_state_get_capabilities(LassiStateInfo *i, const char *id, guint32 *version, guint32 *capabilities);
+void lassi_state_set_capabilities(LassiStateInfo *i, const char *id, guint32 version, guint32 capabilities);
+
+GList *lassi_state_get_order(LassiStateInfo *i);
+void lassi_state_set_order(LassiStateInfo *i, GList *order);
+
+void lassi_state_get_generations(LassiStateInfo *i, int *active, int *order, int *clipboard, int *primary);
+void lassi_state_set_generations(LassiStateInfo *i, int active, int order, int clipboard, int primary);
+
+#endif
@@ -0,0 +1,469 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gi18n.h>
+#include <dbus/dbus.h>
+#include <dbus/dbus-glib-lowlevel.h>
+
+#include "lassi-stats.h"
+#include "lassi-server.h"
+
+#define STATS_BUS_NAME "org.gnome.MangoLassi"
+#define STATS_PATH "/org/gnome/MangoLassi/Stats"
+#define STATS_INTERFACE "org.gnome.MangoLassi.Stats"
+
+/* How often we measure round trip times and refresh the tray */
+#define PING_INTERVAL_MSEC 5000
+
+static void append_counter(DBusMessageIter *iter, const char *name, guint64 value) {
+    DBusMessageIter entry;
+    dbus_bool_t b;
+
+    b = dbus_message_iter_open_container(iter, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+    g_assert(b);
+
+    b = dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &name);
+    g_assert(b);
+
+    b = dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT64, &value);
+    g_assert(b);
+
+    b = dbus_message_iter_close_container(iter, &entry);
+    g_assert(b);
+}
+
+static void append_stats(DBusMessageIter *iter, LassiConnection *lc) {
+    DBusMessageIter entry, sub;
+    LassiStats *s = &lc->stats;
+    dbus_bool_t b;
+
+    b = dbus_message_iter_open_container(iter, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+    g_assert(b);
+
+    b = dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &lc->id);
+    g_assert(b);
+
+    b = dbus_message_iter_open_container(&entry, DBUS_TYPE_ARRAY, "{st}", &sub);
+    g_assert(b);
+
+    append_counter(&sub, "MessagesSent", s->messages_sent);
+    append_counter(&sub, "MessagesReceived", s->messages_received);
+    append_counter(&sub, "BytesSent", s->bytes_sent);
+    append_counter(&sub, "BytesReceived", s->bytes_received);
+    append_counter(&sub, "InputSent", s->input_sent);
+    append_counter(&sub, "InputReceived", s->input_received);
+    append_counter(&sub, "Drops", s->drops);
+    append_counter(&sub, "Late", s->late);
+    append_counter(&sub, "QueueDepth", s->queue_depth);
+    append_counter(&sub, "QueueMax", s->queue_max);
+    append_counter(&sub, "RoundTripUsec", s->rtt_usec);
+    append_counter(&sub, "ClipboardTransfers", s->clipboard_transfers);
+    append_counter(&sub, "ClipboardBytes", s->clipboard_bytes);
+    append_counter(&sub, "ClipboardUsec", s->clipboard_usec);
+    append_counter(&sub, "Handoffs", s->handoffs);
+
+    b = dbus_message_iter_close_container(&entry, &sub);
+    g_assert(b);
+
+    b = dbus_message_iter_close_container(iter, &entry);
+    g_assert(b);
+}
+
+static DBusHandlerResult stats_message_function(DBusConnection *c, DBusMessage *m, void *userdata) {
+    LassiStatsInfo *i = userdata;
+    DBusMessage *reply;
+    DBusMessageIter iter, sub;
+    GList *l;
+    dbus_bool_t b;
+
+    g_assert(i);
+
+    if (dbus_message_is_method_call(m, STATS_INTERFACE, "GetMeshStats")) {
+
+        reply = dbus_message_new_method_return(m);
+        g_assert(reply);
+
+        dbus_message_iter_init_append(reply, &iter);
+
+        b = dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{st}", &sub);
+        g_assert(b);
+
+        append_counter(&sub, "Dials", i->dials);
+        append_counter(&sub, "DuplicateConnections", i->duplicates);
+        append_counter(&sub, "MembershipSent", i->membership_sent);
+        append_counter(&sub, "MembershipReceived", i->membership_received);
+        append_counter(&sub, "UpdatesSent", i->updates_sent);
+        append_counter(&sub, "UpdatesApplied", i->updates_applied);
+        append_counter(&sub, "UpdatesIgnored", i->updates_ignored);
+
+        b = dbus_message_iter_close_container(&iter, &sub);
+        g_assert(b);
+
+        dbus_connection_send(c, reply, NULL);
+        dbus_message_unref(reply);
+
+        return DBUS_HANDLER_RESULT_HANDLED;
+    }
+
+    if (!dbus_message_is_method_call(m, STATS_INTERFACE, "GetStats"))
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+    reply = dbus_message_new_method_return(m);
+    g_assert(reply);
+
+    dbus_message_iter_init_append(reply, &iter);
+
+    b = dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sa{st}}", &sub);
+    g_assert(b);
+
+    for (l = i->server->connections; l; l = l->next) {
+        LassiConnection *lc = l->data;
+
+        if (lc->id)
+            append_stats(&sub, lc);
+    }
+
+    b = dbus_message_iter_close_container(&iter, &sub);
+    g_assert(b);
+
+    dbus_connection_send(c, reply, NULL);
+    dbus_message_unref(reply);
+
+    return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static gboolean ping_cb(gpointer userdata) {
+    LassiStatsInfo *i = userdata;
+    GList *l;
+    gint64 now;
+
+    g_assert(i);
+
+    now = lassi_stats_now();
+
+    for (l = i->server->connections; l; l = l->next) {
+        LassiConnection *lc = l->data;
+        DBusMessage *n;
+        dbus_bool_t b;
+
+        if (!lc->id)
+            continue;
+
+        lc->stats.queue_depth = dbus_connection_get_outgoing_size(lc->dbus_connection);
+
+        if (!lassi_connection_has_capability(lc, LASSI_CAPABILITY_PING))
+            continue;
+
+        n = dbus_message_new_signal("/", LASSI_INTERFACE, "Ping");
+        g_assert(n);
+
+        b = dbus_message_append_args(n, DBUS_TYPE_INT64, &now, DBUS_TYPE_INVALID);
+        g_assert(b);
+
+        lassi_connection_send(lc, n);
+        dbus_message_unref(n);
+    }
+
+    lassi_tray_update(&i->server->tray_info, i->server->n_connections);
+
+    return TRUE;
+}
+
+int lassi_stats_init(LassiStatsInfo *i, LassiServer *server) {
+    static const DBusObjectPathVTable vtable = {
+        .message_function = stats_message_function
+    };
+    DBusError e;
+
+    g_assert(i);
+    g_assert(server);
+
+    memset(i, 0, sizeof(*i));
+    i->server = server;
+
+    i->ping_id = g_timeout_add(PING_INTERVAL_MSEC, ping_cb, i);
+
+    dbus_error_init(&e);
+
+    /* Not having a session bus is no reason not to run */
+    if (!(i->bus = dbus_bus_get(DBUS_BUS_SESSION, &e))) {
+        g_debug("Not exporting statistics: %s", e.message);
+        dbus_error_free(&e);
+        return 0;
+    }
+
+    dbus_connection_set_exit_on_disconnect(i->bus, FALSE);
+    dbus_connection_setup_with_g_main(i->bus, NULL);
+
+    if (dbus_bus_request_name(i->bus, STATS_BUS_NAME, DBUS_NAME_FLAG_DO_NOT_QUEUE, &e) != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER) {
+        g_debug("Couldn't acquire %s, another instance running?", STATS_BUS_NAME);
+        dbus_error_free(&e);
+    }
+
+    if (!dbus_connection_register_object_path(i->bus, STATS_PATH, &vtable, i))
+        g_warning("Failed to export statistics.");
+
+    return 0;
+}
+
+void lassi_stats_done(LassiStatsInfo *i) {
+    g_assert(i);
+
+    if (i->ping_id > 0)
+        g_source_remove(i->ping_id);
+
+    if (i->bus) {
+        dbus_connection_unregister_object_path(i->bus, STATS_PATH);
+        dbus_connection_unref(i->bus);
+    }
+
+    memset(i, 0, sizeof(*i));
+}
+
+gint64 lassi_stats_now(void) {
+    GTimeVal tv;
+
+    g_get_current_time(&tv);
+
+    return (gint64) tv.tv_sec * G_USEC_PER_SEC + tv.tv_usec;
+}
+
+static unsigned align(unsigned n, unsigned a) {
+    return (n + a - 1) & ~(a - 1);
+}
+
+static unsigned type_alignment(int t) {
+    switch (t) {
+        case DBUS_TYPE_BYTE:
+        case DBUS_TYPE_SIGNATURE:
+        case DBUS_TYPE_VARIANT:
+            return 1;
+
+        case DBUS_TYPE_INT16:
+        case DBUS_TYPE_UINT16:
+            return 2;
+
+        case DBUS_TYPE_INT64:
+        case DBUS_TYPE_UINT64:
+        case DBUS_TYPE_DOUBLE:
+        case DBUS_TYPE_STRUCT:
+        case DBUS_TYPE_DICT_ENTRY:
+            return 8;
+
+        default:
+            return 4;
+    }
+}
+
+static unsigned body_size(DBusMessageIter *iter, unsigned n) {
+    int t;
+
+    while ((t = dbus_message_iter_get_arg_type(iter)) != DBUS_TYPE_INVALID) {
+        DBusMessageIter sub;
+        const char *s;
+        char *signature;
+        const void *elements;
+        int n_elements, e;
+
+        switch (t) {
+            case DBUS_TYPE_STRING:
+            case DBUS_TYPE_OBJECT_PATH:
+                dbus_message_iter_get_basic(iter, &s);
+                n = align(n, 4) + 4 + strlen(s) + 1;
+                break;
+
+            case DBUS_TYPE_SIGNATURE:
+                dbus_message_iter_get_basic(iter, &s);
+                n += 1 + strlen(s) + 1;
+                break;
+
+            case DBUS_TYPE_ARRAY:
+                e = dbus_message_iter_get_element_type(iter);
+                dbus_message_iter_recurse(iter, &sub);
+                n = align(align(n, 4) + 4, type_alignment(e));
+
+                /* Clipboard data and relayed frames come in one piece */
+                if (e == DBUS_TYPE_BYTE) {
+                    dbus_message_iter_get_fixed_array(&sub, &elements, &n_elements);
+                    n += n_elements;
+                } else
+                    n = body_size(&sub, n);
+                break;
+
+            case DBUS_TYPE_STRUCT:
+            case DBUS_TYPE_DICT_ENTRY:
+                dbus_message_iter_recurse(iter, &sub);
+                n = body_size(&sub, align(n, 8));
+                break;
+
+            case DBUS_TYPE_VARIANT:
+                dbus_message_iter_recurse(iter, &sub);
+                signature = dbus_message_iter_get_signature(&sub);
+                n += 1 + strlen(signature) + 1;
+                dbus_free(signature);
+                n = body_size(&sub, n);
+                break;
+
+            default:
+                /* Fixed size types are as large as they are aligned */
+                n = align(n, type_alignment(t)) + type_alignment(t);
+                break;
+        }
+
+        dbus_message_iter_next(iter);
+    }
+
+    return n;
+}
+
+static unsigned header_field(unsigned n, const char *value, unsigned string_length) {
+    if (!value)
+        return n;
+
+    /* Field code and the signature of the variant, then the value */
+    n = align(n, 8) + 4;
+
+    return align(n, string_length) + string_length + strlen(value) + 1;
+}
+
+/* The size of a message on the wire, without marshalling it. It is
+ * laid out as the specification says, so we can just add up */
+static unsigned message_size(DBusMessage *m) {
+    DBusMessageIter iter;
+    unsigned n;
+
+    g_assert(m);
+
+    /* Endianness, type, flags, version, body length, serial and the
+     * length of the field array */
+    n = 16;
+
+    n = header_field(n, dbus_message_get_path(m), 4);
+    n = header_field(n, dbus_message_get_interface(m), 4);
+    n = header_field(n, dbus_message_get_member(m), 4);
+    n = header_field(n, dbus_message_get_error_name(m), 4);
+    n = header_field(n, dbus_message_get_destination(m), 4);
+    n = header_field(n, dbus_message_get_sender(m), 4);
+
+    /* An empty signature is left out */
+    if (*dbus_message_get_signature(m))
+        n = header_field(n, dbus_message_get_signature(m), 1);
+
+    if (dbus_message_get_reply_serial(m))
+        n = align(n, 8) + 8;
+
+    n = align(n, 8);
+
+    if (dbus_message_iter_init(m, &iter))
+        n = body_size(&iter, n);
+
+    return n;
+}
+
+void lassi_stats_message_sent(LassiStats *s, DBusConnection *c, DBusMessage *m) {
+    g_assert(s);
+    g_assert(c);
+    g_assert(m);
+
+    s->messages_sent++;
+    s->bytes_sent += message_size(m);
+    s->queue_max = MAX(s->queue_max, (guint64) dbus_connection_get_outgoing_size(c));
+}
+
+void lassi_stats_message_received(LassiStats *s, DBusMessage *m) {
+    g_assert(s);
+    g_assert(m);
+
+    s->messages_received++;
+    s->bytes_received += message_size(m);
+}
+
+void lassi_stats_clipboard(LassiStats *s, int bytes, gint64 usec) {
+    g_assert(s);
+
+    s->clipboard_transfers++;
+    s->clipboard_bytes += bytes;
+    s->clipboard_usec += usec;
+}
+
+int lassi_stats_handle_ping(LassiStatsInfo *i, LassiConnection *lc, DBusMessage *m) {
+    DBusError e;
+    DBusMessage *n;
+    gint64 t;
+    dbus_bool_t b;
+
+    g_assert(i);
+    g_assert(lc);
+
+    dbus_error_init(&e);
+
+    if (!dbus_message_get_args(m, &e, DBUS_TYPE_INT64, &t, DBUS_TYPE_INVALID)) {
+        g_warning("Received invalid message: %s", e.message);
+        dbus_error_free(&e);
+        return -1;
+    }
+
+    n = dbus_message_new_signal("/", LASSI_INTERFACE, "Pong");
+    g_assert(n);
+
+    b = dbus_message_append_args(n, DBUS_TYPE_INT64, &t, DBUS_TYPE_INVALID);
+    g_assert(b);
+
+    lassi_connection_send(lc, n);
+    dbus_message_unref(n);
+
+    return 0;
+}
+
+int lassi_stats_handle_pong(LassiStatsInfo *i, LassiConnection *lc, DBusMessage *m) {
+    DBusError e;
+    gint64 t, now;
+
+    g_assert(i);
+    g_assert(lc);
+
+    dbus_error_init(&e);
+
+    if (!dbus_message_get_args(m, &e, DBUS_TYPE_INT64, &t, DBUS_TYPE_INVALID)) {
+        g_warning("Received invalid message: %s", e.message);
+        dbus_error_free(&e);
+        return -1;
+    }
+
+    /* That's our own time stamp coming back, so the clocks of the two
+     * hosts don't need to agree */
+    now = lassi_stats_now();
+    lc->stats.rtt_usec = now > t ? (guint64) (now - t) : 0;
+
+    return 0;
+}
+
+char *lassi_stats_summary(LassiStatsInfo *i) {
+    GString *s;
+    GList *l;
+
+    g_assert(i);
+
+    s = g_string_new(NULL);
+
+    for (l = i->server->connections; l; l = l->next) {
+        LassiConnection *lc = l->data;
+
+        if (!lc->id)
+            continue;
+
+        g_string_append_printf(s, "\n%s: ", lc->id);
+
+        if (lc->stats.rtt_usec > 0)
+            g_string_append_printf(s, _("%.1f ms, "), lc->stats.rtt_usec / 1000.0);
+
+        g_string_append_printf(s, _("%" G_GUINT64_FORMAT " events sent, %" G_GUINT64_FORMAT " received, %" G_GUINT64_FORMAT " dropped"),
+                               lc->stats.input_sent, lc->stats.input_received, lc->stats.drops);
+    }
+
+    return g_string_free(s, FALSE);
+}
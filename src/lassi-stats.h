@@ -0,0 +1,72 @@
+#ifndef foolassistatshfoo
+#define foolassistatshfoo
+
+#include <glib.h>
+#include <dbus/dbus.h>
+
+typedef struct LassiStatsInfo LassiStatsInfo;
+typedef struct LassiStats LassiStats;
+struct LassiServer;
+struct LassiConnection;
+
+/* Counters kept per connection */
+struct LassiStats {
+    guint64 messages_sent, messages_received;
+    guint64 bytes_sent, bytes_received;
+
+    /* Motion, button and key events */
+    guint64 input_sent, input_received;
+
+    /* Input we received but could not inject, and input we held back
+     * for its motion longer than we wanted to */
+    guint64 drops, late;
+
+    /* Bytes waiting in the outgoing queue when we last looked, and the
+     * most we have seen */
+    guint64 queue_depth, queue_max;
+
+    /* Round trip time of the last Ping, 0 if we don't know */
+    guint64 rtt_usec;
+
+    /* Clipboard data we fetched from this peer */
+    guint64 clipboard_transfers, clipboard_bytes, clipboard_usec;
+
+    /* How often the pointer moved over to this peer */
+    guint64 handoffs;
+};
+
+struct LassiStatsInfo {
+    struct LassiServer *server;
+
+    /* Where we export the counters, NULL if there is no session bus */
+    DBusConnection *bus;
+
+    guint ping_id;
+
+    /* What joining the mesh cost us: connections we opened, connections
+     * dropped because both ends dialed, and membership messages */
+    guint64 dials, duplicates;
+    guint64 membership_sent, membership_received;
+
+    /* Grab, order and clipboard updates we sent, and those we received
+     * and applied respectively dropped as outdated or already known */
+    guint64 updates_sent, updates_applied, updates_ignored;
+};
+
+#include "lassi-server.h"
+
+int lassi_stats_init(LassiStatsInfo *i, LassiServer *server);
+void lassi_stats_done(LassiStatsInfo *i);
+
+gint64 lassi_stats_now(void);
+
+void lassi_stats_message_sent(LassiStats *s, DBusConnection *c, DBusMessage *m);
+void lassi_stats_message_received(LassiStats *s, DBusMessage *m);
+void lassi_stats_clipboard(LassiStats *s, int bytes, gint64 usec);
+
+int lassi_stats_handle_ping(LassiStatsInfo *i, LassiConnection *lc, DBusMessage *m);
+int lassi_stats_handle_pong(LassiStatsInfo *i, LassiConnection *lc, DBusMessage *m);
+
+char *lassi_stats_summary(LassiStatsInfo *i);
+
+#endif
@@ -0,0 +1,75 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <stdio.h>
+
+#include <glib.h>
+
+#include "lassi-trace.h"
+
+/* Converts a trace file written by mango-lassi --trace into one line of
+ * text per record: seconds since the first record, delta to the
+ * previous one in microseconds, the trace point and its arguments.
+ * With --summary only the number of records per trace point is shown. */
+
+int main(int argc, char *argv[]) {
+    gboolean summary = FALSE;
+    GOptionEntry entries[] = {
+        {
+            "summary", 's', 0, G_OPTION_ARG_NONE, &summary,
+            "only count the records per trace point", NULL
+        },
+        {NULL, 0, 0, 0, NULL, NULL, NULL}
+    };
+    GOptionContext *context;
+    GError *error = NULL;
+    LassiTraceRecord *records;
+    unsigned j, n, counts[LASSI_TRACE_MAX + 1];
+
+    context = g_option_context_new("FILE - dump a mango-lassi trace");
+    g_option_context_add_main_entries(context, entries, NULL);
+
+    if (!g_option_context_parse(context, &argc, &argv, &error) || argc != 2) {
+        fprintf(stderr, "%s\n", error ? error->message : "Exactly one trace file expected.");
+        g_clear_error(&error);
+        g_option_context_free(context);
+        return 1;
+    }
+
+    g_option_context_free(context);
+
+    if (!(records = lassi_trace_load(argv[1], &n)))
+        return 1;
+
+    memset(counts, 0, sizeof(counts));
+
+    for (j = 0; j < n; j++) {
+        LassiTraceRecord *r = &records[j];
+
+        if (summary) {
+            counts[r->point < LASSI_TRACE_MAX ? r->point : LASSI_TRACE_MAX]++;
+            continue;
+        }
+
+        printf("%12.6f %8llu %-22s %8i %8i %8i\n",
+               (double) (r->usec - records[0].usec) / G_USEC_PER_SEC,
+               (unsigned long long) (j > 0 ? r->usec - records[j-1].usec : 0),
+               lassi_trace_point_name(r->point),
+               r->a, r->b, r->c);
+    }
+
+    if (summary) {
+        for (j = 0; j <= LASSI_TRACE_MAX; j++)
+            if (counts[j] > 0)
+                printf("%-22s %8u\n", lassi_trace_point_name(j), counts[j]);
+
+        if (n > 1)
+            printf("%u records in %.6f s\n", n, (double) (records[n-1].usec - records[0].usec) / G_USEC_PER_SEC);
+    }
+
+    g_free(records);
+
+    return 0;
+}
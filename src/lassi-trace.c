@@ -0,0 +1,237 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#include <glib.h>
+
+#include "lassi-trace.h"
+
+/* A file starts with this magic, followed by the records oldest first,
+ * each one little endian: u64 usec, u32 point, i32 a, i32 b, i32 c */
+#define TRACE_MAGIC "MLTRC001"
+#define TRACE_MAGIC_SIZE 8
+#define TRACE_RECORD_SIZE 24
+
+/* How often we check whether SIGUSR1 asked for a dump */
+#define DUMP_POLL_SEC 1
+
+gboolean lassi_trace_enabled = FALSE;
+
+static char *trace_filename = NULL;
+static LassiTraceRecord *ring = NULL;
+static guint64 ring_head = 0, ring_mask = 0;
+static guint dump_poll_id = 0;
+static volatile sig_atomic_t dump_requested = 0;
+
+static const char * const point_names[LASSI_TRACE_MAX] = {
+    [LASSI_TRACE_FILTER_MOTION] = "filter-motion",
+    [LASSI_TRACE_FILTER_BUTTON] = "filter-button",
+    [LASSI_TRACE_FILTER_KEY] = "filter-key",
+    [LASSI_TRACE_RECENTER] = "recenter",
+    [LASSI_TRACE_SEND_MOTION] = "send-motion",
+    [LASSI_TRACE_SEND_MOTION_ABSOLUTE] = "send-motion-absolute",
+    [LASSI_TRACE_RECV_MOTION] = "recv-motion",
+    [LASSI_TRACE_RECV_MOTION_ABSOLUTE] = "recv-motion-absolute",
+    [LASSI_TRACE_RECV_BUTTON] = "recv-button",
+    [LASSI_TRACE_RECV_KEY] = "recv-key",
+    [LASSI_TRACE_INJECT_BUTTON] = "inject-button",
+    [LASSI_TRACE_INJECT_KEY] = "inject-key"
+};
+
+static void pack(guint8 *b, const LassiTraceRecord *r) {
+    guint64 q;
+    guint32 u;
+
+    q = GUINT64_TO_LE(r->usec);
+    memcpy(b, &q, 8);
+    u = GUINT32_TO_LE(r->point);
+    memcpy(b+8, &u, 4);
+    u = GUINT32_TO_LE((guint32) r->a);
+    memcpy(b+12, &u, 4);
+    u = GUINT32_TO_LE((guint32) r->b);
+    memcpy(b+16, &u, 4);
+    u = GUINT32_TO_LE((guint32) r->c);
+    memcpy(b+20, &u, 4);
+}
+
+static void unpack(LassiTraceRecord *r, const guint8 *b) {
+    guint64 q;
+    guint32 u;
+
+    memcpy(&q, b, 8);
+    r->usec = GUINT64_FROM_LE(q);
+    memcpy(&u, b+8, 4);
+    r->point = GUINT32_FROM_LE(u);
+    memcpy(&u, b+12, 4);
+    r->a = (gint32) GUINT32_FROM_LE(u);
+    memcpy(&u, b+16, 4);
+    r->b = (gint32) GUINT32_FROM_LE(u);
+    memcpy(&u, b+20, 4);
+    r->c = (gint32) GUINT32_FROM_LE(u);
+}
+
+static void sigusr1_handler(int sig) {
+    dump_requested = 1;
+}
+
+static gboolean dump_poll_cb(gpointer userdata) {
+
+    if (dump_requested) {
+        dump_requested = 0;
+        lassi_trace_dump();
+    }
+
+    return TRUE;
+}
+
+int lassi_trace_start(const char *filename, unsigned n_records) {
+    unsigned n = 1;
+
+    g_assert(filename);
+    g_assert(n_records > 0);
+    g_assert(!ring);
+
+    /* Round up to a power of two so that wrapping is a mask */
+    while (n < n_records)
+        n <<= 1;
+
+    ring = g_new0(LassiTraceRecord, n);
+    ring_mask = n - 1;
+    ring_head = 0;
+    trace_filename = g_strdup(filename);
+
+    signal(SIGUSR1, sigusr1_handler);
+    dump_poll_id = g_timeout_add_seconds(DUMP_POLL_SEC, dump_poll_cb, NULL);
+
+    lassi_trace_enabled = TRUE;
+
+    return 0;
+}
+
+void lassi_trace_stop(void) {
+
+    if (!ring)
+        return;
+
+    lassi_trace_enabled = FALSE;
+    lassi_trace_dump();
+
+    signal(SIGUSR1, SIG_DFL);
+
+    if (dump_poll_id > 0)
+        g_source_remove(dump_poll_id);
+
+    g_free(ring);
+    g_free(trace_filename);
+
+    ring = NULL;
+    trace_filename = NULL;
+    ring_head = ring_mask = 0;
+    dump_poll_id = 0;
+}
+
+void lassi_trace_record(LassiTracePoint point, gint32 a, gint32 b, gint32 c) {
+    LassiTraceRecord *r;
+    struct timespec ts;
+
+    g_assert(ring);
+
+    /* No allocation, no formatting: the older records are simply
+     * overwritten once the ring is full */
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    r = &ring[ring_head++ & ring_mask];
+    r->usec = (guint64) ts.tv_sec * G_USEC_PER_SEC + (guint64) ts.tv_nsec / 1000;
+    r->point = point;
+    r->a = a;
+    r->b = b;
+    r->c = c;
+}
+
+int lassi_trace_dump(void) {
+    FILE *f;
+    guint64 j, first;
+    guint8 b[TRACE_RECORD_SIZE];
+    int r = -1;
+
+    g_assert(ring);
+
+    if (!(f = fopen(trace_filename, "wb"))) {
+        g_warning("Failed to open trace file %s: %s", trace_filename, g_strerror(errno));
+        return -1;
+    }
+
+    if (fwrite(TRACE_MAGIC, TRACE_MAGIC_SIZE, 1, f) != 1)
+        goto finish;
+
+    first = ring_head > ring_mask + 1 ? ring_head - ring_mask - 1 : 0;
+
+    for (j = first; j < ring_head; j++) {
+        pack(b, &ring[j & ring_mask]);
+
+        if (fwrite(b, sizeof(b), 1, f) != 1)
+            goto finish;
+    }
+
+    g_debug("Dumped %u trace records to %s", (unsigned) (ring_head - first), trace_filename);
+    r = 0;
+
+finish:
+
+    if (r < 0)
+        g_warning("Failed to write trace file %s: %s", trace_filename, g_strerror(errno));
+
+    fclose(f);
+
+    return r;
+}
+
+LassiTraceRecord *lassi_trace_load(const char *filename, unsigned *n_records) {
+    GError *error = NULL;
+    LassiTraceRecord *records;
+    char *data;
+    gsize length;
+    unsigned j, n;
+
+    g_assert(filename);
+    g_assert(n_records);
+
+    if (!g_file_get_contents(filename, &data, &length, &error)) {
+        g_warning("Failed to read trace file %s: %s", filename, error->message);
+        g_error_free(error);
+        return NULL;
+    }
+
+    if (length < TRACE_MAGIC_SIZE ||
+        memcmp(data, TRACE_MAGIC, TRACE_MAGIC_SIZE) ||
+        (length - TRACE_MAGIC_SIZE) % TRACE_RECORD_SIZE) {
+        g_warning("%s is not a trace file.", filename);
+        g_free(data);
+        return NULL;
+    }
+
+    n = (length - TRACE_MAGIC_SIZE) / TRACE_RECORD_SIZE;
+    records = g_new(LassiTraceRecord, n > 0 ? n : 1);
+
+    for (j = 0; j < n; j++)
+        unpack(&records[j], (guint8*) data + TRACE_MAGIC_SIZE + j * TRACE_RECORD_SIZE);
+
+    g_free(data);
+
+    *n_records = n;
+    return records;
+}
+
+const char *lassi_trace_point_name(guint32 point) {
+
+    if (point >= LASSI_TRACE_MAX)
+        return "unknown";
+
+    return point_names[point];
+}
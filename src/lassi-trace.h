@@ -0,0 +1,54 @@
+#ifndef foolassitracehfoo
+#define foolassitracehfoo
+
+#include <glib.h>
+
+typedef struct LassiTraceRecord LassiTraceRecord;
+
+/* Append new points at the end, the numbers end up in trace files */
+typedef enum LassiTracePoint {
+    LASSI_TRACE_FILTER_MOTION,      /* x, y */
+    LASSI_TRACE_FILTER_BUTTON,      /* button, is_press */
+    LASSI_TRACE_FILTER_KEY,         /* keysym, is_press */
+    LASSI_TRACE_RECENTER,           /* x, y */
+    LASSI_TRACE_SEND_MOTION,        /* dx, dy, serial */
+    LASSI_TRACE_SEND_MOTION_ABSOLUTE, /* x, y, serial */
+    LASSI_TRACE_RECV_MOTION,        /* dx, dy, serial */
+    LASSI_TRACE_RECV_MOTION_ABSOLUTE, /* x, y, serial */
+    LASSI_TRACE_RECV_BUTTON,        /* button, is_press, serial */
+    LASSI_TRACE_RECV_KEY,           /* keysym, is_press, serial */
+    LASSI_TRACE_INJECT_BUTTON,      /* button, is_press, forced */
+    LASSI_TRACE_INJECT_KEY,         /* keysym, is_press, forced */
+    LASSI_TRACE_MAX
+} LassiTracePoint;
+
+struct LassiTraceRecord {
+    guint64 usec;
+    guint32 point;
+    gint32 a, b, c;
+};
+
+/* Trace points cost nothing unless configured with --enable-tracing,
+ * and a single predictable branch unless started with --trace */
+#ifdef LASSI_TRACING
+extern gboolean lassi_trace_enabled;
+
+#define lassi_trace(point, a, b, c)                                     \
+    do {                                                                \
+        if (G_UNLIKELY(lassi_trace_enabled))                            \
+            lassi_trace_record((point), (gint32) (a), (gint32) (b), (gint32) (c)); \
+    } while (0)
+#else
+#define lassi_trace(point, a, b, c) do { } while (0)
+#endif
+
+int lassi_trace_start(const char *filename, unsigned n_records);
+void lassi_trace_stop(void);
+
+void lassi_trace_record(LassiTracePoint point, gint32 a, gint32 b, gint32 c);
+int lassi_trace_dump(void);
+
+LassiTraceRecord *lassi_trace_load(const char *filename, unsigned *n_records);
+const char *lassi_trace_point_name(guint32 point);
+
+#endif
@@ -124,6 +124,17 @@ void lassi_tray_update(LassiTrayInfo *i, int n_connected) {
     else
         t = g_strdup_printf("%i desktops connected.", n_connected);
 
+    if (n_connected > 0) {
+        char *s, *u;
+
+        /* Enough to spot a slow peer without digging through logs */
+        s = lassi_stats_summary(&i->server->stats_info);
+        u = g_strconcat(t, s, NULL);
+        g_free(s);
+        g_free(t);
+        t = u;
+    }
+
     gtk_status_icon_set_tooltip_text(i->status_icon, t);
 
     g_free(t);
@@ -0,0 +1,273 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include <linux/input.h>
+#include <linux/uinput.h>
+
+#include <glib.h>
+
+#include "lassi-uinput.h"
+
+#define DEVICE "/dev/uinput"
+
+/* The evdev driver numbers X keycodes like the kernel, plus 8 */
+#define X_KEYCODE_OFFSET 8
+
+#define ABS_RANGE 0xFFFF
+
+/* One detent of a wheel in high resolution units */
+#define WHEEL_HI_RES 120
+
+/* The most events a single frame takes, not counting SYN_REPORT */
+#define MAX_FRAME 2
+
+static int create_device(const char *name, gboolean absolute) {
+    struct uinput_user_dev dev;
+    int fd, k;
+
+    if ((fd = open(DEVICE, O_WRONLY|O_NONBLOCK)) < 0) {
+        g_warning("Failed to open %s: %s", DEVICE, g_strerror(errno));
+        return -1;
+    }
+
+    if (ioctl(fd, UI_SET_EVBIT, EV_SYN) < 0 ||
+        ioctl(fd, UI_SET_EVBIT, EV_KEY) < 0)
+        goto fail;
+
+    memset(&dev, 0, sizeof(dev));
+    snprintf(dev.name, UINPUT_MAX_NAME_SIZE, "%s", name);
+    dev.id.bustype = BUS_VIRTUAL;
+    dev.id.version = 1;
+
+    if (absolute) {
+
+        /* Without a button the X server won't take it for a pointer */
+        if (ioctl(fd, UI_SET_EVBIT, EV_ABS) < 0 ||
+            ioctl(fd, UI_SET_ABSBIT, ABS_X) < 0 ||
+            ioctl(fd, UI_SET_ABSBIT, ABS_Y) < 0 ||
+            ioctl(fd, UI_SET_KEYBIT, BTN_LEFT) < 0)
+            goto fail;
+
+        dev.absmax[ABS_X] = dev.absmax[ABS_Y] = ABS_RANGE;
+
+    } else {
+
+        if (ioctl(fd, UI_SET_EVBIT, EV_REL) < 0 ||
+            ioctl(fd, UI_SET_RELBIT, REL_X) < 0 ||
+            ioctl(fd, UI_SET_RELBIT, REL_Y) < 0 ||
+            ioctl(fd, UI_SET_RELBIT, REL_WHEEL) < 0 ||
+            ioctl(fd, UI_SET_RELBIT, REL_HWHEEL) < 0)
+            goto fail;
+
+#ifdef REL_WHEEL_HI_RES
+        if (ioctl(fd, UI_SET_RELBIT, REL_WHEEL_HI_RES) < 0 ||
+            ioctl(fd, UI_SET_RELBIT, REL_HWHEEL_HI_RES) < 0)
+            goto fail;
+#endif
+
+        /* Everything a keyboard can have, and the mouse buttons */
+        for (k = KEY_ESC; k <= KEY_MICMUTE; k++)
+            if (ioctl(fd, UI_SET_KEYBIT, k) < 0)
+                goto fail;
+
+        for (k = BTN_LEFT; k <= BTN_TASK; k++)
+            if (ioctl(fd, UI_SET_KEYBIT, k) < 0)
+                goto fail;
+    }
+
+    if (write(fd, &dev, sizeof(dev)) != sizeof(dev) ||
+        ioctl(fd, UI_DEV_CREATE) < 0)
+        goto fail;
+
+    g_debug("Created uinput device %s", name);
+
+    return fd;
+
+fail:
+    g_warning("Failed to set up uinput device %s: %s", name, g_strerror(errno));
+    close(fd);
+    return -1;
+}
+
+static void destroy_device(int fd) {
+
+    if (fd < 0)
+        return;
+
+    ioctl(fd, UI_DEV_DESTROY);
+    close(fd);
+}
+
+static void set_event(struct input_event *e, guint16 type, guint16 code, gint32 value) {
+    g_assert(e);
+
+    memset(e, 0, sizeof(*e));
+    e->type = type;
+    e->code = code;
+    e->value = value;
+}
+
+static int write_frame(int fd, struct input_event *events, unsigned n) {
+    ssize_t size;
+
+    g_assert(events);
+
+    if (fd < 0)
+        return -1;
+
+    if (n == 0)
+        return 0;
+
+    /* Everything in one write, the kernel passes the frame on at the
+     * SYN_REPORT. events has to have room for it. */
+    set_event(&events[n], EV_SYN, SYN_REPORT, 0);
+    size = (ssize_t) ((n + 1) * sizeof(struct input_event));
+
+    if (write(fd, events, size) != size) {
+        g_debug("Failed to write to uinput device: %s", g_strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+int lassi_uinput_init(LassiUinputInfo *i, LassiServer *server) {
+    g_assert(i);
+    g_assert(server);
+
+    memset(i, 0, sizeof(*i));
+    i->server = server;
+    i->fd = i->abs_fd = -1;
+
+    return 0;
+}
+
+void lassi_uinput_done(LassiUinputInfo *i) {
+    g_assert(i);
+
+    /* Never initialized, fd 0 isn't ours */
+    if (!i->server)
+        return;
+
+    destroy_device(i->fd);
+    destroy_device(i->abs_fd);
+
+    memset(i, 0, sizeof(*i));
+    i->fd = i->abs_fd = -1;
+}
+
+int lassi_uinput_open(LassiUinputInfo *i) {
+    g_assert(i);
+    g_assert(i->fd < 0);
+
+    if ((i->fd = create_device("Mango Lassi", FALSE)) < 0)
+        return -1;
+
+    if ((i->abs_fd = create_device("Mango Lassi Absolute", TRUE)) < 0) {
+        destroy_device(i->fd);
+        i->fd = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+gboolean lassi_uinput_is_open(LassiUinputInfo *i) {
+    g_assert(i);
+
+    return i->fd >= 0;
+}
+
+int lassi_uinput_move_pointer_relative(LassiUinputInfo *i, int dx, int dy) {
+    struct input_event events[MAX_FRAME+1];
+    unsigned n = 0;
+
+    g_assert(i);
+
+    if (dx != 0)
+        set_event(&events[n++], EV_REL, REL_X, dx);
+
+    if (dy != 0)
+        set_event(&events[n++], EV_REL, REL_Y, dy);
+
+    return write_frame(i->fd, events, n);
+}
+
+int lassi_uinput_move_pointer_absolute(LassiUinputInfo *i, int x, int y, int width, int height) {
+    struct input_event events[MAX_FRAME+1];
+
+    g_assert(i);
+
+    /* The X server maps the whole range onto the screen */
+    set_event(&events[0], EV_ABS, ABS_X, width > 1 ? (gint32) ((gint64) x * ABS_RANGE / (width - 1)) : 0);
+    set_event(&events[1], EV_ABS, ABS_Y, height > 1 ? (gint32) ((gint64) y * ABS_RANGE / (height - 1)) : 0);
+
+    return write_frame(i->abs_fd, events, 2);
+}
+
+int lassi_uinput_press_button(LassiUinputInfo *i, unsigned button, gboolean is_press) {
+    struct input_event events[MAX_FRAME+1];
+    unsigned n = 0;
+    gint32 detents = 0;
+    guint16 code = 0;
+
+    g_assert(i);
+
+    switch (button) {
+        case 1: code = BTN_LEFT; break;
+        case 2: code = BTN_MIDDLE; break;
+        case 3: code = BTN_RIGHT; break;
+        case 8: code = BTN_SIDE; break;
+        case 9: code = BTN_EXTRA; break;
+
+        /* X turns wheels into buttons, turn them back */
+        case 4: code = REL_WHEEL; detents = 1; break;
+        case 5: code = REL_WHEEL; detents = -1; break;
+        case 6: code = REL_HWHEEL; detents = -1; break;
+        case 7: code = REL_HWHEEL; detents = 1; break;
+
+        default:
+            g_debug("Can't press button %u through uinput", button);
+            return -1;
+    }
+
+    if (detents == 0) {
+        set_event(&events[n++], EV_KEY, code, is_press);
+        return write_frame(i->fd, events, n);
+    }
+
+    /* A detent is a press and a release, only one of them scrolls */
+    if (!is_press)
+        return 0;
+
+    set_event(&events[n++], EV_REL, code, detents);
+
+#ifdef REL_WHEEL_HI_RES
+    set_event(&events[n++], EV_REL, code == REL_WHEEL ? REL_WHEEL_HI_RES : REL_HWHEEL_HI_RES, detents * WHEEL_HI_RES);
+#endif
+
+    return write_frame(i->fd, events, n);
+}
+
+int lassi_uinput_press_key(LassiUinputInfo *i, unsigned keycode, gboolean is_press) {
+    struct input_event events[MAX_FRAME+1];
+
+    g_assert(i);
+
+    if (keycode < X_KEYCODE_OFFSET) {
+        g_debug("No kernel key code for X keycode %u", keycode);
+        return -1;
+    }
+
+    set_event(&events[0], EV_KEY, (guint16) (keycode - X_KEYCODE_OFFSET), is_press);
+
+    return write_frame(i->fd, events, 1);
+}
@@ -0,0 +1,35 @@
+#ifndef foolassiuinputhfoo
+#define foolassiuinputhfoo
+
+#include <glib.h>
+
+typedef struct LassiUinputInfo LassiUinputInfo;
+struct LassiServer;
+
+/* Virtual input devices in the kernel, as an alternative to XTest. The
+ * X server picks them up like any other hotplugged device */
+struct LassiUinputInfo {
+    struct LassiServer *server;
+
+    /* Keys, buttons, relative motion and wheels */
+    int fd;
+
+    /* Absolute motion needs a device of its own, or it would be taken
+     * for a touchpad */
+    int abs_fd;
+};
+
+#include "lassi-server.h"
+
+int lassi_uinput_init(LassiUinputInfo *i, LassiServer *server);
+void lassi_uinput_done(LassiUinputInfo *i);
+
+int lassi_uinput_open(LassiUinputInfo *i);
+gboolean lassi_uinput_is_open(LassiUinputInfo *i);
+
+int lassi_uinput_move_pointer_relative(LassiUinputInfo *i, int dx, int dy);
+int lassi_uinput_move_pointer_absolute(LassiUinputInfo *i, int x, int y, int width, int height);
+int lassi_uinput_press_button(LassiUinputInfo *i, unsigned button, gboolean is_press);
+int lassi_uinput_press_key(LassiUinputInfo *i, unsigned keycode, gboolean is_press);
+
+#endif
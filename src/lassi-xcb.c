@@ -0,0 +1,429 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <stdlib.h>
+
+#include <glib.h>
+
+#include <xcb/xcb.h>
+#include <xcb/xcbext.h>
+#include <xcb/xtest.h>
+
+#include "lassi-xcb.h"
+
+static void request_mapping(LassiXcbInfo *i) {
+    g_assert(i);
+
+    if (i->mapping_pending)
+        xcb_discard_reply(i->connection, i->mapping_cookie.sequence);
+
+    i->mapping_cookie = xcb_get_keyboard_mapping(i->connection, i->min_keycode, i->max_keycode - i->min_keycode + 1);
+    i->mapping_pending = TRUE;
+}
+
+static gboolean poll_reply(LassiXcbInfo *i, unsigned int sequence, void **reply) {
+    xcb_generic_error_t *e = NULL;
+
+    *reply = NULL;
+
+    if (!xcb_poll_for_reply(i->connection, sequence, reply, &e))
+        return FALSE;
+
+    if (e) {
+        g_debug("X request %u failed with error %u", sequence, e->error_code);
+        free(e);
+    }
+
+    return TRUE;
+}
+
+static gboolean poll_grab_reply(LassiXcbInfo *i, unsigned int sequence) {
+    xcb_grab_pointer_reply_t *r;
+    void *reply;
+
+    /* Pointer and keyboard grab replies look the same */
+    if (!poll_reply(i, sequence, &reply))
+        return FALSE;
+
+    r = reply;
+
+    if (!r || r->status != XCB_GRAB_STATUS_SUCCESS) {
+        g_debug("Grab failed: %u", r ? r->status : 0);
+        i->grab_failed = TRUE;
+    }
+
+    free(r);
+
+    return TRUE;
+}
+
+static void check_replies(LassiXcbInfo *i) {
+    void *reply;
+
+    g_assert(i);
+
+    if (i->mapping_pending && poll_reply(i, i->mapping_cookie.sequence, &reply)) {
+        xcb_get_keyboard_mapping_reply_t *r = reply;
+
+        i->mapping_pending = FALSE;
+
+        if (r) {
+            g_free(i->keysyms);
+            i->keysyms = g_memdup(xcb_get_keyboard_mapping_keysyms(r),
+                                  xcb_get_keyboard_mapping_keysyms_length(r) * sizeof(xcb_keysym_t));
+            i->keysyms_per_keycode = r->keysyms_per_keycode;
+
+            free(r);
+        }
+    }
+
+    if (i->pointer_pending && poll_grab_reply(i, i->pointer_cookie.sequence))
+        i->pointer_pending = FALSE;
+
+    if (i->keyboard_pending && poll_grab_reply(i, i->keyboard_cookie.sequence))
+        i->keyboard_pending = FALSE;
+}
+
+/* Takes care of what nobody else needs to see */
+static xcb_generic_event_t *filter_event(LassiXcbInfo *i, xcb_generic_event_t *e) {
+    g_assert(i);
+    g_assert(e);
+
+    if (e->response_type == 0) {
+        g_debug("X error %u", ((xcb_generic_error_t*) e)->error_code);
+        free(e);
+        return NULL;
+    }
+
+    if ((e->response_type & 0x7f) == XCB_MAPPING_NOTIFY) {
+
+        if (((xcb_mapping_notify_event_t*) e)->request != XCB_MAPPING_POINTER) {
+            request_mapping(i);
+            xcb_flush(i->connection);
+        }
+
+        free(e);
+        return NULL;
+    }
+
+    return e;
+}
+
+static xcb_generic_event_t *read_event(LassiXcbInfo *i) {
+    xcb_generic_event_t *e;
+
+    g_assert(i);
+
+    for (;;) {
+        e = xcb_poll_for_event(i->connection);
+
+        /* Reading events might have brought in replies, too */
+        check_replies(i);
+
+        if (!e)
+            return NULL;
+
+        if ((e = filter_event(i, e)))
+            return e;
+    }
+}
+
+typedef struct XcbSource {
+    GSource source;
+    GPollFD poll_fd;
+    LassiXcbInfo *info;
+} XcbSource;
+
+static gboolean has_pending(LassiXcbInfo *i) {
+    xcb_generic_event_t *e;
+
+    g_assert(i);
+
+    if (!g_queue_is_empty(i->events))
+        return TRUE;
+
+    /* Events that were read off the socket along with something else
+     * won't make poll() wake us up */
+    while ((e = xcb_poll_for_queued_event(i->connection)))
+        if ((e = filter_event(i, e))) {
+            g_queue_push_tail(i->events, e);
+            return TRUE;
+        }
+
+    return FALSE;
+}
+
+static gboolean source_prepare(GSource *source, gint *timeout) {
+    *timeout = -1;
+
+    return has_pending(((XcbSource*) source)->info);
+}
+
+static gboolean source_check(GSource *source) {
+    XcbSource *s = (XcbSource*) source;
+
+    return (s->poll_fd.revents & (G_IO_IN|G_IO_HUP|G_IO_ERR)) || has_pending(s->info);
+}
+
+static gboolean source_dispatch(GSource *source, GSourceFunc callback, gpointer userdata) {
+    g_assert(callback);
+
+    return callback(userdata);
+}
+
+static GSourceFuncs source_funcs = {
+    source_prepare,
+    source_check,
+    source_dispatch,
+    NULL,
+    NULL,
+    NULL
+};
+
+int lassi_xcb_init(LassiXcbInfo *i, const char *display_name) {
+    const xcb_query_extension_reply_t *ext;
+    const xcb_setup_t *setup;
+    xcb_screen_iterator_t it;
+    int screen;
+
+    g_assert(i);
+
+    memset(i, 0, sizeof(*i));
+    i->events = g_queue_new();
+
+    i->connection = xcb_connect(display_name, &screen);
+
+    if (xcb_connection_has_error(i->connection)) {
+        g_warning("Failed to open a second connection to %s.", display_name);
+        goto fail;
+    }
+
+    /* The only round trip we ever wait for */
+    ext = xcb_get_extension_data(i->connection, &xcb_test_id);
+
+    if (!ext || !ext->present) {
+        g_warning("XTest extension not supported.");
+        goto fail;
+    }
+
+    setup = xcb_get_setup(i->connection);
+
+    for (it = xcb_setup_roots_iterator(setup); screen > 0 && it.rem > 1; screen--)
+        xcb_screen_next(&it);
+
+    i->root = it.data->root;
+    i->min_keycode = setup->min_keycode;
+    i->max_keycode = setup->max_keycode;
+
+    request_mapping(i);
+    xcb_flush(i->connection);
+
+    return 0;
+
+fail:
+    lassi_xcb_done(i);
+    return -1;
+}
+
+void lassi_xcb_done(LassiXcbInfo *i) {
+    xcb_generic_event_t *e;
+
+    g_assert(i);
+
+    if (i->events) {
+        while ((e = g_queue_pop_head(i->events)))
+            free(e);
+
+        g_queue_free(i->events);
+    }
+
+    if (i->connection)
+        xcb_disconnect(i->connection);
+
+    g_free(i->keysyms);
+
+    memset(i, 0, sizeof(*i));
+}
+
+guint lassi_xcb_add_watch(LassiXcbInfo *i, GSourceFunc func, gpointer userdata) {
+    XcbSource *s;
+    guint id;
+
+    g_assert(i);
+    g_assert(func);
+
+    s = (XcbSource*) g_source_new(&source_funcs, sizeof(XcbSource));
+    s->info = i;
+    s->poll_fd.fd = xcb_get_file_descriptor(i->connection);
+    s->poll_fd.events = G_IO_IN|G_IO_HUP|G_IO_ERR;
+
+    g_source_add_poll(&s->source, &s->poll_fd);
+    g_source_set_callback(&s->source, func, userdata, NULL);
+
+    id = g_source_attach(&s->source, NULL);
+    g_source_unref(&s->source);
+
+    return id;
+}
+
+xcb_generic_event_t *lassi_xcb_poll_event(LassiXcbInfo *i) {
+    xcb_generic_event_t *e;
+
+    g_assert(i);
+
+    if ((e = g_queue_pop_head(i->events)))
+        return e;
+
+    return read_event(i);
+}
+
+xcb_generic_event_t *lassi_xcb_poll_motion(LassiXcbInfo *i) {
+    xcb_generic_event_t *e;
+    GList *l;
+
+    g_assert(i);
+
+    /* Like XCheckTypedEvent(): the first motion event, wherever it is
+     * in the queue, everything else stays queued */
+    for (l = i->events->head; l; l = l->next) {
+        e = l->data;
+
+        if ((e->response_type & 0x7f) == XCB_MOTION_NOTIFY) {
+            g_queue_delete_link(i->events, l);
+            return e;
+        }
+    }
+
+    while ((e = read_event(i))) {
+
+        if ((e->response_type & 0x7f) == XCB_MOTION_NOTIFY)
+            return e;
+
+        g_queue_push_tail(i->events, e);
+    }
+
+    return NULL;
+}
+
+void lassi_xcb_drop_motion(LassiXcbInfo *i) {
+    xcb_generic_event_t *e;
+
+    g_assert(i);
+
+    while ((e = lassi_xcb_poll_motion(i)))
+        free(e);
+}
+
+void lassi_xcb_grab(LassiXcbInfo *i, xcb_window_t w, xcb_cursor_t cursor) {
+    g_assert(i);
+
+    /* We own no windows on this connection, so everything is reported
+     * relative to the grab window */
+    i->pointer_cookie = xcb_grab_pointer(i->connection, FALSE, w,
+                                         XCB_EVENT_MASK_POINTER_MOTION|
+                                         XCB_EVENT_MASK_BUTTON_PRESS|XCB_EVENT_MASK_BUTTON_RELEASE|
+                                         XCB_EVENT_MASK_ENTER_WINDOW,
+                                         XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC,
+                                         XCB_NONE, cursor, XCB_CURRENT_TIME);
+
+    i->keyboard_cookie = xcb_grab_keyboard(i->connection, FALSE, w, XCB_CURRENT_TIME,
+                                           XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC);
+
+    i->pointer_pending = i->keyboard_pending = TRUE;
+    i->grab_failed = FALSE;
+
+    xcb_flush(i->connection);
+}
+
+void lassi_xcb_ungrab(LassiXcbInfo *i) {
+    g_assert(i);
+
+    if (i->pointer_pending)
+        xcb_discard_reply(i->connection, i->pointer_cookie.sequence);
+
+    if (i->keyboard_pending)
+        xcb_discard_reply(i->connection, i->keyboard_cookie.sequence);
+
+    i->pointer_pending = i->keyboard_pending = i->grab_failed = FALSE;
+
+    xcb_ungrab_keyboard(i->connection, XCB_CURRENT_TIME);
+    xcb_ungrab_pointer(i->connection, XCB_CURRENT_TIME);
+    xcb_flush(i->connection);
+}
+
+void lassi_xcb_grab_control(LassiXcbInfo *i, gboolean impervious) {
+    g_assert(i);
+
+    xcb_test_grab_control(i->connection, impervious);
+    xcb_flush(i->connection);
+}
+
+void lassi_xcb_warp_pointer(LassiXcbInfo *i, int x, int y) {
+    g_assert(i);
+
+    xcb_warp_pointer(i->connection, XCB_NONE, i->root, 0, 0, 0, 0, (int16_t) x, (int16_t) y);
+    xcb_flush(i->connection);
+}
+
+void lassi_xcb_fake_motion(LassiXcbInfo *i, gboolean relative, int x, int y) {
+    g_assert(i);
+
+    /* Just what XTestFakeRelativeMotionEvent() and XTestFakeMotionEvent()
+     * send, minus the XSync() */
+    xcb_test_fake_input(i->connection, XCB_MOTION_NOTIFY, relative, XCB_CURRENT_TIME,
+                        relative ? XCB_NONE : i->root, (int16_t) x, (int16_t) y, 0);
+    xcb_flush(i->connection);
+}
+
+void lassi_xcb_fake_button(LassiXcbInfo *i, unsigned button, gboolean is_press) {
+    g_assert(i);
+
+    xcb_test_fake_input(i->connection, is_press ? XCB_BUTTON_PRESS : XCB_BUTTON_RELEASE, (uint8_t) button,
+                        XCB_CURRENT_TIME, XCB_NONE, 0, 0, 0);
+    xcb_flush(i->connection);
+}
+
+static xcb_keycode_t keysym_to_keycode(LassiXcbInfo *i, unsigned keysym) {
+    unsigned n, col, k;
+
+    g_assert(i);
+
+    if (!i->keysyms)
+        return 0;
+
+    n = i->max_keycode - i->min_keycode + 1;
+
+    /* Same search order as XKeysymToKeycode() */
+    for (col = 0; col < i->keysyms_per_keycode; col++)
+        for (k = 0; k < n; k++)
+            if (i->keysyms[k * i->keysyms_per_keycode + col] == keysym)
+                return (xcb_keycode_t) (i->min_keycode + k);
+
+    return 0;
+}
+
+void lassi_xcb_fake_key(LassiXcbInfo *i, unsigned keysym, gboolean is_press) {
+    xcb_keycode_t keycode;
+
+    g_assert(i);
+
+    if (!(keycode = keysym_to_keycode(i, keysym))) {
+        g_debug("No keycode for keysym 0x%x%s", keysym, i->keysyms ? "" : ", keyboard mapping not known yet");
+        return;
+    }
+
+    xcb_test_fake_input(i->connection, is_press ? XCB_KEY_PRESS : XCB_KEY_RELEASE, keycode,
+                        XCB_CURRENT_TIME, XCB_NONE, 0, 0, 0);
+    xcb_flush(i->connection);
+}
+
+unsigned lassi_xcb_keycode_to_keysym(LassiXcbInfo *i, xcb_keycode_t keycode) {
+    g_assert(i);
+
+    if (!i->keysyms || keycode < i->min_keycode || keycode > i->max_keycode)
+        return 0;
+
+    return i->keysyms[(keycode - i->min_keycode) * i->keysyms_per_keycode];
+}
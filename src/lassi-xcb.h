@@ -0,0 +1,54 @@
+#ifndef foolassixcbhfoo
+#define foolassixcbhfoo
+
+#include <glib.h>
+#include <xcb/xcb.h>
+
+typedef struct LassiXcbInfo LassiXcbInfo;
+
+/* A connection of our own for grabbing and injecting input. Nothing on
+ * it waits for a reply: requests are flushed right away, and replies
+ * are picked up once they are there while polling for events. GTK's
+ * connection is left to GTK. */
+struct LassiXcbInfo {
+    xcb_connection_t *connection;
+    xcb_window_t root;
+
+    /* Column 0 is what XKeycodeToKeysym(..., 0) returns */
+    xcb_keycode_t min_keycode, max_keycode;
+    guint8 keysyms_per_keycode;
+    xcb_keysym_t *keysyms;
+
+    gboolean mapping_pending;
+    xcb_get_keyboard_mapping_cookie_t mapping_cookie;
+
+    gboolean pointer_pending, keyboard_pending, grab_failed;
+    xcb_grab_pointer_cookie_t pointer_cookie;
+    xcb_grab_keyboard_cookie_t keyboard_cookie;
+
+    /* Events read while looking for motion */
+    GQueue *events;
+};
+
+int lassi_xcb_init(LassiXcbInfo *i, const char *display_name);
+void lassi_xcb_done(LassiXcbInfo *i);
+
+/* Calls func whenever there are events to poll, including those that
+ * were read or put aside while looking for something else */
+guint lassi_xcb_add_watch(LassiXcbInfo *i, GSourceFunc func, gpointer userdata);
+xcb_generic_event_t *lassi_xcb_poll_event(LassiXcbInfo *i);
+xcb_generic_event_t *lassi_xcb_poll_motion(LassiXcbInfo *i);
+void lassi_xcb_drop_motion(LassiXcbInfo *i);
+
+void lassi_xcb_grab(LassiXcbInfo *i, xcb_window_t w, xcb_cursor_t cursor);
+void lassi_xcb_ungrab(LassiXcbInfo *i);
+void lassi_xcb_grab_control(LassiXcbInfo *i, gboolean impervious);
+void lassi_xcb_warp_pointer(LassiXcbInfo *i, int x, int y);
+
+void lassi_xcb_fake_motion(LassiXcbInfo *i, gboolean relative, int x, int y);
+void lassi_xcb_fake_button(LassiXcbInfo *i, unsigned button, gboolean is_press);
+void lassi_xcb_fake_key(LassiXcbInfo *i, unsigned keysym, gboolean is_press);
+
+unsigned lassi_xcb_keycode_to_keysym(LassiXcbInfo *i, xcb_keycode_t keycode);
+
+#endif